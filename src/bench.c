@@ -0,0 +1,121 @@
+/* Copyright (C) 2013 Eric P. Hutchins */
+
+/* This file is part of libcasheph. */
+
+/* libcasheph is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* libcasheph is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with libcasheph.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Timestamp formatting throughput: localtime and strftime, as saving
+   used to do, against casheph_format_ts with and without its cache, for
+   dates in order and shuffled. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "casheph.h"
+
+double
+now ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+report (const char *name, int n, double secs, unsigned long check)
+{
+  printf ("%-24s %8.1f ns/date %8.2f M dates/s  (%lu)\n", name,
+          secs * 1e9 / n, n / secs / 1e6, check);
+}
+
+int
+main (int argc, char *argv[])
+{
+  int n = argc > 1 ? atoi (argv[1]) : 2000000;
+  time_t *dates = (time_t*)malloc (sizeof (time_t) * n);
+  /* A few years of transactions, a few hours apart. */
+  int i;
+  for (i = 0; i < n; ++i)
+    {
+      dates[i] = 1262304000 + (time_t)i * 3 * 3600 % (10 * 365 * 86400);
+    }
+  tzset ();
+  char buf[64];
+  unsigned long check = 0;
+
+  double start = now ();
+  for (i = 0; i < n; ++i)
+    {
+      struct tm *tm = localtime (&dates[i]);
+      int len = strftime (buf, 64, "%Y-%m-%d %H:%M:%S", tm);
+      len += sprintf (buf + len, " %c%02d%02d", timezone > 0 ? '-' : '+',
+                      (int)(timezone / 3600 - tm->tm_isdst),
+                      (int)((timezone / 60) % 60));
+      check += buf[len - 1];
+    }
+  report ("localtime + strftime", n, now () - start, check);
+
+  check = 0;
+  start = now ();
+  for (i = 0; i < n; ++i)
+    {
+      check += buf[casheph_format_ts (NULL, dates[i], buf) - 1];
+    }
+  report ("casheph_format_ts", n, now () - start, check);
+
+  casheph_ts_cache_t cache;
+  casheph_ts_cache_init (&cache);
+  check = 0;
+  start = now ();
+  for (i = 0; i < n; ++i)
+    {
+      check += buf[casheph_format_ts (&cache, dates[i], buf) - 1];
+    }
+  report ("casheph_format_ts cached", n, now () - start, check);
+
+  /* The same dates out of order, as from a book not sorted by date. */
+  srand (1);
+  for (i = n - 1; i > 0; --i)
+    {
+      int j = (int)(((uint64_t)rand () * RAND_MAX + rand ()) % (i + 1));
+      time_t t = dates[i];
+      dates[i] = dates[j];
+      dates[j] = t;
+    }
+  check = 0;
+  start = now ();
+  for (i = 0; i < n; ++i)
+    {
+      struct tm tm;
+      localtime_r (&dates[i], &tm);
+      check += tm.tm_hour;
+    }
+  report ("shuffled localtime_r", n, now () - start, check);
+
+  casheph_ts_cache_init (&cache);
+  check = 0;
+  start = now ();
+  for (i = 0; i < n; ++i)
+    {
+      check += buf[casheph_format_ts (&cache, dates[i], buf) - 1];
+    }
+  report ("shuffled cached", n, now () - start, check);
+
+  free (dates);
+  return 0;
+}
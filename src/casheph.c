@@ -19,6 +19,14 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #include "mxml.h"
 
@@ -54,6 +62,417 @@ casheph_parse_value_str (const char *str)
   return val;
 }
 
+struct casheph_guid_map_s
+{
+  size_t n;
+  size_t cap;
+  const char **keys;
+  void **values;
+};
+
+uint64_t
+casheph_guid_hash (const char *id)
+{
+  uint64_t h = 14695981039346656037ULL;
+  while (*id != '\0')
+    {
+      h ^= (unsigned char)*id++;
+      h *= 1099511628211ULL;
+    }
+  return h;
+}
+
+casheph_guid_map_t *
+casheph_guid_map_new (size_t hint)
+{
+  casheph_guid_map_t *map = (casheph_guid_map_t*)malloc (sizeof (casheph_guid_map_t));
+  map->n = 0;
+  map->cap = 16;
+  while (map->cap < hint * 2)
+    {
+      map->cap *= 2;
+    }
+  map->keys = (const char**)calloc (map->cap, sizeof (const char*));
+  map->values = (void**)calloc (map->cap, sizeof (void*));
+  return map;
+}
+
+void
+casheph_guid_map_destroy (casheph_guid_map_t *map)
+{
+  if (map == NULL)
+    {
+      return;
+    }
+  free (map->keys);
+  free (map->values);
+  free (map);
+}
+
+size_t
+casheph_guid_map_slot (casheph_guid_map_t *map, const char *id)
+{
+  size_t mask = map->cap - 1;
+  size_t i = casheph_guid_hash (id) & mask;
+  while (map->keys[i] != NULL && strcmp (map->keys[i], id) != 0)
+    {
+      i = (i + 1) & mask;
+    }
+  return i;
+}
+
+void casheph_guid_map_put (casheph_guid_map_t *map, const char *id, void *value);
+
+void
+casheph_guid_map_grow (casheph_guid_map_t *map)
+{
+  size_t old_cap = map->cap;
+  const char **old_keys = map->keys;
+  void **old_values = map->values;
+  map->cap *= 2;
+  map->n = 0;
+  map->keys = (const char**)calloc (map->cap, sizeof (const char*));
+  map->values = (void**)calloc (map->cap, sizeof (void*));
+  size_t i;
+  for (i = 0; i < old_cap; ++i)
+    {
+      if (old_keys[i] != NULL)
+        {
+          casheph_guid_map_put (map, old_keys[i], old_values[i]);
+        }
+    }
+  free (old_keys);
+  free (old_values);
+}
+
+void
+casheph_guid_map_put (casheph_guid_map_t *map, const char *id, void *value)
+{
+  if ((map->n + 1) * 2 > map->cap)
+    {
+      casheph_guid_map_grow (map);
+    }
+  size_t i = casheph_guid_map_slot (map, id);
+  if (map->keys[i] == NULL)
+    {
+      ++map->n;
+    }
+  map->keys[i] = id;
+  map->values[i] = value;
+}
+
+void *
+casheph_guid_map_get (casheph_guid_map_t *map, const char *id)
+{
+  size_t i = casheph_guid_map_slot (map, id);
+  return map->keys[i] == NULL ? NULL : map->values[i];
+}
+
+void
+casheph_guid_map_remove (casheph_guid_map_t *map, const char *id)
+{
+  size_t mask = map->cap - 1;
+  size_t i = casheph_guid_map_slot (map, id);
+  if (map->keys[i] == NULL)
+    {
+      return;
+    }
+  map->keys[i] = NULL;
+  map->values[i] = NULL;
+  --map->n;
+  /* Re-seat the rest of the probe run so lookups never stop early. */
+  size_t j = (i + 1) & mask;
+  while (map->keys[j] != NULL)
+    {
+      const char *key = map->keys[j];
+      void *value = map->values[j];
+      map->keys[j] = NULL;
+      map->values[j] = NULL;
+      --map->n;
+      casheph_guid_map_put (map, key, value);
+      j = (j + 1) & mask;
+    }
+}
+
+bool
+casheph_parse_wval (const char *str, casheph_wval_t *val)
+{
+  const char *p = str;
+  bool neg = false;
+  if (*p == '-')
+    {
+      neg = true;
+      ++p;
+    }
+  if (*p < '0' || *p > '9')
+    {
+      return false;
+    }
+  uint64_t n = 0;
+  while (*p >= '0' && *p <= '9')
+    {
+      if (n > (UINT64_C (9223372036854775808) - (*p - '0')) / 10)
+        {
+          return false;
+        }
+      n = n * 10 + (*p++ - '0');
+    }
+  if (n > (neg ? UINT64_C (9223372036854775808) : (uint64_t)INT64_MAX))
+    {
+      return false;
+    }
+  uint64_t d = 1;
+  if (*p == '/')
+    {
+      ++p;
+      d = 0;
+      while (*p >= '0' && *p <= '9')
+        {
+          d = d * 10 + (*p++ - '0');
+          if (d > UINT32_MAX)
+            {
+              return false;
+            }
+        }
+      if (d == 0)
+        {
+          return false;
+        }
+    }
+  val->n = neg ? (int64_t)(0 - n) : (int64_t)n;
+  val->d = (uint32_t)d;
+  return true;
+}
+
+int
+casheph_format_wval (casheph_wval_t val, char *buf)
+{
+  char tmp[24];
+  int len = 0;
+  uint64_t n = val.n < 0 ? 0 - (uint64_t)val.n : (uint64_t)val.n;
+  if (val.n < 0)
+    {
+      buf[len++] = '-';
+    }
+  int i = 0;
+  do
+    {
+      tmp[i++] = '0' + n % 10;
+      n /= 10;
+    }
+  while (n > 0);
+  while (i > 0)
+    {
+      buf[len++] = tmp[--i];
+    }
+  buf[len++] = '/';
+  uint32_t d = val.d;
+  do
+    {
+      tmp[i++] = '0' + d % 10;
+      d /= 10;
+    }
+  while (d > 0);
+  while (i > 0)
+    {
+      buf[len++] = tmp[--i];
+    }
+  buf[len] = '\0';
+  return len;
+}
+
+uint64_t
+casheph_gcd (uint64_t a, uint64_t b)
+{
+  while (b != 0)
+    {
+      uint64_t t = a % b;
+      a = b;
+      b = t;
+    }
+  return a;
+}
+
+/* Checked 64-bit arithmetic in plain C: no __int128 or overflow
+   builtins, so 32-bit targets build too. */
+bool
+casheph_add_i64 (int64_t a, int64_t b, int64_t *res)
+{
+  if ((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b))
+    {
+      return false;
+    }
+  *res = a + b;
+  return true;
+}
+
+bool
+casheph_mul_i64_u32 (int64_t a, uint32_t m, int64_t *res)
+{
+  if (m != 0 && (a > INT64_MAX / (int64_t)m || a < INT64_MIN / (int64_t)m))
+    {
+      return false;
+    }
+  *res = a * (int64_t)m;
+  return true;
+}
+
+/* X * Y as a 96-bit number in *HI:*LO. */
+void
+casheph_mul_u64_u32 (uint64_t x, uint32_t y, uint64_t *hi, uint64_t *lo)
+{
+  uint64_t low = (x & 0xffffffffULL) * y;
+  uint64_t high = (x >> 32) * y;
+  *lo = low + (high << 32);
+  *hi = (high >> 32) + (*lo < low);
+}
+
+/* Sign and magnitude of N * M. */
+void
+casheph_mul_wide (int64_t n, uint32_t m, int *sign, uint64_t *hi, uint64_t *lo)
+{
+  *sign = (n < 0 ? -1 : (n > 0 ? 1 : 0)) * (m != 0);
+  casheph_mul_u64_u32 (n < 0 ? -(uint64_t)n : (uint64_t)n, m, hi, lo);
+}
+
+bool
+casheph_wval_add (casheph_wval_t a, casheph_wval_t b, casheph_wval_t *res)
+{
+  if (a.d == b.d)
+    {
+      int64_t n;
+      if (!casheph_add_i64 (a.n, b.n, &n))
+        {
+          return false;
+        }
+      res->n = n;
+      res->d = a.d;
+      return true;
+    }
+  if (a.d == 0 || b.d == 0)
+    {
+      return false;
+    }
+  uint64_t l = (uint64_t)a.d / casheph_gcd (a.d, b.d) * b.d;
+  if (l > UINT32_MAX)
+    {
+      return false;
+    }
+  /* a.n * (l / a.d) + b.n * (l / b.d) in sign and 96-bit magnitude, so
+     large terms that cancel still give the exact sum. */
+  int sa, sb;
+  uint64_t ah, al, bh, bl, h, lo;
+  casheph_mul_wide (a.n, (uint32_t)(l / a.d), &sa, &ah, &al);
+  casheph_mul_wide (b.n, (uint32_t)(l / b.d), &sb, &bh, &bl);
+  int s;
+  if (sa == sb || sb == 0)
+    {
+      s = sa;
+      lo = al + bl;
+      h = ah + bh + (lo < al);
+    }
+  else if (sa == 0)
+    {
+      s = sb;
+      h = bh;
+      lo = bl;
+    }
+  else if (ah > bh || (ah == bh && al >= bl))
+    {
+      s = sa;
+      lo = al - bl;
+      h = ah - bh - (al < bl);
+    }
+  else
+    {
+      s = sb;
+      lo = bl - al;
+      h = bh - ah - (bl < al);
+    }
+  if (h != 0 || lo > (s < 0 ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX))
+    {
+      return false;
+    }
+  res->n = s < 0 ? (int64_t)(0 - lo) : (int64_t)lo;
+  res->d = (uint32_t)l;
+  return true;
+}
+
+bool
+casheph_wval_neg (casheph_wval_t a, casheph_wval_t *res)
+{
+  if (a.n == INT64_MIN)
+    {
+      return false;
+    }
+  res->n = -a.n;
+  res->d = a.d;
+  return true;
+}
+
+bool
+casheph_wval_rescale (casheph_wval_t a, uint32_t d, casheph_wval_t *res)
+{
+  if (a.d == d)
+    {
+      *res = a;
+      return true;
+    }
+  if (a.d == 0 || d == 0)
+    {
+      return false;
+    }
+  /* |a.n| * d / a.d as (q * a.d + r) * d / a.d, where r * d cannot
+     overflow because r < a.d. */
+  bool neg = a.n < 0;
+  uint64_t mag = neg ? -(uint64_t)a.n : (uint64_t)a.n;
+  uint64_t q = mag / a.d;
+  uint64_t r = mag % a.d;
+  if (q > UINT64_MAX / d)
+    {
+      return false;
+    }
+  uint64_t rd = r * d;
+  uint64_t n = q * d;
+  uint64_t frac = rd / a.d;
+  if (n > UINT64_MAX - frac)
+    {
+      return false;
+    }
+  n += frac;
+  if (2 * (rd % a.d) >= a.d)
+    {
+      ++n;
+    }
+  if (n > (neg ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX))
+    {
+      return false;
+    }
+  res->n = neg ? (int64_t)(0 - n) : (int64_t)n;
+  res->d = d;
+  return true;
+}
+
+int
+casheph_wval_cmp (casheph_wval_t a, casheph_wval_t b)
+{
+  if (a.d == b.d)
+    {
+      return a.n < b.n ? -1 : (a.n > b.n ? 1 : 0);
+    }
+  /* Compare a.n * b.d with b.n * a.d. */
+  int sa, sb;
+  uint64_t lh, ll, rh, rl;
+  casheph_mul_wide (a.n, b.d, &sa, &lh, &ll);
+  casheph_mul_wide (b.n, a.d, &sb, &rh, &rl);
+  if (sa != sb)
+    {
+      return sa < sb ? -1 : 1;
+    }
+  int mag = lh != rh ? (lh < rh ? -1 : 1) : (ll < rl ? -1 : (ll > rl ? 1 : 0));
+  return sa < 0 ? -mag : mag;
+}
+
 casheph_account_t *
 casheph_account_get_account_by_name (casheph_account_t *act,
                                      const char *name)
@@ -73,6 +492,10 @@ casheph_transaction_t *
 casheph_get_transaction (casheph_t *ce,
                          const char *id)
 {
+  if (ce->trn_map != NULL)
+    {
+      return (casheph_transaction_t*)casheph_guid_map_get (ce->trn_map, id);
+    }
   int i;
   for (i = 0; i < ce->n_transactions; ++i)
     {
@@ -237,12 +660,18 @@ mxml_load_child_ts_date (mxml_node_t *node, const char *name)
   return t;
 }
 
-casheph_val_t *
+casheph_wval_t *
 mxml_load_child_val (mxml_node_t *node, const char *name)
 {
-  char *buf = mxml_load_child_text (node, name);
-  casheph_val_t *val = casheph_parse_value_str (buf);
-  free (buf);
+  casheph_wval_t *val = (casheph_wval_t*)malloc (sizeof (casheph_wval_t));
+  val->n = 0;
+  val->d = 1;
+  mxml_node_t *ch = mxmlFindElement (node, node, name, NULL, NULL, MXML_DESCEND);
+  const char *str = mxmlGetText (mxmlGetFirstChild (ch), NULL);
+  if (str != NULL)
+    {
+      casheph_parse_wval (str, val);
+    }
   return val;
 }
 
@@ -370,6 +799,8 @@ mxml_load_account (mxml_node_t *act_node)
   account->n_accounts = 0;
   account->slots = NULL;
   account->n_slots = 0;
+  account->ledger = NULL;
+  account->cube = NULL;
 
   account->name = mxml_load_child_text (act_node, "act:name");
   account->type = mxml_load_child_text (act_node, "act:type");
@@ -415,7 +846,9 @@ mxml_load_split (mxml_node_t *split_node)
   casheph_split_t *split = (casheph_split_t*)malloc (sizeof (casheph_split_t));
 
   split->id = mxml_load_child_text (split_node, "split:id");
-  split->reconciled_state = mxml_load_child_text (split_node, "split:reconciled-state");
+  char *state = mxml_load_child_text (split_node, "split:reconciled-state");
+  split->reconciled_state = (state != NULL && state[0] != '\0') ? state[0] : ce_unreconciled;
+  free (state);
   split->account = mxml_load_child_text (split_node, "split:account");
   split->value = mxml_load_child_val (split_node, "split:value");
   split->quantity = mxml_load_child_val (split_node, "split:quantity");
@@ -441,11 +874,15 @@ casheph_transaction_t *
 mxml_load_transaction (mxml_node_t *trn_node)
 {
   casheph_transaction_t *trn = (casheph_transaction_t*)malloc (sizeof (casheph_transaction_t));
+  trn->packed = false;
 
   trn->desc = mxml_load_child_text (trn_node, "trn:description");
   trn->id = mxml_load_child_text (trn_node, "trn:id");
   trn->date_posted = mxml_load_child_ts_date (trn_node, "trn:date-posted");
   trn->date_entered = mxml_load_child_ts_date (trn_node, "trn:date-entered");
+  trn->xml = NULL;
+  trn->xml_len = 0;
+  trn->version = 0;
   mxml_node_t *splits_node = mxmlFindElement (trn_node, trn_node, "trn:splits", NULL, NULL, MXML_DESCEND);
   trn->splits = NULL;
   trn->n_splits = 0;
@@ -475,8 +912,124 @@ mxml_load_transaction (mxml_node_t *trn_node)
   return trn;
 }
 
+bool
+casheph_filter_match (const casheph_filter_t *filter,
+                      casheph_guid_map_t *accounts, mxml_node_t *trn_node)
+{
+  if (filter->has_dates)
+    {
+      time_t posted = mxml_load_child_ts_date (trn_node, "trn:date-posted");
+      if (posted < filter->posted_from || posted >= filter->posted_to)
+        {
+          return false;
+        }
+    }
+  mxml_node_t *node;
+  if (filter->n_accounts > 0)
+    {
+      bool found = false;
+      node = trn_node;
+      while (!found
+             && (node = mxmlFindElement (node, trn_node, "split:account",
+                                         NULL, NULL, MXML_DESCEND)) != NULL)
+        {
+          const char *id = mxmlGetText (mxmlGetFirstChild (node), NULL);
+          found = id != NULL && casheph_guid_map_get (accounts, id) != NULL;
+        }
+      if (!found)
+        {
+          return false;
+        }
+    }
+  if (filter->slot_key != NULL)
+    {
+      bool found = false;
+      node = trn_node;
+      while (!found
+             && (node = mxmlFindElement (node, trn_node, "slot:key",
+                                         NULL, NULL, MXML_DESCEND)) != NULL)
+        {
+          const char *key = mxmlGetText (mxmlGetFirstChild (node), NULL);
+          found = key != NULL && strcmp (key, filter->slot_key) == 0;
+        }
+      if (!found)
+        {
+          return false;
+        }
+    }
+  return true;
+}
+
+casheph_t *casheph_cache_load (const char *filename);
+
+uint64_t casheph_random ();
+
+casheph_t *
+casheph_alloc ()
+{
+  casheph_t *ce = (casheph_t*)malloc (sizeof (casheph_t));
+  ce->root = NULL;
+  ce->book_id = NULL;
+  ce->n_transactions = 0;
+  ce->transactions = NULL;
+  ce->n_template_transactions = 0;
+  ce->template_transactions = NULL;
+  ce->template_root = NULL;
+  ce->n_schedxactions = 0;
+  ce->schedxactions = NULL;
+  ce->account_map = NULL;
+  ce->path_map = NULL;
+  ce->trn_map = NULL;
+  ce->ledgers_built = false;
+  ce->cubes_built = false;
+  ce->text_index = NULL;
+  ce->xml_tz = NULL;
+  ce->journal = NULL;
+  ce->journal_book = NULL;
+  ce->journal_group = 1;
+  ce->journal_pending = 0;
+  ce->journal_failed = false;
+  ce->save_job = NULL;
+  ce->n_deferred = 0;
+  ce->deferred = NULL;
+  ce->mod_count = 0;
+  ce->epoch = casheph_random ();
+  ce->saved = NULL;
+  ce->loaded = NULL;
+  ce->n_tombstones = 0;
+  ce->tombstones = NULL;
+  ce->in_batch = false;
+  ce->n_undo = 0;
+  ce->cap_undo = 0;
+  ce->undo = NULL;
+  return ce;
+}
+
+void casheph_journal_replay (casheph_t *ce, const char *filename,
+                             const casheph_filter_t *filter,
+                             casheph_guid_map_t *filter_accounts);
+
+enum { ce_undo_add, ce_undo_remove, ce_undo_reconcile, ce_undo_account_add,
+       ce_undo_account_remove, ce_undo_account_move };
+
+void casheph_undo_push (casheph_t *ce, int kind, casheph_transaction_t *trn,
+                        casheph_split_t *split, int index);
+
+void casheph_loaded_record (casheph_t *ce, const char *filename);
+
 casheph_t *
 casheph_open (const char *filename)
+{
+  casheph_t *ce = casheph_cache_load (filename);
+  if (ce != NULL)
+    {
+      return ce;
+    }
+  return casheph_open_filtered (filename, NULL);
+}
+
+casheph_t *
+casheph_open_filtered (const char *filename, const casheph_filter_t *filter)
 {
   gzFile file2 = gzopen (filename, "r");
   if (file2 == NULL)
@@ -512,14 +1065,7 @@ casheph_open (const char *filename)
 
   mxml_node_t *gnc_root = mxmlFindElement (tree, tree, "gnc-v2", NULL, NULL, MXML_DESCEND);
 
-  casheph_t *ce = (casheph_t*)malloc (sizeof (casheph_t));
-  ce->n_transactions = 0;
-  ce->transactions = NULL;
-  ce->n_template_transactions = 0;
-  ce->template_transactions = NULL;
-  ce->template_root = NULL;
-  ce->n_schedxactions = 0;
-  ce->schedxactions = NULL;
+  casheph_t *ce = casheph_alloc ();
   mxml_node_t *book_id_node = mxmlFindElement (gnc_root, gnc_root, "book:id", NULL, NULL, MXML_DESCEND);
   int whitespace = 0;
   mxml_node_t *book_id_val = mxmlGetFirstChild (book_id_node);
@@ -553,6 +1099,17 @@ casheph_open (const char *filename)
                                       NULL,
                                       MXML_NO_DESCEND)) != NULL);
 
+  casheph_guid_map_t *filter_accounts = NULL;
+  if (filter != NULL && filter->n_accounts > 0)
+    {
+      filter_accounts = casheph_guid_map_new (filter->n_accounts);
+      int i;
+      for (i = 0; i < filter->n_accounts; ++i)
+        {
+          casheph_guid_map_put (filter_accounts, filter->accounts[i],
+                                (void*)filter->accounts[i]);
+        }
+    }
   mxml_node_t *trn_node = NULL;
   trn_node = mxmlFindElement (gnc_root,
                               gnc_root,
@@ -562,6 +1119,11 @@ casheph_open (const char *filename)
                               MXML_DESCEND);
   do
     {
+      if (filter != NULL
+          && !casheph_filter_match (filter, filter_accounts, trn_node))
+        {
+          continue;
+        }
       casheph_transaction_t *transaction = mxml_load_transaction (trn_node);
       ++ce->n_transactions;
       ce->transactions = (casheph_transaction_t**)realloc (ce->transactions,
@@ -631,6 +1193,12 @@ casheph_open (const char *filename)
     }
 
   casheph_account_collect_accounts (ce->root, n_accounts, accounts);
+  if (filter == NULL)
+    {
+      casheph_loaded_record (ce, filename);
+    }
+  casheph_journal_replay (ce, filename, filter, filter_accounts);
+  casheph_guid_map_destroy (filter_accounts);
 
   return ce;
 }
@@ -653,80 +1221,469 @@ casheph_count_accounts (casheph_t *ce)
   return 1 + casheph_account_n_sub_accounts (ce->root);
 }
 
+typedef struct casheph_buf_s casheph_buf_t;
+
+/* Output buffer for the serializer.  When FLUSH is set the buffer is
+   handed to it whenever it fills up, otherwise it grows. */
+struct casheph_buf_s
+{
+  char *data;
+  size_t len;
+  size_t cap;
+  bool (*flush) (casheph_buf_t *buf);
+  void *ctx;
+  bool error;
+  casheph_ts_cache_t *ts;
+};
+
 void
-casheph_write_commodity (casheph_commodity_t *cmdty, const char *prefix,
-                         const char *indent, gzFile file)
+casheph_buf_init (casheph_buf_t *buf, size_t cap,
+                  bool (*flush) (casheph_buf_t *), void *ctx)
 {
-  gzprintf (file, "%s<%scommodity>\n", indent, prefix);
-  gzprintf (file, "%s  <cmdty:space>%s</cmdty:space>\n", indent,
-            cmdty->space);
-  gzprintf (file, "%s  <cmdty:id>%s</cmdty:id>\n", indent,
-            cmdty->id);
-  gzprintf (file, "%s</%scommodity>\n", indent, prefix);
+  buf->data = (char*)malloc (cap);
+  buf->len = 0;
+  buf->cap = cap;
+  buf->flush = flush;
+  buf->ctx = ctx;
+  buf->error = false;
+  buf->ts = NULL;
 }
 
 void
-casheph_write_account (casheph_account_t *account, gzFile file)
+casheph_buf_free (casheph_buf_t *buf)
 {
-  gzputs (file, "<gnc:account version=\"2.0.0\">\n");
-  if (strcmp (account->type, "ROOT") == 0)
+  free (buf->data);
+  free (buf->ts);
+  buf->data = NULL;
+  buf->ts = NULL;
+  buf->len = buf->cap = 0;
+}
+
+/* Make room for N more bytes and return where they go. */
+char *
+casheph_buf_reserve (casheph_buf_t *buf, size_t n)
+{
+  if (buf->len + n > buf->cap && buf->flush != NULL && buf->len > 0)
     {
-      gzprintf (file, "  <act:name>%s</act:name>\n", account->name);
-      gzprintf (file, "  <act:id type=\"guid\">%s</act:id>\n", account->id);
-      gzprintf (file, "  <act:type>ROOT</act:type>\n");
-      if (account->commodity != NULL)
+      if (!buf->flush (buf))
         {
-          casheph_write_commodity (account->commodity, "act:", "  ", file);
-          gzprintf (file, "  <act:commodity-scu>%d</act:commodity-scu>\n",
-                    account->commodity_scu);
+          buf->error = true;
         }
+      buf->len = 0;
     }
-  else
+  if (buf->len + n > buf->cap)
     {
-      gzprintf (file, "  <act:name>%s</act:name>\n", account->name);
-      gzprintf (file, "  <act:id type=\"guid\">%s</act:id>\n", account->id);
-      gzprintf (file, "  <act:type>%s</act:type>\n", account->type);
-      casheph_write_commodity (account->commodity, "act:", "  ", file);
-      gzprintf (file, "  <act:commodity-scu>%d</act:commodity-scu>\n",
-                account->commodity_scu);
-      if (account->description != NULL)
-        {
-          gzprintf (file, "  <act:description>%s</act:description>\n", account->description);
-        }
-      if (account->n_slots > 0)
+      while (buf->len + n > buf->cap)
         {
-          gzprintf (file, "  <act:slots>\n");
-          int i;
-          for (i = 0; i < account->n_slots; ++i)
-            {
-              gzprintf (file, "    <slot>\n");
-              gzprintf (file, "      <slot:key>placeholder</slot:key>\n");
-              gzprintf (file, "      <slot:value type=\"string\">true</slot:value>\n");
-              gzprintf (file, "    </slot>\n");
-            }
-          gzprintf (file, "  </act:slots>\n");
+          buf->cap *= 2;
         }
-      gzprintf (file, "  <act:parent type=\"guid\">%s</act:parent>\n", account->parent);
+      buf->data = (char*)realloc (buf->data, buf->cap);
     }
-  gzputs (file, "</gnc:account>\n");
+  return buf->data + buf->len;
 }
 
 void
-casheph_write_accounts (casheph_account_t *account, gzFile file)
+casheph_buf_put (casheph_buf_t *buf, const char *str, size_t len)
 {
-  casheph_write_account (account, file);
+  memcpy (casheph_buf_reserve (buf, len), str, len);
+  buf->len += len;
+}
+
+void
+casheph_buf_puts (casheph_buf_t *buf, const char *str)
+{
+  casheph_buf_put (buf, str, strlen (str));
+}
+
+#define casheph_buf_putl(buf, lit) casheph_buf_put ((buf), (lit), sizeof (lit) - 1)
+
+void
+casheph_buf_putc (casheph_buf_t *buf, char c)
+{
+  *casheph_buf_reserve (buf, 1) = c;
+  ++buf->len;
+}
+
+void
+casheph_buf_put_int (casheph_buf_t *buf, int64_t v)
+{
+  char *p = casheph_buf_reserve (buf, 21);
+  char tmp[20];
+  uint64_t u = v < 0 ? 0 - (uint64_t)v : (uint64_t)v;
+  int n = 0;
+  int i = 0;
+  if (v < 0)
+    {
+      p[n++] = '-';
+    }
+  do
+    {
+      tmp[i++] = '0' + u % 10;
+      u /= 10;
+    }
+  while (u > 0);
+  while (i > 0)
+    {
+      p[n++] = tmp[--i];
+    }
+  buf->len += n;
+}
+
+/* Zero-padded to at least WIDTH digits, like %0*d. */
+void
+casheph_buf_put_padded (casheph_buf_t *buf, int v, int width)
+{
+  char *p = casheph_buf_reserve (buf, 12);
+  char tmp[12];
+  unsigned int u = v < 0 ? 0 - (unsigned int)v : (unsigned int)v;
+  int n = 0;
+  int i = 0;
+  if (v < 0)
+    {
+      p[n++] = '-';
+      --width;
+    }
+  do
+    {
+      tmp[i++] = '0' + u % 10;
+      u /= 10;
+    }
+  while (u > 0);
+  while (i < width)
+    {
+      tmp[i++] = '0';
+    }
+  while (i > 0)
+    {
+      p[n++] = tmp[--i];
+    }
+  buf->len += n;
+}
+
+/* Character data, with the characters XML reserves escaped. */
+void
+casheph_buf_put_text (casheph_buf_t *buf, const char *str)
+{
+  const char *run = str;
+  const char *p;
+  for (p = str; *p != '\0'; ++p)
+    {
+      const char *esc;
+      switch (*p)
+        {
+        case '&':
+          esc = "&amp;";
+          break;
+        case '<':
+          esc = "&lt;";
+          break;
+        case '>':
+          esc = "&gt;";
+          break;
+        default:
+          continue;
+        }
+      casheph_buf_put (buf, run, p - run);
+      casheph_buf_puts (buf, esc);
+      run = p + 1;
+    }
+  casheph_buf_put (buf, run, p - run);
+}
+
+void
+casheph_buf_put_wval (casheph_buf_t *buf, const casheph_wval_t *val)
+{
+  buf->len += casheph_format_wval (*val, casheph_buf_reserve (buf, 32));
+}
+
+void
+casheph_buf_put_gdate (casheph_buf_t *buf, const casheph_gdate_t *date)
+{
+  casheph_buf_put_padded (buf, date->year, 4);
+  casheph_buf_putc (buf, '-');
+  casheph_buf_put_padded (buf, date->month, 2);
+  casheph_buf_putc (buf, '-');
+  casheph_buf_put_padded (buf, date->day, 2);
+}
+
+int32_t
+casheph_utc_offset (time_t t)
+{
+  struct tm tm;
+  localtime_r (&t, &tm);
+  return tm.tm_gmtoff;
+}
+
+void
+casheph_ts_cache_init (casheph_ts_cache_t *cache)
+{
+  tzset ();
+  cache->lookups = 0;
+  cache->fills = 0;
+  int i;
+  for (i = 0; i < 64; ++i)
+    {
+      cache->years[i].used = false;
+    }
+}
+
+int32_t casheph_days_from_civil (int y, unsigned int m, unsigned int d);
+
+void casheph_civil_from_days (int64_t days, int *y, unsigned int *m,
+                              unsigned int *d);
+
+/* The offset changes during year Y, found a day at a time and then to
+   the second by bisection. */
+void
+casheph_ts_year_fill (casheph_ts_year_t *entry, int y)
+{
+  time_t a = (time_t)casheph_days_from_civil (y, 1, 1) * 86400;
+  time_t end = (time_t)casheph_days_from_civil (y + 1, 1, 1) * 86400 - 1;
+  int32_t cur = casheph_utc_offset (a);
+  entry->used = true;
+  entry->year = y;
+  entry->n = 0;
+  entry->off[0] = cur;
+  while (a < end)
+    {
+      time_t b = end - a > 86400 ? a + 86400 : end;
+      if (casheph_utc_offset (b) == cur)
+        {
+          a = b;
+          continue;
+        }
+      while (b - a > 1)
+        {
+          time_t mid = a + (b - a) / 2;
+          if (casheph_utc_offset (mid) == cur)
+            {
+              a = mid;
+            }
+          else
+            {
+              b = mid;
+            }
+        }
+      if (entry->n == 4)
+        {
+          entry->n = -1;
+          return;
+        }
+      cur = casheph_utc_offset (b);
+      entry->at[entry->n] = b;
+      entry->off[entry->n + 1] = cur;
+      ++entry->n;
+      a = b;
+    }
+}
+
+int32_t
+casheph_ts_cache_offset (casheph_ts_cache_t *cache, time_t t)
+{
+  int64_t days = t >= 0 ? t / 86400 : -((-(int64_t)t + 86399) / 86400);
+  int y;
+  unsigned int m;
+  unsigned int d;
+  casheph_civil_from_days (days, &y, &m, &d);
+  casheph_ts_year_t *entry = &cache->years[y & 63];
+  ++cache->lookups;
+  if (!entry->used || entry->year != y)
+    {
+      /* Allow about one fill per thousand lookups. */
+      if (cache->fills * 1024 > cache->lookups)
+        {
+          return casheph_utc_offset (t);
+        }
+      ++cache->fills;
+      casheph_ts_year_fill (entry, y);
+    }
+  if (entry->n < 0)
+    {
+      return casheph_utc_offset (t);
+    }
+  int32_t off = entry->off[0];
+  int i;
+  for (i = 0; i < entry->n && t >= entry->at[i]; ++i)
+    {
+      off = entry->off[i + 1];
+    }
+  return off;
+}
+
+/* Inverse of casheph_days_from_civil. */
+void
+casheph_civil_from_days (int64_t days, int *y, unsigned int *m,
+                         unsigned int *d)
+{
+  days += 719468;
+  int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+  unsigned int doe = (unsigned int)(days - era * 146097);
+  unsigned int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  unsigned int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  unsigned int mp = (5 * doy + 2) / 153;
+  *d = doy - (153 * mp + 2) / 5 + 1;
+  *m = mp < 10 ? mp + 3 : mp - 9;
+  *y = (int)(yoe + era * 400) + (*m <= 2);
+}
+
+void
+casheph_put_2 (char *p, unsigned int v)
+{
+  p[0] = '0' + v / 10;
+  p[1] = '0' + v % 10;
+}
+
+int
+casheph_format_ts (casheph_ts_cache_t *cache, time_t t, char *buf)
+{
+  int32_t off = cache != NULL ? casheph_ts_cache_offset (cache, t)
+    : casheph_utc_offset (t);
+  int64_t local = (int64_t)t + off;
+  int64_t days = local >= 0 ? local / 86400 : -((-local + 86399) / 86400);
+  unsigned int secs = (unsigned int)(local - days * 86400);
+  int y;
+  unsigned int m;
+  unsigned int d;
+  casheph_civil_from_days (days, &y, &m, &d);
+  if (y < 0 || y > 9999)
+    {
+      struct tm tm;
+      localtime_r (&t, &tm);
+      int n = (int)strftime (buf, 32, "%Y-%m-%d %H:%M:%S", &tm);
+      unsigned int a = off < 0 ? -off : off;
+      return n + sprintf (buf + n, " %c%02u%02u", off < 0 ? '-' : '+',
+                          a / 3600, a / 60 % 60);
+    }
+  casheph_put_2 (buf, y / 100);
+  casheph_put_2 (buf + 2, y % 100);
+  buf[4] = '-';
+  casheph_put_2 (buf + 5, m);
+  buf[7] = '-';
+  casheph_put_2 (buf + 8, d);
+  buf[10] = ' ';
+  casheph_put_2 (buf + 11, secs / 3600);
+  buf[13] = ':';
+  casheph_put_2 (buf + 14, secs / 60 % 60);
+  buf[16] = ':';
+  casheph_put_2 (buf + 17, secs % 60);
+  buf[19] = ' ';
+  unsigned int a = off < 0 ? -off : off;
+  buf[20] = off < 0 ? '-' : '+';
+  casheph_put_2 (buf + 21, a / 3600 % 100);
+  casheph_put_2 (buf + 23, a / 60 % 60);
+  buf[25] = '\0';
+  return 25;
+}
+
+void
+casheph_buf_put_ts (casheph_buf_t *buf, time_t t)
+{
+  if (buf->ts == NULL)
+    {
+      buf->ts = (casheph_ts_cache_t*)malloc (sizeof (casheph_ts_cache_t));
+      casheph_ts_cache_init (buf->ts);
+    }
+  buf->len += casheph_format_ts (buf->ts, t, casheph_buf_reserve (buf, 32));
+}
+
+/* Appends "<open>text</close>\n" after INDENT. */
+void
+casheph_buf_put_elem (casheph_buf_t *buf, const char *indent,
+                      const char *open, const char *text, const char *close)
+{
+  casheph_buf_puts (buf, indent);
+  casheph_buf_puts (buf, open);
+  casheph_buf_put_text (buf, text);
+  casheph_buf_puts (buf, close);
+}
+
+void
+casheph_write_commodity (casheph_commodity_t *cmdty, const char *prefix,
+                         const char *indent, casheph_buf_t *out)
+{
+  casheph_buf_puts (out, indent);
+  casheph_buf_putc (out, '<');
+  casheph_buf_puts (out, prefix);
+  casheph_buf_putl (out, "commodity>\n");
+  casheph_buf_put_elem (out, indent, "  <cmdty:space>", cmdty->space,
+                        "</cmdty:space>\n");
+  casheph_buf_put_elem (out, indent, "  <cmdty:id>", cmdty->id,
+                        "</cmdty:id>\n");
+  casheph_buf_puts (out, indent);
+  casheph_buf_putl (out, "</");
+  casheph_buf_puts (out, prefix);
+  casheph_buf_putl (out, "commodity>\n");
+}
+
+void
+casheph_write_account (casheph_account_t *account, casheph_buf_t *out)
+{
+  casheph_buf_putl (out, "<gnc:account version=\"2.0.0\">\n");
+  casheph_buf_put_elem (out, "", "  <act:name>", account->name, "</act:name>\n");
+  casheph_buf_put_elem (out, "", "  <act:id type=\"guid\">", account->id,
+                        "</act:id>\n");
+  if (strcmp (account->type, "ROOT") == 0)
+    {
+      casheph_buf_putl (out, "  <act:type>ROOT</act:type>\n");
+      if (account->commodity != NULL)
+        {
+          casheph_write_commodity (account->commodity, "act:", "  ", out);
+          casheph_buf_putl (out, "  <act:commodity-scu>");
+          casheph_buf_put_int (out, account->commodity_scu);
+          casheph_buf_putl (out, "</act:commodity-scu>\n");
+        }
+    }
+  else
+    {
+      casheph_buf_put_elem (out, "", "  <act:type>", account->type,
+                            "</act:type>\n");
+      casheph_write_commodity (account->commodity, "act:", "  ", out);
+      casheph_buf_putl (out, "  <act:commodity-scu>");
+      casheph_buf_put_int (out, account->commodity_scu);
+      casheph_buf_putl (out, "</act:commodity-scu>\n");
+      if (account->description != NULL)
+        {
+          casheph_buf_put_elem (out, "", "  <act:description>",
+                                account->description, "</act:description>\n");
+        }
+      if (account->n_slots > 0)
+        {
+          casheph_buf_putl (out, "  <act:slots>\n");
+          int i;
+          for (i = 0; i < account->n_slots; ++i)
+            {
+              casheph_buf_putl (out, "    <slot>\n"
+                                "      <slot:key>placeholder</slot:key>\n"
+                                "      <slot:value type=\"string\">true</slot:value>\n"
+                                "    </slot>\n");
+            }
+          casheph_buf_putl (out, "  </act:slots>\n");
+        }
+      casheph_buf_put_elem (out, "", "  <act:parent type=\"guid\">",
+                            account->parent, "</act:parent>\n");
+    }
+  casheph_buf_putl (out, "</gnc:account>\n");
+}
+
+void
+casheph_write_accounts (casheph_account_t *account, casheph_buf_t *out)
+{
+  casheph_write_account (account, out);
   int i;
   for (i = 0; i < account->n_accounts; ++i)
     {
-      casheph_write_accounts (account->accounts[i], file);
+      casheph_write_accounts (account->accounts[i], out);
     }
 }
 
 void
-casheph_write_slot (const char *indent, casheph_slot_t *slot, gzFile file)
+casheph_write_slot (const char *indent, casheph_slot_t *slot,
+                    casheph_buf_t *out)
 {
-  gzprintf (file, "%s<slot>\n", indent);
-  gzprintf (file, "%s  <slot:key>%s</slot:key>\n", indent, slot->key);
+  casheph_buf_puts (out, indent);
+  casheph_buf_putl (out, "<slot>\n");
+  casheph_buf_put_elem (out, indent, "  <slot:key>", slot->key,
+                        "</slot:key>\n");
   casheph_gdate_t *date;
   casheph_frame_t *frame;
   int i;
@@ -737,34 +1694,45 @@ casheph_write_slot (const char *indent, casheph_slot_t *slot, gzFile file)
     {
     case ce_gdate:
       date = (casheph_gdate_t*)slot->value;
-      gzprintf (file, "%s  <slot:value type=\"gdate\">\n", indent);
-      gzprintf (file, "%s    <gdate>%04d-%02d-%02d</gdate>\n", indent,
-                date->year, date->month, date->day);
-      gzprintf (file, "%s  </slot:value>\n", indent);
+      casheph_buf_puts (out, indent);
+      casheph_buf_putl (out, "  <slot:value type=\"gdate\">\n");
+      casheph_buf_puts (out, indent);
+      casheph_buf_putl (out, "    <gdate>");
+      casheph_buf_put_gdate (out, date);
+      casheph_buf_putl (out, "</gdate>\n");
+      casheph_buf_puts (out, indent);
+      casheph_buf_putl (out, "  </slot:value>\n");
       break;
     case ce_numeric:
-      gzprintf (file, "%s  <slot:value type=\"numeric\">%d/%d</slot:value>\n",
-                indent,
-                ((casheph_val_t*)slot->value)->n,
-                ((casheph_val_t*)slot->value)->d);
+      casheph_buf_puts (out, indent);
+      casheph_buf_putl (out, "  <slot:value type=\"numeric\">");
+      casheph_buf_put_int (out, ((casheph_val_t*)slot->value)->n);
+      casheph_buf_putc (out, '/');
+      casheph_buf_put_int (out, (int32_t)((casheph_val_t*)slot->value)->d);
+      casheph_buf_putl (out, "</slot:value>\n");
       break;
     case ce_guid:
-      gzprintf (file, "%s  <slot:value type=\"guid\">%s</slot:value>\n", indent, (char*)slot->value);
+      casheph_buf_put_elem (out, indent, "  <slot:value type=\"guid\">",
+                            (char*)slot->value, "</slot:value>\n");
       break;
     case ce_string:
-      gzprintf (file, "%s  <slot:value type=\"string\">%s</slot:value>\n", indent, (char*)slot->value);
+      casheph_buf_put_elem (out, indent, "  <slot:value type=\"string\">",
+                            (char*)slot->value, "</slot:value>\n");
       break;
     case ce_frame:
       frame = (casheph_frame_t*)slot->value;
-      gzprintf (file, "%s  <slot:value type=\"frame\">\n", indent);
+      casheph_buf_puts (out, indent);
+      casheph_buf_putl (out, "  <slot:value type=\"frame\">\n");
       for (i = 0; i < frame->n_slots; ++i)
         {
-          casheph_write_slot (nextindent, frame->slots[i], file);
+          casheph_write_slot (nextindent, frame->slots[i], out);
         }
-      gzprintf (file, "%s  </slot:value>\n", indent);
+      casheph_buf_puts (out, indent);
+      casheph_buf_putl (out, "  </slot:value>\n");
       break;
     }
-  gzprintf (file, "%s</slot>\n", indent);
+  casheph_buf_puts (out, indent);
+  casheph_buf_putl (out, "</slot>\n");
 }
 
 casheph_slot_t *
@@ -782,197 +1750,259 @@ casheph_trn_get_slot (casheph_transaction_t *trn, const char *key)
 }
 
 void
-casheph_write_transaction (casheph_transaction_t *trn, gzFile file)
-{
-  gzputs (file, "<gnc:transaction version=\"2.0.0\">\n");
-  gzprintf (file, "  <trn:id type=\"guid\">%s</trn:id>\n", trn->id);
-  gzprintf (file, "  <trn:currency>\n");
-  gzprintf (file, "    <cmdty:space>ISO4217</cmdty:space>\n");
-  gzprintf (file, "    <cmdty:id>USD</cmdty:id>\n");
-  gzprintf (file, "  </trn:currency>\n");
-  gzprintf (file, "  <trn:date-posted>\n");
-  struct tm *tm = localtime (&trn->date_posted);
-  int hrs_off = timezone / 3600 - tm->tm_isdst;
-  int mins_off = (timezone / 60) % 60;
-  char sign = '+';
-  if (timezone > 0)
-    {
-      sign = '-';
-    }
-  char buf[1024];
-  strftime (buf, 1024, "%Y-%m-%d %H:%M:%S", tm);
-  gzprintf (file, "    <ts:date>%s %c%02d%02d</ts:date>\n", buf, sign, hrs_off, mins_off);
-  gzprintf (file, "  </trn:date-posted>\n");
-  gzprintf (file, "  <trn:date-entered>\n");
-  tm = localtime (&trn->date_entered);
-  hrs_off = timezone / 3600 - tm->tm_isdst;
-  mins_off = (timezone / 60) % 60;
-  sign = '+';
-  if (timezone > 0)
-    {
-      sign = '-';
-    }
-  strftime (buf, 1024, "%Y-%m-%d %H:%M:%S", tm);
-  gzprintf (file, "    <ts:date>%s %c%02d%02d</ts:date>\n", buf, sign, hrs_off, mins_off);
-  gzprintf (file, "  </trn:date-entered>\n");
-  gzprintf (file, "  <trn:description>%s</trn:description>\n", trn->desc);
+casheph_write_transaction (casheph_transaction_t *trn, casheph_buf_t *out)
+{
+  casheph_buf_putl (out, "<gnc:transaction version=\"2.0.0\">\n");
+  casheph_buf_put_elem (out, "", "  <trn:id type=\"guid\">", trn->id,
+                        "</trn:id>\n");
+  casheph_buf_putl (out, "  <trn:currency>\n"
+                    "    <cmdty:space>ISO4217</cmdty:space>\n"
+                    "    <cmdty:id>USD</cmdty:id>\n"
+                    "  </trn:currency>\n"
+                    "  <trn:date-posted>\n"
+                    "    <ts:date>");
+  casheph_buf_put_ts (out, trn->date_posted);
+  casheph_buf_putl (out, "</ts:date>\n"
+                    "  </trn:date-posted>\n"
+                    "  <trn:date-entered>\n"
+                    "    <ts:date>");
+  casheph_buf_put_ts (out, trn->date_entered);
+  casheph_buf_putl (out, "</ts:date>\n"
+                    "  </trn:date-entered>\n");
+  casheph_buf_put_elem (out, "", "  <trn:description>",
+                        trn->desc ? trn->desc : "", "</trn:description>\n");
+  int i;
   if (trn->n_slots > 0)
     {
-      gzprintf (file, "  <trn:slots>\n");
-      int i;
+      casheph_buf_putl (out, "  <trn:slots>\n");
       for (i = 0; i < trn->n_slots; ++i)
         {
-          casheph_write_slot ("    ", trn->slots[i], file);
+          casheph_write_slot ("    ", trn->slots[i], out);
         }
-      gzprintf (file, "  </trn:slots>\n");
+      casheph_buf_putl (out, "  </trn:slots>\n");
     }
   if (trn->n_splits > 0)
     {
-      gzprintf (file, "  <trn:splits>\n");
-      int i;
+      casheph_buf_putl (out, "  <trn:splits>\n");
       for (i = 0; i < trn->n_splits; ++i)
         {
-          gzprintf (file, "    <trn:split>\n");
-          gzprintf (file, "      <split:id type=\"guid\">%s</split:id>\n", trn->splits[i]->id);
-          gzprintf (file, "      <split:reconciled-state>%s</split:reconciled-state>\n", trn->splits[i]->reconciled_state);
-          casheph_val_t *val = trn->splits[i]->value;
-          int32_t n = val->n;
-          uint32_t d = val->d;
-          gzprintf (file, "      <split:value>%d/%d</split:value>\n", n, d);
-          val = trn->splits[i]->quantity;
-          n = val->n;
-          d = val->d;
-          gzprintf (file, "      <split:quantity>%d/%d</split:quantity>\n", n, d);
-          gzprintf (file, "      <split:account type=\"guid\">%s</split:account>\n", trn->splits[i]->account);
-          if (trn->splits[i]->n_slots > 0)
+          casheph_split_t *split = trn->splits[i];
+          casheph_buf_putl (out, "    <trn:split>\n");
+          casheph_buf_put_elem (out, "", "      <split:id type=\"guid\">",
+                                split->id, "</split:id>\n");
+          casheph_buf_putl (out, "      <split:reconciled-state>");
+          casheph_buf_putc (out, split->reconciled_state);
+          casheph_buf_putl (out, "</split:reconciled-state>\n"
+                            "      <split:value>");
+          casheph_buf_put_wval (out, split->value);
+          casheph_buf_putl (out, "</split:value>\n"
+                            "      <split:quantity>");
+          casheph_buf_put_wval (out, split->quantity);
+          casheph_buf_putl (out, "</split:quantity>\n");
+          casheph_buf_put_elem (out, "", "      <split:account type=\"guid\">",
+                                split->account, "</split:account>\n");
+          if (split->n_slots > 0)
             {
-              gzprintf (file, "      <split:slots>\n");
+              casheph_buf_putl (out, "      <split:slots>\n");
               int j;
-              for (j = 0; j < trn->splits[i]->n_slots; ++j)
+              for (j = 0; j < split->n_slots; ++j)
                 {
-                  casheph_write_slot ("        ", trn->splits[i]->slots[j], file);
+                  casheph_write_slot ("        ", split->slots[j], out);
                 }
-              gzprintf (file, "      </split:slots>\n");
+              casheph_buf_putl (out, "      </split:slots>\n");
             }
-          gzprintf (file, "    </trn:split>\n");
+          casheph_buf_putl (out, "    </trn:split>\n");
         }
-      gzprintf (file, "  </trn:splits>\n");
+      casheph_buf_putl (out, "  </trn:splits>\n");
     }
-  gzputs (file, "</gnc:transaction>\n");
+  casheph_buf_putl (out, "</gnc:transaction>\n");
 }
 
 void
-casheph_write_recurrence (casheph_recurrence_t *recurrence, gzFile file)
+casheph_write_recurrence (casheph_recurrence_t *recurrence, casheph_buf_t *out)
 {
-  gzputs (file, "    <gnc:recurrence version=\"1.0.0\">\n");
-  gzprintf (file, "      <recurrence:mult>%d</recurrence:mult>\n",
-            recurrence->mult);
-  gzprintf (file, "      <recurrence:period_type>%s</recurrence:period_type>\n",
-            recurrence->period_type);
-  gzputs (file, "      <recurrence:start>\n");
-  gzprintf (file, "        <gdate>%04d-%02d-%02d</gdate>\n",
-            recurrence->start->year,
-            recurrence->start->month,
-            recurrence->start->day);
-  gzputs (file, "      </recurrence:start>\n");
+  casheph_buf_putl (out, "    <gnc:recurrence version=\"1.0.0\">\n"
+                    "      <recurrence:mult>");
+  casheph_buf_put_int (out, recurrence->mult);
+  casheph_buf_putl (out, "</recurrence:mult>\n");
+  casheph_buf_put_elem (out, "", "      <recurrence:period_type>",
+                        recurrence->period_type, "</recurrence:period_type>\n");
+  casheph_buf_putl (out, "      <recurrence:start>\n"
+                    "        <gdate>");
+  casheph_buf_put_gdate (out, recurrence->start);
+  casheph_buf_putl (out, "</gdate>\n"
+                    "      </recurrence:start>\n");
   if (recurrence->weekend_adj != NULL)
     {
-      gzprintf (file, "      <recurrence:weekend_adj>%s</recurrence:weekend_adj>\n",
-                recurrence->weekend_adj);
+      casheph_buf_put_elem (out, "", "      <recurrence:weekend_adj>",
+                            recurrence->weekend_adj,
+                            "</recurrence:weekend_adj>\n");
     }
-  gzputs (file, "    </gnc:recurrence>\n");
+  casheph_buf_putl (out, "    </gnc:recurrence>\n");
 }
 
 void
-casheph_write_schedule (casheph_schedule_t *schedule, gzFile file)
+casheph_write_schedule (casheph_schedule_t *schedule, casheph_buf_t *out)
 {
-  gzputs (file, "  <sx:schedule>\n");
+  casheph_buf_putl (out, "  <sx:schedule>\n");
   int i;
   for (i = 0; i < schedule->n_recurrences; ++i)
     {
-      casheph_write_recurrence (schedule->recurrences[i], file);
+      casheph_write_recurrence (schedule->recurrences[i], out);
     }
-  gzputs (file, "  </sx:schedule>\n");
+  casheph_buf_putl (out, "  </sx:schedule>\n");
+}
+
+void
+casheph_write_sx_int (const char *open, int v, const char *close,
+                      casheph_buf_t *out)
+{
+  casheph_buf_puts (out, open);
+  casheph_buf_put_int (out, v);
+  casheph_buf_puts (out, close);
 }
 
 void
-casheph_write_schedxaction (casheph_schedxaction_t *sx, gzFile file)
+casheph_write_schedxaction (casheph_schedxaction_t *sx, casheph_buf_t *out)
 {
-  gzputs (file, "<gnc:schedxaction version=\"2.0.0\">\n");
-  gzprintf (file, "  <sx:id type=\"guid\">%s</sx:id>\n",
-            sx->id);
-  gzprintf (file, "  <sx:name>%s</sx:name>\n",
-            sx->name);
-  gzprintf (file, "  <sx:enabled>%c</sx:enabled>\n",
-            (sx->enabled?'y':'n'));
-  gzprintf (file, "  <sx:autoCreate>%c</sx:autoCreate>\n",
-            (sx->auto_create?'y':'n'));
-  gzprintf (file, "  <sx:autoCreateNotify>%c</sx:autoCreateNotify>\n",
-            (sx->auto_create_notify?'y':'n'));
-  gzprintf (file, "  <sx:advanceCreateDays>%d</sx:advanceCreateDays>\n",
-            sx->advance_create_days);
-  gzprintf (file, "  <sx:advanceRemindDays>%d</sx:advanceRemindDays>\n",
-            sx->advance_remind_days);
-  gzprintf (file, "  <sx:instanceCount>%d</sx:instanceCount>\n",
-            sx->instance_count);
+  casheph_buf_putl (out, "<gnc:schedxaction version=\"2.0.0\">\n");
+  casheph_buf_put_elem (out, "", "  <sx:id type=\"guid\">", sx->id,
+                        "</sx:id>\n");
+  casheph_buf_put_elem (out, "", "  <sx:name>", sx->name, "</sx:name>\n");
+  casheph_buf_putl (out, "  <sx:enabled>");
+  casheph_buf_putc (out, sx->enabled ? 'y' : 'n');
+  casheph_buf_putl (out, "</sx:enabled>\n"
+                    "  <sx:autoCreate>");
+  casheph_buf_putc (out, sx->auto_create ? 'y' : 'n');
+  casheph_buf_putl (out, "</sx:autoCreate>\n"
+                    "  <sx:autoCreateNotify>");
+  casheph_buf_putc (out, sx->auto_create_notify ? 'y' : 'n');
+  casheph_buf_putl (out, "</sx:autoCreateNotify>\n");
+  casheph_write_sx_int ("  <sx:advanceCreateDays>", sx->advance_create_days,
+                        "</sx:advanceCreateDays>\n", out);
+  casheph_write_sx_int ("  <sx:advanceRemindDays>", sx->advance_remind_days,
+                        "</sx:advanceRemindDays>\n", out);
+  casheph_write_sx_int ("  <sx:instanceCount>", sx->instance_count,
+                        "</sx:instanceCount>\n", out);
   if (sx->start != NULL)
     {
-      gzputs (file, "  <sx:start>\n");
-      gzprintf (file, "    <gdate>%04d-%02d-%02d</gdate>\n",
-                sx->start->year,
-                sx->start->month,
-                sx->start->day);
-      gzputs (file, "  </sx:start>\n");
+      casheph_buf_putl (out, "  <sx:start>\n"
+                        "    <gdate>");
+      casheph_buf_put_gdate (out, sx->start);
+      casheph_buf_putl (out, "</gdate>\n"
+                        "  </sx:start>\n");
     }
   if (sx->last != NULL)
     {
-      gzputs (file, "  <sx:last>\n");
-      gzprintf (file, "    <gdate>%04d-%02d-%02d</gdate>\n",
-                sx->last->year,
-                sx->last->month,
-                sx->last->day);
-      gzputs (file, "  </sx:last>\n");
+      casheph_buf_putl (out, "  <sx:last>\n"
+                        "    <gdate>");
+      casheph_buf_put_gdate (out, sx->last);
+      casheph_buf_putl (out, "</gdate>\n"
+                        "  </sx:last>\n");
+    }
+  casheph_buf_put_elem (out, "", "  <sx:templ-acct type=\"guid\">",
+                        sx->templ_acct, "</sx:templ-acct>\n");
+  casheph_write_schedule (sx->schedule, out);
+  casheph_buf_putl (out, "</gnc:schedxaction>\n");
+}
+
+void
+casheph_write_transactions (casheph_t *ce, casheph_buf_t *out)
+{
+  int i;
+  if (ce->xml_tz == NULL)
+    {
+      for (i = 0; i < ce->n_transactions; ++i)
+        {
+          casheph_write_transaction (ce->transactions[i], out);
+        }
+      return;
+    }
+  casheph_buf_t scratch;
+  casheph_buf_init (&scratch, 4096, NULL, NULL);
+  for (i = 0; i < ce->n_transactions; ++i)
+    {
+      casheph_transaction_t *trn = ce->transactions[i];
+      if (trn->xml == NULL)
+        {
+          scratch.len = 0;
+          casheph_write_transaction (trn, &scratch);
+          trn->xml = (char*)malloc (scratch.len);
+          memcpy (trn->xml, scratch.data, scratch.len);
+          trn->xml_len = scratch.len;
+        }
+      casheph_buf_put (out, trn->xml, trn->xml_len);
     }
-  gzprintf (file, "  <sx:templ-acct type=\"guid\">%s</sx:templ-acct>\n",
-            sx->templ_acct);
-  casheph_write_schedule (sx->schedule, file);
-  gzputs (file, "</gnc:schedxaction>\n");
+  casheph_buf_free (&scratch);
+}
+
+void
+casheph_trn_touch (casheph_t *ce, casheph_transaction_t *trn)
+{
+  ++ce->mod_count;
+  trn->version = ce->mod_count;
+  free (trn->xml);
+  trn->xml = NULL;
+  trn->xml_len = 0;
 }
 
 void
-casheph_write_transactions (casheph_t *ce, gzFile file)
+casheph_drop_fragments (casheph_t *ce)
 {
   int i;
   for (i = 0; i < ce->n_transactions; ++i)
     {
-      casheph_write_transaction (ce->transactions[i], file);
+      free (ce->transactions[i]->xml);
+      ce->transactions[i]->xml = NULL;
+      ce->transactions[i]->xml_len = 0;
     }
+  free (ce->xml_tz);
+  ce->xml_tz = NULL;
 }
 
+/* Start or stop caching transaction XML for this save. */
 void
-casheph_write_schedxactions (casheph_t *ce, gzFile file)
+casheph_prepare_fragments (casheph_t *ce, bool keep)
+{
+  const char *tz = getenv ("TZ");
+  if (tz == NULL)
+    {
+      tz = "";
+    }
+  if (ce->xml_tz != NULL && (!keep || strcmp (ce->xml_tz, tz) != 0))
+    {
+      casheph_drop_fragments (ce);
+    }
+  if (keep && ce->xml_tz == NULL)
+    {
+      ce->xml_tz = strdup (tz);
+    }
+}
+
+void
+casheph_write_schedxactions (casheph_t *ce, casheph_buf_t *out)
 {
   int i;
   for (i = 0; i < ce->n_schedxactions; ++i)
     {
-      casheph_write_schedxaction (ce->schedxactions[i], file);
+      casheph_write_schedxaction (ce->schedxactions[i], out);
     }
 }
 
 void
-casheph_write_template_transactions (casheph_t *ce, gzFile file)
+casheph_write_template_transactions (casheph_t *ce, casheph_buf_t *out)
 {
   int i;
   for (i = 0; i < ce->n_template_transactions; ++i)
     {
-      casheph_write_transaction (ce->template_transactions[i], file);
+      casheph_write_transaction (ce->template_transactions[i], out);
     }
 }
 
-casheph_val_t *
+casheph_wval_t *
 casheph_trn_value_for_act (casheph_transaction_t *trn, casheph_account_t *act)
 {
-  casheph_val_t *val = NULL;
+  casheph_wval_t *val = NULL;
   int i;
   for (i = 0; i < trn->n_splits; ++i)
     {
@@ -986,54 +2016,55 @@ casheph_trn_value_for_act (casheph_transaction_t *trn, casheph_account_t *act)
 }
 
 void
-casheph_save (casheph_t *ce, const char *filename)
+casheph_write_book_head (casheph_t *ce, casheph_buf_t *out)
 {
-  gzFile file = gzopen (filename, "w");
-  gzputs (file, "<?xml version=\"1.0\" encoding=\"utf-8\" ?>\n");
-  gzputs (file, "<gnc-v2\n");
-  gzputs (file, "     xmlns:gnc=\"http://www.gnucash.org/XML/gnc\"\n");
-  gzputs (file, "     xmlns:act=\"http://www.gnucash.org/XML/act\"\n");
-  gzputs (file, "     xmlns:book=\"http://www.gnucash.org/XML/book\"\n");
-  gzputs (file, "     xmlns:cd=\"http://www.gnucash.org/XML/cd\"\n");
-  gzputs (file, "     xmlns:cmdty=\"http://www.gnucash.org/XML/cmdty\"\n");
-  gzputs (file, "     xmlns:price=\"http://www.gnucash.org/XML/price\"\n");
-  gzputs (file, "     xmlns:slot=\"http://www.gnucash.org/XML/slot\"\n");
-  gzputs (file, "     xmlns:split=\"http://www.gnucash.org/XML/split\"\n");
-  gzputs (file, "     xmlns:sx=\"http://www.gnucash.org/XML/sx\"\n");
-  gzputs (file, "     xmlns:trn=\"http://www.gnucash.org/XML/trn\"\n");
-  gzputs (file, "     xmlns:ts=\"http://www.gnucash.org/XML/ts\"\n");
-  gzputs (file, "     xmlns:fs=\"http://www.gnucash.org/XML/fs\"\n");
-  gzputs (file, "     xmlns:bgt=\"http://www.gnucash.org/XML/bgt\"\n");
-  gzputs (file, "     xmlns:recurrence=\"http://www.gnucash.org/XML/recurrence\"\n");
-  gzputs (file, "     xmlns:lot=\"http://www.gnucash.org/XML/lot\"\n");
-  gzputs (file, "     xmlns:addr=\"http://www.gnucash.org/XML/addr\"\n");
-  gzputs (file, "     xmlns:owner=\"http://www.gnucash.org/XML/owner\"\n");
-  gzputs (file, "     xmlns:billterm=\"http://www.gnucash.org/XML/billterm\"\n");
-  gzputs (file, "     xmlns:bt-days=\"http://www.gnucash.org/XML/bt-days\"\n");
-  gzputs (file, "     xmlns:bt-prox=\"http://www.gnucash.org/XML/bt-prox\"\n");
-  gzputs (file, "     xmlns:cust=\"http://www.gnucash.org/XML/cust\"\n");
-  gzputs (file, "     xmlns:employee=\"http://www.gnucash.org/XML/employee\"\n");
-  gzputs (file, "     xmlns:entry=\"http://www.gnucash.org/XML/entry\"\n");
-  gzputs (file, "     xmlns:invoice=\"http://www.gnucash.org/XML/invoice\"\n");
-  gzputs (file, "     xmlns:job=\"http://www.gnucash.org/XML/job\"\n");
-  gzputs (file, "     xmlns:order=\"http://www.gnucash.org/XML/order\"\n");
-  gzputs (file, "     xmlns:taxtable=\"http://www.gnucash.org/XML/taxtable\"\n");
-  gzputs (file, "     xmlns:tte=\"http://www.gnucash.org/XML/tte\"\n");
-  gzputs (file, "     xmlns:vendor=\"http://www.gnucash.org/XML/vendor\">\n");
-  gzputs (file, "<gnc:count-data cd:type=\"book\">1</gnc:count-data>\n");
-  gzputs (file, "<gnc:book version=\"2.0.0\">\n");
-  gzprintf (file, "<book:id type=\"guid\">%s</book:id>\n", ce->book_id);
-  gzputs (file, "<gnc:count-data cd:type=\"commodity\">1</gnc:count-data>\n");
-  gzprintf (file, "<gnc:count-data cd:type=\"account\">%d</gnc:count-data>\n",
-            casheph_count_accounts (ce));
-  gzprintf (file, "<gnc:count-data cd:type=\"transaction\">%d</gnc:count-data>\n",
-            ce->n_transactions);
+  casheph_buf_putl (out, "<?xml version=\"1.0\" encoding=\"utf-8\" ?>\n\
+<gnc-v2\n\
+     xmlns:gnc=\"http://www.gnucash.org/XML/gnc\"\n\
+     xmlns:act=\"http://www.gnucash.org/XML/act\"\n\
+     xmlns:book=\"http://www.gnucash.org/XML/book\"\n\
+     xmlns:cd=\"http://www.gnucash.org/XML/cd\"\n\
+     xmlns:cmdty=\"http://www.gnucash.org/XML/cmdty\"\n\
+     xmlns:price=\"http://www.gnucash.org/XML/price\"\n\
+     xmlns:slot=\"http://www.gnucash.org/XML/slot\"\n\
+     xmlns:split=\"http://www.gnucash.org/XML/split\"\n\
+     xmlns:sx=\"http://www.gnucash.org/XML/sx\"\n\
+     xmlns:trn=\"http://www.gnucash.org/XML/trn\"\n\
+     xmlns:ts=\"http://www.gnucash.org/XML/ts\"\n\
+     xmlns:fs=\"http://www.gnucash.org/XML/fs\"\n\
+     xmlns:bgt=\"http://www.gnucash.org/XML/bgt\"\n\
+     xmlns:recurrence=\"http://www.gnucash.org/XML/recurrence\"\n\
+     xmlns:lot=\"http://www.gnucash.org/XML/lot\"\n\
+     xmlns:addr=\"http://www.gnucash.org/XML/addr\"\n\
+     xmlns:owner=\"http://www.gnucash.org/XML/owner\"\n\
+     xmlns:billterm=\"http://www.gnucash.org/XML/billterm\"\n\
+     xmlns:bt-days=\"http://www.gnucash.org/XML/bt-days\"\n\
+     xmlns:bt-prox=\"http://www.gnucash.org/XML/bt-prox\"\n\
+     xmlns:cust=\"http://www.gnucash.org/XML/cust\"\n\
+     xmlns:employee=\"http://www.gnucash.org/XML/employee\"\n\
+     xmlns:entry=\"http://www.gnucash.org/XML/entry\"\n\
+     xmlns:invoice=\"http://www.gnucash.org/XML/invoice\"\n\
+     xmlns:job=\"http://www.gnucash.org/XML/job\"\n\
+     xmlns:order=\"http://www.gnucash.org/XML/order\"\n\
+     xmlns:taxtable=\"http://www.gnucash.org/XML/taxtable\"\n\
+     xmlns:tte=\"http://www.gnucash.org/XML/tte\"\n\
+     xmlns:vendor=\"http://www.gnucash.org/XML/vendor\">\n\
+<gnc:count-data cd:type=\"book\">1</gnc:count-data>\n\
+<gnc:book version=\"2.0.0\">\n");
+  casheph_buf_put_elem (out, "", "<book:id type=\"guid\">", ce->book_id,
+                        "</book:id>\n");
+  casheph_buf_putl (out, "<gnc:count-data cd:type=\"commodity\">1</gnc:count-data>\n");
+  casheph_write_sx_int ("<gnc:count-data cd:type=\"account\">",
+                        casheph_count_accounts (ce), "</gnc:count-data>\n", out);
+  casheph_write_sx_int ("<gnc:count-data cd:type=\"transaction\">",
+                        ce->n_transactions, "</gnc:count-data>\n", out);
   if (ce->n_template_transactions > 0)
     {
-      gzprintf (file, "<gnc:count-data cd:type=\"schedxaction\">%d</gnc:count-data>\n",
-                ce->n_template_transactions);
+      casheph_write_sx_int ("<gnc:count-data cd:type=\"schedxaction\">",
+                            ce->n_template_transactions,
+                            "</gnc:count-data>\n", out);
     }
-  gzputs (file, "<gnc:commodity version=\"2.0.0\">\n\
+  casheph_buf_putl (out, "<gnc:commodity version=\"2.0.0\">\n\
   <cmdty:space>ISO4217</cmdty:space>\n\
   <cmdty:id>USD</cmdty:id>\n\
   <cmdty:get_quotes/>\n\
@@ -1047,175 +2078,4377 @@ casheph_save (casheph_t *ce, const char *filename)
   <cmdty:xcode>template</cmdty:xcode>\n\
   <cmdty:fraction>1</cmdty:fraction>\n\
 </gnc:commodity>\n");
+  casheph_write_accounts (ce->root, out);
+}
 
-  casheph_write_accounts (ce->root, file);
-  casheph_write_transactions (ce, file);
-
+void
+casheph_write_book_tail (casheph_t *ce, casheph_buf_t *out)
+{
   if (ce->n_template_transactions > 0)
     {
-      gzputs (file, "<gnc:template-transactions>\n");
-      casheph_write_accounts (ce->template_root, file);
-      casheph_write_template_transactions (ce, file);
-      gzputs (file, "</gnc:template-transactions>\n");
-      casheph_write_schedxactions (ce, file);
+      casheph_buf_putl (out, "<gnc:template-transactions>\n");
+      casheph_write_accounts (ce->template_root, out);
+      casheph_write_template_transactions (ce, out);
+      casheph_buf_putl (out, "</gnc:template-transactions>\n");
+      casheph_write_schedxactions (ce, out);
     }
 
-  gzputs (file, "</gnc:book>\n");
-  gzputs (file, "</gnc-v2>\n");
-  gzputs (file, "\n");
-  gzputs (file, "<!-- Local variables: -->\n");
-  gzputs (file, "<!-- mode: xml        -->\n");
-  gzputs (file, "<!-- End:             -->\n");
-  gzclose (file);
+  casheph_buf_putl (out, "</gnc:book>\n\
+</gnc-v2>\n\
+\n\
+<!-- Local variables: -->\n\
+<!-- mode: xml        -->\n\
+<!-- End:             -->\n");
 }
 
 void
-casheph_val_destroy (casheph_val_t *v)
+casheph_write_book (casheph_t *ce, casheph_buf_t *out)
 {
-  free (v);
+  casheph_write_book_head (ce, out);
+  casheph_write_transactions (ce, out);
+  casheph_write_book_tail (ce, out);
 }
 
-void casheph_slot_destroy (casheph_slot_t *s);
+/* Fingerprint of serialized content: CRC-32, Adler-32 and length. */
+typedef struct
+{
+  uint32_t crc;
+  uint32_t adler;
+  uint64_t len;
+} casheph_digest_t;
 
 void
-casheph_frame_destroy (casheph_frame_t *f)
+casheph_digest_init (casheph_digest_t *digest)
 {
-  int i;
-  for (i = 0; i < f->n_slots; ++i)
-    {
-      casheph_slot_destroy (f->slots[i]);
-    }
-  free (f->slots);
-  free (f);
+  digest->crc = crc32 (0, Z_NULL, 0);
+  digest->adler = adler32 (0, Z_NULL, 0);
+  digest->len = 0;
 }
 
 void
-casheph_slot_destroy (casheph_slot_t *s)
+casheph_digest_update (casheph_digest_t *digest, const char *data, size_t len)
 {
-  free (s->key);
-  switch (s->type)
-    {
-    case ce_gdate:
-      free (s->value);
-      break;
-    case ce_string:
-      free (s->value);
-      break;
-    case ce_guid:
-      free (s->value);
-      break;
-    case ce_numeric:
-      casheph_val_destroy (s->value);
-      break;
-    case ce_frame:
-      casheph_frame_destroy (s->value);
-      break;
-    }
-  free (s);
+  digest->crc = crc32 (digest->crc, (const Bytef*)data, len);
+  digest->adler = adler32 (digest->adler, (const Bytef*)data, len);
+  digest->len += len;
 }
 
-void
-casheph_split_destroy (casheph_split_t *s)
+bool
+casheph_digest_equal (const casheph_digest_t *a, const casheph_digest_t *b)
 {
-  free (s->id);
-  free (s->reconciled_state);
-  casheph_val_destroy (s->value);
-  casheph_val_destroy (s->quantity);
-  free (s->account);
-  int i;
-  for (i = 0; i < s->n_slots; ++i)
-    {
-      casheph_slot_destroy (s->slots[i]);
-    }
-  free (s->slots);
-  free (s);
+  return a->crc == b->crc && a->adler == b->adler && a->len == b->len;
 }
 
-void
-casheph_trn_destroy (casheph_transaction_t *t)
+/* Where casheph_save_with sends the serialized book: through deflate,
+   or straight to FILE when PLAIN is set. */
+typedef struct
 {
-  free (t->id);
-  free (t->desc);
-  int i;
-  for (i = 0; i < t->n_splits; ++i)
+  casheph_digest_t digest;
+  z_stream zs;
+  bool plain;
+  FILE *file;
+  unsigned char *out;
+  size_t out_cap;
+  uint64_t raw_bytes;
+  uint64_t out_bytes;
+} casheph_save_sink_t;
+
+bool
+casheph_sink_write (casheph_save_sink_t *sink, const char *data,
+                    size_t len, int flush)
+{
+  sink->raw_bytes += len;
+  casheph_digest_update (&sink->digest, data, len);
+  if (sink->plain)
     {
-      casheph_split_destroy (t->splits[i]);
+      sink->out_bytes += len;
+      return len == 0 || fwrite (data, 1, len, sink->file) == len;
     }
-  free (t->splits);
-  for (i = 0; i < t->n_slots; ++i)
+  sink->zs.next_in = (Bytef*)data;
+  sink->zs.avail_in = len;
+  do
     {
-      casheph_slot_destroy (t->slots[i]);
+      sink->zs.next_out = sink->out;
+      sink->zs.avail_out = sink->out_cap;
+      int res = deflate (&sink->zs, flush);
+      if (res == Z_STREAM_ERROR)
+        {
+          return false;
+        }
+      size_t n = sink->out_cap - sink->zs.avail_out;
+      if (n > 0 && fwrite (sink->out, 1, n, sink->file) != n)
+        {
+          return false;
+        }
+      sink->out_bytes += n;
     }
-  free (t->slots);
+  while (sink->zs.avail_out == 0);
+  return true;
+}
+
+bool
+casheph_sink_flush (casheph_buf_t *buf)
+{
+  return casheph_sink_write ((casheph_save_sink_t*)buf->ctx, buf->data,
+                             buf->len, Z_NO_FLUSH);
+}
+
+double
+casheph_now ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+casheph_save_fill_stats (casheph_save_stats_t *stats, uint64_t raw_bytes,
+                         uint64_t out_bytes, double start)
+{
+  if (stats == NULL)
+    {
+      return;
+    }
+  stats->wrote = true;
+  stats->raw_bytes = raw_bytes;
+  stats->out_bytes = out_bytes;
+  stats->seconds = casheph_now () - start;
+  stats->mb_per_sec = 0;
+  if (stats->seconds > 0)
+    {
+      stats->mb_per_sec = raw_bytes / 1e6 / stats->seconds;
+    }
+  stats->ratio = 0;
+  if (out_bytes > 0)
+    {
+      stats->ratio = (double)raw_bytes / out_bytes;
+    }
+}
+
+void
+casheph_save_opts_init (casheph_save_opts_t *opts)
+{
+  opts->level = Z_DEFAULT_COMPRESSION;
+  opts->strategy = Z_DEFAULT_STRATEGY;
+  opts->uncompressed = false;
+  opts->buffer_size = 1 << 18;
+  opts->n_threads = 1;
+  opts->keep_fragments = false;
+}
+
+/* Parallel compression: the serialized book is cut into blocks which
+   are raw-deflated independently, each primed with the last 32K of the
+   block before it as a preset dictionary, and ended with a sync flush
+   (the last with Z_FINISH) so they concatenate into one deflate
+   stream. */
+typedef struct
+{
+  const char *data;
+  size_t len;
+  size_t block_size;
+  int n_blocks;
+  int level;
+  int strategy;
+  int first;
+  int stride;
+  unsigned char **out;
+  size_t *out_len;
+  uLong *crcs;
+  bool ok;
+} casheph_gzip_job_t;
+
+bool
+casheph_gzip_block (casheph_gzip_job_t *job, int b)
+{
+  size_t start = (size_t)b * job->block_size;
+  size_t len = job->len - start < job->block_size ? job->len - start : job->block_size;
+  bool last = b == job->n_blocks - 1;
+  z_stream zs;
+  memset (&zs, 0, sizeof (z_stream));
+  if (deflateInit2 (&zs, job->level, Z_DEFLATED, -15, 8,
+                    job->strategy) != Z_OK)
+    {
+      return false;
+    }
+  if (b > 0)
+    {
+      size_t dict = start < 32768 ? start : 32768;
+      deflateSetDictionary (&zs, (const Bytef*)job->data + start - dict, dict);
+    }
+  /* Room for the sync flush marker on top of the worst case. */
+  size_t cap = deflateBound (&zs, len) + 16;
+  unsigned char *out = (unsigned char*)malloc (cap);
+  zs.next_in = (Bytef*)job->data + start;
+  zs.avail_in = len;
+  zs.next_out = out;
+  zs.avail_out = cap;
+  int res = deflate (&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+  bool ok = (last ? res == Z_STREAM_END : res == Z_OK) && zs.avail_in == 0;
+  job->out[b] = out;
+  job->out_len[b] = cap - zs.avail_out;
+  job->crcs[b] = crc32 (crc32 (0, Z_NULL, 0), (const Bytef*)job->data + start, len);
+  deflateEnd (&zs);
+  return ok;
+}
+
+void *
+casheph_gzip_worker (void *data)
+{
+  casheph_gzip_job_t *job = (casheph_gzip_job_t*)data;
+  int b;
+  for (b = job->first; b < job->n_blocks; b += job->stride)
+    {
+      if (!casheph_gzip_block (job, b))
+        {
+          job->ok = false;
+        }
+    }
+  return NULL;
+}
+
+void
+casheph_put_le32 (unsigned char *p, uint32_t v)
+{
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  p[2] = (v >> 16) & 0xff;
+  p[3] = (v >> 24) & 0xff;
+}
+
+/* Compress LEN bytes of DATA into FILE as a gzip stream, returning the
+   number of bytes written or 0 on failure. */
+uint64_t
+casheph_gzip_parallel (const char *data, size_t len, FILE *file,
+                       const casheph_save_opts_t *opts, size_t block_size)
+{
+  /* Smaller blocks would lose too much to the reset dictionaries. */
+  if (block_size < 32768)
+    {
+      block_size = 32768;
+    }
+  int n_threads = opts->n_threads;
+  if (n_threads <= 0)
+    {
+      n_threads = (int)sysconf (_SC_NPROCESSORS_ONLN);
+    }
+  int n_blocks = len > 0 ? (int)((len + block_size - 1) / block_size) : 1;
+  if (n_threads > n_blocks)
+    {
+      n_threads = n_blocks;
+    }
+  if (n_threads < 1)
+    {
+      n_threads = 1;
+    }
+
+  unsigned char **out = (unsigned char**)calloc (n_blocks, sizeof (unsigned char*));
+  size_t *out_len = (size_t*)calloc (n_blocks, sizeof (size_t));
+  uLong *crcs = (uLong*)calloc (n_blocks, sizeof (uLong));
+  casheph_gzip_job_t *jobs = (casheph_gzip_job_t*)malloc (sizeof (casheph_gzip_job_t) * n_threads);
+  pthread_t *threads = (pthread_t*)malloc (sizeof (pthread_t) * n_threads);
+  bool *started = (bool*)calloc (n_threads, sizeof (bool));
+  int i;
+  for (i = 0; i < n_threads; ++i)
+    {
+      jobs[i].data = data;
+      jobs[i].len = len;
+      jobs[i].block_size = block_size;
+      jobs[i].n_blocks = n_blocks;
+      jobs[i].level = opts->level;
+      jobs[i].strategy = opts->strategy;
+      jobs[i].first = i;
+      jobs[i].stride = n_threads;
+      jobs[i].out = out;
+      jobs[i].out_len = out_len;
+      jobs[i].crcs = crcs;
+      jobs[i].ok = true;
+    }
+  for (i = 1; i < n_threads; ++i)
+    {
+      started[i] = pthread_create (&threads[i], NULL, casheph_gzip_worker,
+                                   &jobs[i]) == 0;
+      if (!started[i])
+        {
+          casheph_gzip_worker (&jobs[i]);
+        }
+    }
+  casheph_gzip_worker (&jobs[0]);
+  bool ok = jobs[0].ok;
+  for (i = 1; i < n_threads; ++i)
+    {
+      if (started[i])
+        {
+          pthread_join (threads[i], NULL);
+        }
+      ok = ok && jobs[i].ok;
+    }
+
+  /* The header zlib itself writes: no name or mtime, OS Unix. */
+  const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+  uint64_t written = 0;
+  if (ok && fwrite (header, 1, 10, file) != 10)
+    {
+      ok = false;
+    }
+  written += 10;
+  uLong crc = crc32 (0, Z_NULL, 0);
+  int b;
+  for (b = 0; b < n_blocks; ++b)
+    {
+      if (ok && fwrite (out[b], 1, out_len[b], file) != out_len[b])
+        {
+          ok = false;
+        }
+      written += out_len[b];
+      size_t block_len = len - (size_t)b * block_size < block_size ? len - (size_t)b * block_size : block_size;
+      crc = crc32_combine (crc, crcs[b], block_len);
+      free (out[b]);
+    }
+  unsigned char trailer[8];
+  casheph_put_le32 (trailer, crc);
+  casheph_put_le32 (trailer + 4, (uint32_t)len);
+  if (ok && fwrite (trailer, 1, 8, file) != 8)
+    {
+      ok = false;
+    }
+  written += 8;
+
+  free (out);
+  free (out_len);
+  free (crcs);
+  free (jobs);
+  free (threads);
+  free (started);
+  return ok ? written : 0;
+}
+
+/* Write what WRITE produces for CTX to FILENAME as OPTS asks, and its
+   digest to DIGEST. */
+bool
+casheph_save_stream (const char *filename, const casheph_save_opts_t *opts,
+                     casheph_save_stats_t *stats, casheph_digest_t *digest,
+                     void (*write) (void *ctx, casheph_buf_t *out), void *ctx)
+{
+  double start = casheph_now ();
+  size_t buffer_size = opts->buffer_size > 0 ? opts->buffer_size : 1 << 18;
+  if (!opts->uncompressed && opts->n_threads != 1)
+    {
+      FILE *file = fopen (filename, "wb");
+      if (file == NULL)
+        {
+          return false;
+        }
+      casheph_buf_t out;
+      casheph_buf_init (&out, 1 << 20, NULL, NULL);
+      write (ctx, &out);
+      uint64_t written = casheph_gzip_parallel (out.data, out.len, file, opts,
+                                                buffer_size);
+      bool ok = fclose (file) == 0 && written > 0;
+      casheph_digest_init (digest);
+      casheph_digest_update (digest, out.data, out.len);
+      casheph_save_fill_stats (stats, out.len, written, start);
+      casheph_buf_free (&out);
+      return ok;
+    }
+  casheph_save_sink_t sink;
+  memset (&sink, 0, sizeof (casheph_save_sink_t));
+  casheph_digest_init (&sink.digest);
+  sink.plain = opts->uncompressed;
+  if (!sink.plain)
+    {
+      /* windowBits 15 + 16 asks zlib for a gzip wrapper. */
+      if (deflateInit2 (&sink.zs, opts->level, Z_DEFLATED, 15 + 16, 8,
+                        opts->strategy) != Z_OK)
+        {
+          return false;
+        }
+    }
+  sink.file = fopen (filename, "wb");
+  if (sink.file == NULL)
+    {
+      if (!sink.plain)
+        {
+          deflateEnd (&sink.zs);
+        }
+      return false;
+    }
+  sink.out_cap = buffer_size;
+  sink.out = (unsigned char*)malloc (sink.out_cap);
+
+  casheph_buf_t out;
+  casheph_buf_init (&out, buffer_size, casheph_sink_flush, &sink);
+  write (ctx, &out);
+  bool ok = casheph_sink_write (&sink, out.data, out.len, Z_FINISH);
+  ok = ok && !out.error;
+
+  casheph_buf_free (&out);
+  if (!sink.plain)
+    {
+      deflateEnd (&sink.zs);
+    }
+  free (sink.out);
+  if (fclose (sink.file) != 0)
+    {
+      ok = false;
+    }
+  casheph_save_fill_stats (stats, sink.raw_bytes, sink.out_bytes, start);
+  *digest = sink.digest;
+  return ok;
+}
+
+void
+casheph_write_book_ctx (void *ctx, casheph_buf_t *out)
+{
+  casheph_write_book ((casheph_t*)ctx, out);
+}
+
+/* What the last save wrote, so that saving an unchanged book again
+   can be skipped. */
+struct casheph_saved_s
+{
+  char *path;
+  char *tz;
+  bool uncompressed;
+  int level;
+  int strategy;
+  uint64_t mod_count;
+  casheph_digest_t digest;
+  off_t size;
+  struct timespec mtime;
+};
+
+void
+casheph_saved_free (casheph_t *ce)
+{
+  if (ce->saved != NULL)
+    {
+      free (ce->saved->path);
+      free (ce->saved->tz);
+      free (ce->saved);
+      ce->saved = NULL;
+    }
+}
+
+void
+casheph_saved_record (casheph_t *ce, const char *filename,
+                      const casheph_save_opts_t *opts, uint64_t mod_count,
+                      const casheph_digest_t *digest)
+{
+  casheph_saved_free (ce);
+  struct stat st;
+  if (stat (filename, &st) != 0)
+    {
+      return;
+    }
+  const char *tz = getenv ("TZ");
+  casheph_saved_t *saved = (casheph_saved_t*)malloc (sizeof (casheph_saved_t));
+  saved->path = strdup (filename);
+  saved->tz = strdup (tz != NULL ? tz : "");
+  saved->uncompressed = opts->uncompressed;
+  saved->level = opts->level;
+  saved->strategy = opts->strategy;
+  saved->mod_count = mod_count;
+  saved->digest = *digest;
+  saved->size = st.st_size;
+  saved->mtime = st.st_mtim;
+  ce->saved = saved;
+}
+
+/* The file the book was read from, as it was then, for
+   casheph_cache_write.  Only the path, TZ, size, mtime and mod_count
+   are set. */
+void
+casheph_loaded_record (casheph_t *ce, const char *filename)
+{
+  struct stat st;
+  if (stat (filename, &st) != 0)
+    {
+      return;
+    }
+  const char *tz = getenv ("TZ");
+  casheph_saved_t *loaded = (casheph_saved_t*)malloc (sizeof (casheph_saved_t));
+  memset (loaded, 0, sizeof (casheph_saved_t));
+  loaded->path = strdup (filename);
+  loaded->tz = strdup (tz != NULL ? tz : "");
+  loaded->mod_count = ce->mod_count;
+  loaded->size = st.st_size;
+  loaded->mtime = st.st_mtim;
+  ce->loaded = loaded;
+}
+
+/* Whether FILENAME is still the file SAVED describes, under the same
+   TZ. */
+bool
+casheph_saved_unchanged (const casheph_saved_t *saved, const char *filename)
+{
+  if (saved == NULL || strcmp (saved->path, filename) != 0)
+    {
+      return false;
+    }
+  const char *tz = getenv ("TZ");
+  struct stat st;
+  return (strcmp (saved->tz, tz != NULL ? tz : "") == 0
+          && stat (filename, &st) == 0 && st.st_size == saved->size
+          && st.st_mtim.tv_sec == saved->mtime.tv_sec
+          && st.st_mtim.tv_nsec == saved->mtime.tv_nsec);
+}
+
+/* Whether FILENAME is still the file the last save wrote, with the same
+   settings. */
+bool
+casheph_saved_matches (casheph_t *ce, const char *filename,
+                       const casheph_save_opts_t *opts)
+{
+  casheph_saved_t *saved = ce->saved;
+  return (saved != NULL && saved->uncompressed == opts->uncompressed
+          && saved->level == opts->level && saved->strategy == opts->strategy
+          && casheph_saved_unchanged (saved, filename));
+}
+
+void
+casheph_write_memory (void *ctx, casheph_buf_t *out)
+{
+  casheph_buf_t *src = (casheph_buf_t*)ctx;
+  size_t off;
+  for (off = 0; off < src->len; off += out->cap)
+    {
+      size_t n = src->len - off < out->cap ? src->len - off : out->cap;
+      casheph_buf_put (out, src->data + off, n);
+    }
+}
+
+/* Whether zlib will take OPTS' level and strategy, checked before
+   anything is written. */
+bool
+casheph_save_opts_valid (const casheph_save_opts_t *opts)
+{
+  int s = opts->strategy;
+  return (opts->level >= Z_DEFAULT_COMPRESSION && opts->level <= 9
+          && (s == Z_DEFAULT_STRATEGY || s == Z_FILTERED
+              || s == Z_HUFFMAN_ONLY || s == Z_RLE || s == Z_FIXED));
+}
+
+/* casheph_save_stream to "FILENAME.saving", renamed over FILENAME only
+   once it is complete, so a failed save leaves the old file alone. */
+bool
+casheph_save_replace (const char *filename, const casheph_save_opts_t *opts,
+                      casheph_save_stats_t *stats, casheph_digest_t *digest,
+                      void (*write) (void *ctx, casheph_buf_t *out),
+                      void *ctx)
+{
+  char *tmp = (char*)malloc (strlen (filename) + 8);
+  strcpy (tmp, filename);
+  strcat (tmp, ".saving");
+  bool ok = casheph_save_stream (tmp, opts, stats, digest, write, ctx);
+  ok = ok && rename (tmp, filename) == 0;
+  if (!ok)
+    {
+      unlink (tmp);
+    }
+  free (tmp);
+  return ok;
+}
+
+bool
+casheph_save_with (casheph_t *ce, const char *filename,
+                   const casheph_save_opts_t *opts,
+                   casheph_save_stats_t *stats)
+{
+  casheph_save_opts_t defaults;
+  if (opts == NULL)
+    {
+      casheph_save_opts_init (&defaults);
+      opts = &defaults;
+    }
+  if (!casheph_save_opts_valid (opts) || ce->in_batch)
+    {
+      return false;
+    }
+  /* Let a background save finish first so it cannot replace this one. */
+  casheph_save_wait (ce, NULL);
+  casheph_prepare_fragments (ce, opts->keep_fragments);
+  if (stats != NULL)
+    {
+      memset (stats, 0, sizeof (casheph_save_stats_t));
+    }
+  casheph_digest_t digest;
+  bool ok;
+  if (!casheph_saved_matches (ce, filename, opts))
+    {
+      ok = casheph_save_replace (filename, opts, stats, &digest,
+                                 casheph_write_book_ctx, ce);
+    }
+  else if (ce->mod_count == ce->saved->mod_count)
+    {
+      return true;
+    }
+  else
+    {
+      /* Changed and maybe changed back: compare what would be written
+         before compressing and writing it. */
+      casheph_buf_t book;
+      casheph_buf_init (&book, 1 << 20, NULL, NULL);
+      casheph_write_book (ce, &book);
+      casheph_digest_init (&digest);
+      casheph_digest_update (&digest, book.data, book.len);
+      if (casheph_digest_equal (&digest, &ce->saved->digest))
+        {
+          casheph_buf_free (&book);
+          ce->saved->mod_count = ce->mod_count;
+          return true;
+        }
+      ok = casheph_save_replace (filename, opts, stats, &digest,
+                                 casheph_write_memory, &book);
+      casheph_buf_free (&book);
+    }
+  if (ok)
+    {
+      casheph_saved_record (ce, filename, opts, ce->mod_count, &digest);
+    }
+  else
+    {
+      casheph_saved_free (ce);
+    }
+  return ok;
+}
+
+void casheph_trn_destroy (casheph_transaction_t *t);
+
+void casheph_account_destroy (casheph_account_t *act);
+
+/* A background save writes the transactions that existed when it
+   started, from a copy of the pointer array.  Removed transactions are
+   kept alive until it finishes, and everything else (accounts, the
+   template section) is written to memory before it starts. */
+struct casheph_save_job_s
+{
+  pthread_t thread;
+  bool running;
+  int done;
+  bool ok;
+  char *filename;
+  char *tmp_name;
+  casheph_save_opts_t opts;
+  casheph_save_stats_t stats;
+  uint64_t mod_count;
+  casheph_digest_t digest;
+  casheph_buf_t head;
+  casheph_buf_t tail;
+  int n_transactions;
+  casheph_transaction_t **transactions;
+};
+
+void
+casheph_write_snapshot (void *ctx, casheph_buf_t *out)
+{
+  casheph_save_job_t *job = (casheph_save_job_t*)ctx;
+  casheph_buf_put (out, job->head.data, job->head.len);
+  int i;
+  for (i = 0; i < job->n_transactions; ++i)
+    {
+      casheph_write_transaction (job->transactions[i], out);
+    }
+  casheph_buf_put (out, job->tail.data, job->tail.len);
+}
+
+void *
+casheph_save_worker (void *data)
+{
+  casheph_save_job_t *job = (casheph_save_job_t*)data;
+  job->ok = casheph_save_stream (job->tmp_name, &job->opts, &job->stats,
+                                 &job->digest, casheph_write_snapshot, job);
+  if (job->ok)
+    {
+      job->ok = rename (job->tmp_name, job->filename) == 0;
+    }
+  if (!job->ok)
+    {
+      unlink (job->tmp_name);
+    }
+  __atomic_store_n (&job->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+void
+casheph_save_job_free (casheph_save_job_t *job)
+{
+  free (job->filename);
+  free (job->tmp_name);
+  casheph_buf_free (&job->head);
+  casheph_buf_free (&job->tail);
+  free (job->transactions);
+  free (job);
+}
+
+bool
+casheph_save_async (casheph_t *ce, const char *filename,
+                    const casheph_save_opts_t *opts)
+{
+  casheph_save_opts_t defaults;
+  if (opts == NULL)
+    {
+      casheph_save_opts_init (&defaults);
+      opts = &defaults;
+    }
+  if (!casheph_save_opts_valid (opts) || ce->in_batch)
+    {
+      return false;
+    }
+  casheph_save_wait (ce, NULL);
+  /* The worker writes every transaction afresh and never reads the
+     fragment cache, so casheph_trn_touch freeing a fragment while it
+     runs is harmless and the cache stays for later foreground saves. */
+
+  casheph_save_job_t *job = (casheph_save_job_t*)malloc (sizeof (casheph_save_job_t));
+  job->running = false;
+  job->done = 0;
+  job->ok = false;
+  job->filename = strdup (filename);
+  job->tmp_name = (char*)malloc (strlen (filename) + 8);
+  strcpy (job->tmp_name, filename);
+  strcat (job->tmp_name, ".saving");
+  job->opts = *opts;
+  job->opts.keep_fragments = false;
+  memset (&job->stats, 0, sizeof (casheph_save_stats_t));
+  job->mod_count = ce->mod_count;
+  casheph_buf_init (&job->head, 1 << 14, NULL, NULL);
+  casheph_buf_init (&job->tail, 1 << 12, NULL, NULL);
+  job->n_transactions = ce->n_transactions;
+  job->transactions = (casheph_transaction_t**)malloc (sizeof (casheph_transaction_t*)
+                                                       * (ce->n_transactions + 1));
+  memcpy (job->transactions, ce->transactions,
+          sizeof (casheph_transaction_t*) * ce->n_transactions);
+  casheph_write_book_head (ce, &job->head);
+  casheph_write_book_tail (ce, &job->tail);
+
+  if (ce->save_job != NULL)
+    {
+      casheph_save_job_free (ce->save_job);
+      ce->save_job = NULL;
+    }
+  if (pthread_create (&job->thread, NULL, casheph_save_worker, job) != 0)
+    {
+      casheph_save_job_free (job);
+      return false;
+    }
+  job->running = true;
+  ce->save_job = job;
+  return true;
+}
+
+bool
+casheph_save_done (casheph_t *ce)
+{
+  return (ce->save_job == NULL || !ce->save_job->running
+          || __atomic_load_n (&ce->save_job->done, __ATOMIC_ACQUIRE));
+}
+
+bool
+casheph_save_wait (casheph_t *ce, casheph_save_stats_t *stats)
+{
+  casheph_save_job_t *job = ce->save_job;
+  if (job == NULL)
+    {
+      return true;
+    }
+  if (job->running)
+    {
+      pthread_join (job->thread, NULL);
+      job->running = false;
+      int i;
+      for (i = 0; i < ce->n_deferred; ++i)
+        {
+          casheph_trn_destroy (ce->deferred[i]);
+        }
+      free (ce->deferred);
+      ce->deferred = NULL;
+      ce->n_deferred = 0;
+      /* Keep only the result. */
+      free (job->transactions);
+      job->transactions = NULL;
+      casheph_buf_free (&job->head);
+      casheph_buf_free (&job->tail);
+      if (job->ok)
+        {
+          casheph_saved_record (ce, job->filename, &job->opts, job->mod_count,
+                                &job->digest);
+        }
+      else
+        {
+          casheph_saved_free (ce);
+        }
+    }
+  if (stats != NULL)
+    {
+      *stats = job->stats;
+    }
+  return job->ok;
+}
+
+void
+casheph_save (casheph_t *ce, const char *filename)
+{
+  casheph_save_with (ce, filename, NULL, NULL);
+}
+
+casheph_guid_map_t *
+casheph_trn_map (casheph_t *ce)
+{
+  if (ce->trn_map == NULL)
+    {
+      ce->trn_map = casheph_guid_map_new (ce->n_transactions);
+      int i;
+      for (i = 0; i < ce->n_transactions; ++i)
+        {
+          casheph_guid_map_put (ce->trn_map, ce->transactions[i]->id,
+                                ce->transactions[i]);
+        }
+    }
+  return ce->trn_map;
+}
+
+void
+casheph_get_transactions (casheph_t *ce, const char **ids, int n,
+                          casheph_transaction_t **results)
+{
+  int i;
+  if (ce->trn_map == NULL && n < 8)
+    {
+      for (i = 0; i < n; ++i)
+        {
+          results[i] = casheph_get_transaction (ce, ids[i]);
+        }
+      return;
+    }
+  casheph_guid_map_t *map = casheph_trn_map (ce);
+  size_t mask = map->cap - 1;
+  /* Hash a group of IDs and prefetch their home slots before probing,
+     so the cache misses overlap. */
+  enum { group = 8 };
+  size_t slots[group];
+  for (i = 0; i < n; i += group)
+    {
+      int m = n - i < group ? n - i : group;
+      int j;
+      for (j = 0; j < m; ++j)
+        {
+          slots[j] = casheph_guid_hash (ids[i + j]) & mask;
+          __builtin_prefetch (&map->keys[slots[j]]);
+          __builtin_prefetch (&map->values[slots[j]]);
+        }
+      for (j = 0; j < m; ++j)
+        {
+          size_t k = slots[j];
+          while (map->keys[k] != NULL && strcmp (map->keys[k], ids[i + j]) != 0)
+            {
+              k = (k + 1) & mask;
+            }
+          results[i + j] = map->keys[k] == NULL ? NULL : (casheph_transaction_t*)map->values[k];
+        }
+    }
+}
+
+void
+casheph_account_map_add_rec (casheph_guid_map_t *map, casheph_account_t *act)
+{
+  casheph_guid_map_put (map, act->id, act);
+  int i;
+  for (i = 0; i < act->n_accounts; ++i)
+    {
+      casheph_account_map_add_rec (map, act->accounts[i]);
+    }
+}
+
+casheph_guid_map_t *
+casheph_account_map (casheph_t *ce)
+{
+  if (ce->account_map == NULL)
+    {
+      ce->account_map = casheph_guid_map_new (64);
+      casheph_account_map_add_rec (ce->account_map, ce->root);
+    }
+  return ce->account_map;
+}
+
+typedef struct
+{
+  time_t date;
+  int64_t amount;
+  casheph_transaction_t *trn;
+  casheph_split_t *split;
+} casheph_ledger_entry_t;
+
+struct casheph_ledger_s
+{
+  int n;
+  int cap;
+  int n_valid;
+  uint32_t denom;
+  /* A split quantity could not be put in DENOM; sums are unusable
+     until the ledgers are rebuilt. */
+  bool overflow;
+  casheph_ledger_entry_t *entries;
+  int64_t *sums;
+  unsigned char *states;
+};
+
+unsigned char
+casheph_reconcile_mask (casheph_reconcile_t state)
+{
+  switch (state)
+    {
+    case ce_cleared:
+      return ce_mask_cleared;
+    case ce_reconciled:
+      return ce_mask_reconciled;
+    case ce_frozen:
+      return ce_mask_frozen;
+    case ce_voided:
+      return ce_mask_voided;
+    default:
+      return ce_mask_unreconciled;
+    }
+}
+
+bool
+casheph_rescale (const casheph_wval_t *v, uint32_t denom, int64_t *n)
+{
+  casheph_wval_t res;
+  if (!casheph_wval_rescale (*v, denom, &res))
+    {
+      return false;
+    }
+  *n = res.n;
+  return true;
+}
+
+casheph_ledger_t *
+casheph_ledger_new (casheph_account_t *act)
+{
+  casheph_ledger_t *ledger = (casheph_ledger_t*)malloc (sizeof (casheph_ledger_t));
+  ledger->n = 0;
+  ledger->cap = 0;
+  ledger->n_valid = 0;
+  ledger->denom = act->commodity_scu > 0 ? act->commodity_scu : 100;
+  ledger->overflow = false;
+  ledger->entries = NULL;
+  ledger->sums = NULL;
+  ledger->states = NULL;
+  return ledger;
+}
+
+void
+casheph_ledger_destroy (casheph_ledger_t *ledger)
+{
+  if (ledger == NULL)
+    {
+      return;
+    }
+  free (ledger->entries);
+  free (ledger->sums);
+  free (ledger->states);
+  free (ledger);
+}
+
+void
+casheph_ledger_reserve (casheph_ledger_t *ledger, int n)
+{
+  if (n <= ledger->cap)
+    {
+      return;
+    }
+  int cap = ledger->cap > 0 ? ledger->cap : 8;
+  while (cap < n)
+    {
+      cap *= 2;
+    }
+  ledger->entries = (casheph_ledger_entry_t*)realloc (ledger->entries,
+                                                      sizeof (casheph_ledger_entry_t) * cap);
+  ledger->sums = (int64_t*)realloc (ledger->sums, sizeof (int64_t) * cap);
+  ledger->states = (unsigned char*)realloc (ledger->states, cap);
+  ledger->cap = cap;
+}
+
+/* Index of the first entry posted after DATE. */
+int
+casheph_ledger_upper_bound (casheph_ledger_t *ledger, time_t date)
+{
+  int lo = 0;
+  int hi = ledger->n;
+  while (lo < hi)
+    {
+      int mid = lo + (hi - lo) / 2;
+      if (ledger->entries[mid].date <= date)
+        {
+          lo = mid + 1;
+        }
+      else
+        {
+          hi = mid;
+        }
+    }
+  return lo;
+}
+
+void
+casheph_ledger_insert (casheph_ledger_t *ledger, casheph_transaction_t *trn,
+                       casheph_split_t *split)
+{
+  casheph_ledger_reserve (ledger, ledger->n + 1);
+  int pos = casheph_ledger_upper_bound (ledger, trn->date_posted);
+  memmove (ledger->entries + pos + 1, ledger->entries + pos,
+           sizeof (casheph_ledger_entry_t) * (ledger->n - pos));
+  memmove (ledger->states + pos + 1, ledger->states + pos, ledger->n - pos);
+  ledger->states[pos] = casheph_reconcile_mask (split->reconciled_state);
+  ledger->entries[pos].date = trn->date_posted;
+  if (!casheph_rescale (split->quantity, ledger->denom,
+                        &ledger->entries[pos].amount))
+    {
+      ledger->entries[pos].amount = 0;
+      ledger->overflow = true;
+    }
+  ledger->entries[pos].trn = trn;
+  ledger->entries[pos].split = split;
+  ++ledger->n;
+  if (ledger->n_valid > pos)
+    {
+      ledger->n_valid = pos;
+    }
+}
+
+void
+casheph_ledger_remove (casheph_ledger_t *ledger, casheph_transaction_t *trn)
+{
+  int pos = casheph_ledger_upper_bound (ledger, trn->date_posted);
+  int i = pos - 1;
+  int n_removed = 0;
+  while (i >= 0 && ledger->entries[i].date == trn->date_posted)
+    {
+      if (ledger->entries[i].trn == trn)
+        {
+          memmove (ledger->entries + i, ledger->entries + i + 1,
+                   sizeof (casheph_ledger_entry_t) * (ledger->n - i - 1));
+          memmove (ledger->states + i, ledger->states + i + 1,
+                   ledger->n - i - 1);
+          --ledger->n;
+          ++n_removed;
+          pos = i;
+        }
+      --i;
+    }
+  if (n_removed > 0 && ledger->n_valid > pos)
+    {
+      ledger->n_valid = pos;
+    }
+}
+
+/* Bring the running sums up to date for the first N entries.  Fails
+   if a sum overflows or an amount could not be rescaled. */
+bool
+casheph_ledger_extend (casheph_ledger_t *ledger, int n)
+{
+  if (ledger->overflow)
+    {
+      return false;
+    }
+  int i;
+  int64_t sum = ledger->n_valid > 0 ? ledger->sums[ledger->n_valid - 1] : 0;
+  for (i = ledger->n_valid; i < n; ++i)
+    {
+      if (!casheph_add_i64 (sum, ledger->entries[i].amount, &sum))
+        {
+          return false;
+        }
+      ledger->sums[i] = sum;
+      ledger->n_valid = i + 1;
+    }
+  return true;
+}
+
+int
+casheph_ledger_seq_cmp (const void *a, const void *b)
+{
+  const casheph_ledger_entry_t *ea = (const casheph_ledger_entry_t*)a;
+  const casheph_ledger_entry_t *eb = (const casheph_ledger_entry_t*)b;
+  if (ea->date != eb->date)
+    {
+      return ea->date < eb->date ? -1 : 1;
+    }
+  return ea->amount < eb->amount ? -1 : (ea->amount > eb->amount ? 1 : 0);
+}
+
+void
+casheph_ledger_sort (casheph_ledger_t *ledger)
+{
+  int i;
+  bool sorted = true;
+  for (i = 1; i < ledger->n && sorted; ++i)
+    {
+      sorted = ledger->entries[i - 1].date <= ledger->entries[i].date;
+    }
+  if (!sorted)
+    {
+      /* Keep ties in load order: sort on (date, sequence) with the
+         sequence parked in the amount field. */
+      int64_t *amounts = (int64_t*)malloc (sizeof (int64_t) * ledger->n);
+      for (i = 0; i < ledger->n; ++i)
+        {
+          amounts[i] = ledger->entries[i].amount;
+          ledger->entries[i].amount = i;
+        }
+      qsort (ledger->entries, ledger->n, sizeof (casheph_ledger_entry_t),
+             casheph_ledger_seq_cmp);
+      for (i = 0; i < ledger->n; ++i)
+        {
+          ledger->entries[i].amount = amounts[ledger->entries[i].amount];
+        }
+      free (amounts);
+    }
+  for (i = 0; i < ledger->n; ++i)
+    {
+      ledger->states[i] = casheph_reconcile_mask (ledger->entries[i].split->reconciled_state);
+    }
+  ledger->n_valid = 0;
+}
+
+void
+casheph_ledgers_clear_rec (casheph_account_t *act)
+{
+  casheph_ledger_destroy (act->ledger);
+  act->ledger = NULL;
+  int i;
+  for (i = 0; i < act->n_accounts; ++i)
+    {
+      casheph_ledgers_clear_rec (act->accounts[i]);
+    }
+}
+
+void
+casheph_ledgers_sort_rec (casheph_account_t *act)
+{
+  if (act->ledger != NULL)
+    {
+      casheph_ledger_sort (act->ledger);
+    }
+  int i;
+  for (i = 0; i < act->n_accounts; ++i)
+    {
+      casheph_ledgers_sort_rec (act->accounts[i]);
+    }
+}
+
+casheph_ledger_t *
+casheph_account_ledger (casheph_account_t *act)
+{
+  if (act->ledger == NULL)
+    {
+      act->ledger = casheph_ledger_new (act);
+    }
+  return act->ledger;
+}
+
+void
+casheph_ledgers_add_trn (casheph_t *ce, casheph_transaction_t *trn,
+                         bool append)
+{
+  casheph_guid_map_t *map = casheph_account_map (ce);
+  int i;
+  for (i = 0; i < trn->n_splits; ++i)
+    {
+      casheph_split_t *split = trn->splits[i];
+      casheph_account_t *act = (casheph_account_t*)casheph_guid_map_get (map, split->account);
+      if (act == NULL)
+        {
+          continue;
+        }
+      casheph_ledger_t *ledger = casheph_account_ledger (act);
+      if (append)
+        {
+          casheph_ledger_reserve (ledger, ledger->n + 1);
+          casheph_ledger_entry_t *e = &ledger->entries[ledger->n++];
+          e->date = trn->date_posted;
+          if (!casheph_rescale (split->quantity, ledger->denom, &e->amount))
+            {
+              e->amount = 0;
+              ledger->overflow = true;
+            }
+          e->trn = trn;
+          e->split = split;
+        }
+      else
+        {
+          casheph_ledger_insert (ledger, trn, split);
+        }
+    }
+}
+
+void
+casheph_build_ledgers (casheph_t *ce)
+{
+  casheph_ledgers_clear_rec (ce->root);
+  int i;
+  for (i = 0; i < ce->n_transactions; ++i)
+    {
+      casheph_ledgers_add_trn (ce, ce->transactions[i], true);
+    }
+  casheph_ledgers_sort_rec (ce->root);
+  ce->ledgers_built = true;
+}
+
+bool
+casheph_account_balance_at (casheph_t *ce, casheph_account_t *act,
+                            time_t date, casheph_wval_t *bal)
+{
+  if (!ce->ledgers_built)
+    {
+      casheph_build_ledgers (ce);
+    }
+  casheph_ledger_t *ledger = casheph_account_ledger (act);
+  int pos = casheph_ledger_upper_bound (ledger, date);
+  if (!casheph_ledger_extend (ledger, pos))
+    {
+      return false;
+    }
+  bal->n = pos > 0 ? ledger->sums[pos - 1] : 0;
+  bal->d = ledger->denom;
+  return true;
+}
+
+bool
+casheph_account_reconcile_balance (casheph_t *ce, casheph_account_t *act,
+                                   unsigned int mask, casheph_wval_t *bal)
+{
+  if (!ce->ledgers_built)
+    {
+      casheph_build_ledgers (ce);
+    }
+  casheph_ledger_t *ledger = casheph_account_ledger (act);
+  if (ledger->overflow)
+    {
+      return false;
+    }
+  int64_t sum = 0;
+  int i;
+  for (i = 0; i < ledger->n; ++i)
+    {
+      if ((ledger->states[i] & mask)
+          && !casheph_add_i64 (sum, ledger->entries[i].amount, &sum))
+        {
+          return false;
+        }
+    }
+  bal->n = sum;
+  bal->d = ledger->denom;
+  return true;
+}
+
+int
+casheph_account_reconcile_list (casheph_t *ce, casheph_account_t *act,
+                                unsigned int mask, casheph_split_t **splits,
+                                int max)
+{
+  if (!ce->ledgers_built)
+    {
+      casheph_build_ledgers (ce);
+    }
+  casheph_ledger_t *ledger = casheph_account_ledger (act);
+  int n = 0;
+  int i;
+  for (i = 0; i < ledger->n; ++i)
+    {
+      if (ledger->states[i] & mask)
+        {
+          if (n < max)
+            {
+              splits[n] = ledger->entries[i].split;
+            }
+          ++n;
+        }
+    }
+  return n;
+}
+
+/* Copy the reconciled state of SPLIT into its ledger entry. */
+void
+casheph_ledger_set_state (casheph_t *ce, casheph_transaction_t *trn,
+                          casheph_split_t *split)
+{
+  casheph_account_t *act = casheph_get_account (ce, split->account);
+  if (act == NULL || act->ledger == NULL)
+    {
+      return;
+    }
+  casheph_ledger_t *ledger = act->ledger;
+  int i = casheph_ledger_upper_bound (ledger, trn->date_posted) - 1;
+  for (; i >= 0 && ledger->entries[i].date == trn->date_posted; --i)
+    {
+      if (ledger->entries[i].split == split)
+        {
+          ledger->states[i] = casheph_reconcile_mask (split->reconciled_state);
+          break;
+        }
+    }
+}
+
+void casheph_journal_reconcile (casheph_t *ce, casheph_transaction_t *trn,
+                                casheph_split_t *split);
+
+void
+casheph_split_set_reconciled (casheph_t *ce, casheph_transaction_t *trn,
+                              casheph_split_t *split,
+                              casheph_reconcile_t state)
+{
+  casheph_save_wait (ce, NULL);
+  if (ce->in_batch)
+    {
+      casheph_undo_push (ce, ce_undo_reconcile, trn, split, 0);
+    }
+  split->reconciled_state = state;
+  casheph_trn_touch (ce, trn);
+  if (!ce->in_batch)
+    {
+      casheph_ledger_set_state (ce, trn, split);
+      casheph_journal_reconcile (ce, trn, split);
+    }
+}
+
+int
+casheph_account_mark_reconciled (casheph_t *ce, casheph_account_t *act,
+                                 time_t date)
+{
+  casheph_save_wait (ce, NULL);
+  int n = 0;
+  int i, j;
+  /* The ledgers lag behind an open batch, so go by the transactions:
+     those added in it count and those removed from it do not.  The
+     ledger states follow at commit. */
+  if (ce->in_batch)
+    {
+      for (i = 0; i < ce->n_transactions; ++i)
+        {
+          casheph_transaction_t *trn = ce->transactions[i];
+          if (trn->date_posted > date)
+            {
+              continue;
+            }
+          for (j = 0; j < trn->n_splits; ++j)
+            {
+              casheph_split_t *split = trn->splits[j];
+              if (strcmp (split->account, act->id) == 0
+                  && (casheph_reconcile_mask (split->reconciled_state)
+                      & (ce_mask_unreconciled | ce_mask_cleared)))
+                {
+                  casheph_undo_push (ce, ce_undo_reconcile, trn, split, 0);
+                  split->reconciled_state = ce_reconciled;
+                  casheph_trn_touch (ce, trn);
+                  ++n;
+                }
+            }
+        }
+      return n;
+    }
+  if (!ce->ledgers_built)
+    {
+      casheph_build_ledgers (ce);
+    }
+  casheph_ledger_t *ledger = casheph_account_ledger (act);
+  int end = casheph_ledger_upper_bound (ledger, date);
+  for (i = 0; i < end; ++i)
+    {
+      if (ledger->states[i] & (ce_mask_unreconciled | ce_mask_cleared))
+        {
+          ledger->states[i] = ce_mask_reconciled;
+          ledger->entries[i].split->reconciled_state = ce_reconciled;
+          casheph_trn_touch (ce, ledger->entries[i].trn);
+          casheph_journal_reconcile (ce, ledger->entries[i].trn,
+                                     ledger->entries[i].split);
+          ++n;
+        }
+    }
+  return n;
+}
+
+int
+casheph_register_open (casheph_t *ce, casheph_account_t *act,
+                       casheph_register_t *reg)
+{
+  if (!ce->ledgers_built)
+    {
+      casheph_build_ledgers (ce);
+    }
+  reg->ce = ce;
+  reg->account = act;
+  reg->n_rows = casheph_account_ledger (act)->n;
+  reg->row = 0;
+  return reg->n_rows;
+}
+
+bool
+casheph_register_seek (casheph_register_t *reg, int row)
+{
+  if (row < 0 || row > reg->n_rows)
+    {
+      return false;
+    }
+  reg->row = row;
+  return true;
+}
+
+bool
+casheph_register_next (casheph_register_t *reg, casheph_register_row_t *row)
+{
+  casheph_ledger_t *ledger = reg->account->ledger;
+  if (ledger == NULL || reg->row >= reg->n_rows || reg->row >= ledger->n)
+    {
+      return false;
+    }
+  if (!casheph_ledger_extend (ledger, reg->row + 1))
+    {
+      return false;
+    }
+  casheph_ledger_entry_t *e = &ledger->entries[reg->row];
+  row->trn = e->trn;
+  row->split = e->split;
+  row->balance.n = ledger->sums[reg->row];
+  row->balance.d = ledger->denom;
+  ++reg->row;
+  return true;
+}
+
+typedef struct
+{
+  casheph_t *ce;
+  casheph_guid_map_t *rows;
+  const uint32_t *denoms;
+  const time_t *bounds;
+  int n_periods;
+  int lo;
+  int hi;
+  int64_t *acc;
+  bool ok;
+} casheph_report_job_t;
+
+int
+casheph_report_period (const time_t *bounds, int n_periods, time_t date)
+{
+  if (date < bounds[0] || date >= bounds[n_periods])
+    {
+      return -1;
+    }
+  int lo = 0;
+  int hi = n_periods;
+  while (hi - lo > 1)
+    {
+      int mid = lo + (hi - lo) / 2;
+      if (bounds[mid] <= date)
+        {
+          lo = mid;
+        }
+      else
+        {
+          hi = mid;
+        }
+    }
+  return lo;
+}
+
+void *
+casheph_report_worker (void *data)
+{
+  casheph_report_job_t *job = (casheph_report_job_t*)data;
+  int i;
+  for (i = job->lo; i < job->hi; ++i)
+    {
+      casheph_transaction_t *trn = job->ce->transactions[i];
+      int p = casheph_report_period (job->bounds, job->n_periods,
+                                     trn->date_posted);
+      if (p < 0)
+        {
+          continue;
+        }
+      int j;
+      for (j = 0; j < trn->n_splits; ++j)
+        {
+          casheph_split_t *split = trn->splits[j];
+          intptr_t row = (intptr_t)casheph_guid_map_get (job->rows, split->account);
+          if (row == 0)
+            {
+              continue;
+            }
+          --row;
+          int64_t *cell = &job->acc[row * job->n_periods + p];
+          int64_t amount;
+          if (!casheph_rescale (split->quantity, job->denoms[row], &amount)
+              || !casheph_add_i64 (*cell, amount, cell))
+            {
+              job->ok = false;
+              return NULL;
+            }
+        }
+    }
+  return NULL;
+}
+
+bool
+casheph_report (casheph_t *ce, casheph_account_t **accounts, int n_accounts,
+                const time_t *bounds, int n_periods, int n_threads,
+                casheph_wval_t *matrix)
+{
+  if (n_accounts <= 0 || n_periods <= 0)
+    {
+      return false;
+    }
+  if (n_threads <= 0)
+    {
+      n_threads = (int)sysconf (_SC_NPROCESSORS_ONLN);
+    }
+  /* Not worth a thread for less than a few thousand transactions. */
+  int max_threads = ce->n_transactions / 4096 + 1;
+  if (n_threads > max_threads)
+    {
+      n_threads = max_threads;
+    }
+  if (n_threads < 1)
+    {
+      n_threads = 1;
+    }
+
+  casheph_guid_map_t *rows = casheph_guid_map_new (n_accounts);
+  uint32_t *denoms = (uint32_t*)malloc (sizeof (uint32_t) * n_accounts);
+  int i;
+  for (i = 0; i < n_accounts; ++i)
+    {
+      casheph_guid_map_put (rows, accounts[i]->id, (void*)(intptr_t)(i + 1));
+      denoms[i] = accounts[i]->commodity_scu > 0 ? accounts[i]->commodity_scu : 100;
+    }
+
+  size_t cells = (size_t)n_accounts * n_periods;
+  casheph_report_job_t *jobs = (casheph_report_job_t*)malloc (sizeof (casheph_report_job_t) * n_threads);
+  pthread_t *threads = (pthread_t*)malloc (sizeof (pthread_t) * n_threads);
+  bool *started = (bool*)calloc (n_threads, sizeof (bool));
+  int chunk = (ce->n_transactions + n_threads - 1) / n_threads;
+  for (i = 0; i < n_threads; ++i)
+    {
+      jobs[i].ce = ce;
+      jobs[i].rows = rows;
+      jobs[i].denoms = denoms;
+      jobs[i].bounds = bounds;
+      jobs[i].n_periods = n_periods;
+      jobs[i].lo = i * chunk < ce->n_transactions ? i * chunk : ce->n_transactions;
+      jobs[i].hi = jobs[i].lo + chunk < ce->n_transactions ? jobs[i].lo + chunk : ce->n_transactions;
+      jobs[i].acc = (int64_t*)calloc (cells, sizeof (int64_t));
+      jobs[i].ok = true;
+    }
+  for (i = 1; i < n_threads; ++i)
+    {
+      started[i] = pthread_create (&threads[i], NULL, casheph_report_worker,
+                                   &jobs[i]) == 0;
+      if (!started[i])
+        {
+          casheph_report_worker (&jobs[i]);
+        }
+    }
+  casheph_report_worker (&jobs[0]);
+  for (i = 1; i < n_threads; ++i)
+    {
+      if (started[i])
+        {
+          pthread_join (threads[i], NULL);
+        }
+      size_t k;
+      for (k = 0; k < cells && jobs[0].ok; ++k)
+        {
+          jobs[0].ok = (jobs[i].ok
+                        && casheph_add_i64 (jobs[0].acc[k], jobs[i].acc[k],
+                                            &jobs[0].acc[k]));
+        }
+      free (jobs[i].acc);
+    }
+  bool ok = jobs[0].ok;
+
+  size_t k;
+  for (k = 0; k < cells && ok; ++k)
+    {
+      matrix[k].n = jobs[0].acc[k];
+      matrix[k].d = denoms[k / n_periods];
+    }
+  free (jobs[0].acc);
+  free (jobs);
+  free (threads);
+  free (started);
+  free (denoms);
+  casheph_guid_map_destroy (rows);
+  return ok;
+}
+
+typedef struct
+{
+  int n;
+  int cap;
+  casheph_transaction_t **trns;
+} casheph_posting_t;
+
+struct casheph_text_index_s
+{
+  size_t n;
+  size_t cap;
+  uint32_t *keys;
+  casheph_posting_t *postings;
+};
+
+unsigned char
+casheph_fold (unsigned char c)
+{
+  return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+/* Bytes of UTF-8 sequences count as letters. */
+bool
+casheph_word_char (unsigned char c)
+{
+  return ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+          || (c >= '0' && c <= '9') || c >= 0x80);
+}
+
+uint32_t
+casheph_trigram (const char *s)
+{
+  return ((uint32_t)casheph_fold (s[0]) << 16
+          | (uint32_t)casheph_fold (s[1]) << 8
+          | (uint32_t)casheph_fold (s[2])) + 1;
+}
+
+casheph_text_index_t *
+casheph_text_index_new ()
+{
+  casheph_text_index_t *idx = (casheph_text_index_t*)malloc (sizeof (casheph_text_index_t));
+  idx->n = 0;
+  idx->cap = 1024;
+  idx->keys = (uint32_t*)calloc (idx->cap, sizeof (uint32_t));
+  idx->postings = (casheph_posting_t*)calloc (idx->cap, sizeof (casheph_posting_t));
+  return idx;
+}
+
+void
+casheph_text_index_destroy (casheph_text_index_t *idx)
+{
+  if (idx == NULL)
+    {
+      return;
+    }
+  size_t i;
+  for (i = 0; i < idx->cap; ++i)
+    {
+      free (idx->postings[i].trns);
+    }
+  free (idx->keys);
+  free (idx->postings);
+  free (idx);
+}
+
+size_t
+casheph_text_index_slot (casheph_text_index_t *idx, uint32_t key)
+{
+  size_t mask = idx->cap - 1;
+  size_t i = (key * 2654435761U) & mask;
+  while (idx->keys[i] != 0 && idx->keys[i] != key)
+    {
+      i = (i + 1) & mask;
+    }
+  return i;
+}
+
+casheph_posting_t *
+casheph_text_index_posting (casheph_text_index_t *idx, uint32_t key,
+                            bool create)
+{
+  size_t i = casheph_text_index_slot (idx, key);
+  if (idx->keys[i] != 0)
+    {
+      return &idx->postings[i];
+    }
+  if (!create)
+    {
+      return NULL;
+    }
+  if ((idx->n + 1) * 2 > idx->cap)
+    {
+      size_t old_cap = idx->cap;
+      uint32_t *old_keys = idx->keys;
+      casheph_posting_t *old_postings = idx->postings;
+      idx->cap *= 2;
+      idx->keys = (uint32_t*)calloc (idx->cap, sizeof (uint32_t));
+      idx->postings = (casheph_posting_t*)calloc (idx->cap, sizeof (casheph_posting_t));
+      size_t j;
+      for (j = 0; j < old_cap; ++j)
+        {
+          if (old_keys[j] != 0)
+            {
+              size_t k = casheph_text_index_slot (idx, old_keys[j]);
+              idx->keys[k] = old_keys[j];
+              idx->postings[k] = old_postings[j];
+            }
+        }
+      free (old_keys);
+      free (old_postings);
+      i = casheph_text_index_slot (idx, key);
+    }
+  idx->keys[i] = key;
+  ++idx->n;
+  return &idx->postings[i];
+}
+
+void
+casheph_text_index_add_str (casheph_text_index_t *idx, const char *str,
+                            casheph_transaction_t *trn)
+{
+  size_t len = strlen (str);
+  size_t i;
+  for (i = 0; i + 3 <= len; ++i)
+    {
+      casheph_posting_t *p = casheph_text_index_posting (idx, casheph_trigram (str + i), true);
+      if (p->n > 0 && p->trns[p->n - 1] == trn)
+        {
+          continue;
+        }
+      if (p->n == p->cap)
+        {
+          p->cap = p->cap > 0 ? p->cap * 2 : 4;
+          p->trns = (casheph_transaction_t**)realloc (p->trns,
+                                                      sizeof (casheph_transaction_t*) * p->cap);
+        }
+      p->trns[p->n++] = trn;
+    }
+}
+
+void
+casheph_text_index_remove_str (casheph_text_index_t *idx, const char *str,
+                               casheph_transaction_t *trn)
+{
+  size_t len = strlen (str);
+  size_t i;
+  for (i = 0; i + 3 <= len; ++i)
+    {
+      casheph_posting_t *p = casheph_text_index_posting (idx, casheph_trigram (str + i), false);
+      if (p == NULL)
+        {
+          continue;
+        }
+      int j;
+      for (j = 0; j < p->n; ++j)
+        {
+          if (p->trns[j] == trn)
+            {
+              p->trns[j] = p->trns[--p->n];
+              break;
+            }
+        }
+    }
+}
+
+void
+casheph_slots_each_text (int n_slots, casheph_slot_t **slots,
+                         void (*func)(const char *, void *), void *data)
+{
+  int i;
+  for (i = 0; i < n_slots; ++i)
+    {
+      if (slots[i]->type == ce_string)
+        {
+          func ((const char*)slots[i]->value, data);
+        }
+      else if (slots[i]->type == ce_frame)
+        {
+          casheph_frame_t *frame = (casheph_frame_t*)slots[i]->value;
+          casheph_slots_each_text (frame->n_slots, frame->slots, func, data);
+        }
+    }
+}
+
+/* Call FUNC on every searchable string of TRN: its description and the
+   string slots of the transaction and its splits. */
+void
+casheph_trn_each_text (casheph_transaction_t *trn,
+                       void (*func)(const char *, void *), void *data)
+{
+  if (trn->desc != NULL)
+    {
+      func (trn->desc, data);
+    }
+  casheph_slots_each_text (trn->n_slots, trn->slots, func, data);
+  int i;
+  for (i = 0; i < trn->n_splits; ++i)
+    {
+      casheph_slots_each_text (trn->splits[i]->n_slots, trn->splits[i]->slots,
+                               func, data);
+    }
+}
+
+typedef struct
+{
+  casheph_text_index_t *idx;
+  casheph_transaction_t *trn;
+} casheph_text_index_op_t;
+
+void
+casheph_text_index_add_cb (const char *str, void *data)
+{
+  casheph_text_index_op_t *op = (casheph_text_index_op_t*)data;
+  casheph_text_index_add_str (op->idx, str, op->trn);
+}
+
+void
+casheph_text_index_remove_cb (const char *str, void *data)
+{
+  casheph_text_index_op_t *op = (casheph_text_index_op_t*)data;
+  casheph_text_index_remove_str (op->idx, str, op->trn);
+}
+
+void
+casheph_text_index_add (casheph_text_index_t *idx, casheph_transaction_t *trn)
+{
+  casheph_text_index_op_t op = { idx, trn };
+  casheph_trn_each_text (trn, casheph_text_index_add_cb, &op);
+}
+
+void
+casheph_text_index_remove (casheph_text_index_t *idx,
+                           casheph_transaction_t *trn)
+{
+  casheph_text_index_op_t op = { idx, trn };
+  casheph_trn_each_text (trn, casheph_text_index_remove_cb, &op);
+}
+
+void
+casheph_text_index_build (casheph_t *ce)
+{
+  casheph_text_index_destroy (ce->text_index);
+  ce->text_index = casheph_text_index_new ();
+  int i;
+  for (i = 0; i < ce->n_transactions; ++i)
+    {
+      casheph_text_index_add (ce->text_index, ce->transactions[i]);
+    }
+}
+
+bool
+casheph_text_match (const char *text, const char *query, size_t qlen,
+                    casheph_search_mode_t mode)
+{
+  const char *p;
+  for (p = text; *p != '\0'; ++p)
+    {
+      if (mode == ce_search_prefix && p != text && casheph_word_char (p[-1]))
+        {
+          continue;
+        }
+      size_t i = 0;
+      while (i < qlen && p[i] != '\0'
+             && casheph_fold (p[i]) == casheph_fold (query[i]))
+        {
+          ++i;
+        }
+      if (i == qlen)
+        {
+          return true;
+        }
+    }
+  return qlen == 0;
+}
+
+typedef struct
+{
+  const char *query;
+  size_t qlen;
+  casheph_search_mode_t mode;
+  bool found;
+} casheph_search_op_t;
+
+void
+casheph_search_cb (const char *str, void *data)
+{
+  casheph_search_op_t *op = (casheph_search_op_t*)data;
+  if (!op->found)
+    {
+      op->found = casheph_text_match (str, op->query, op->qlen, op->mode);
+    }
+}
+
+int
+casheph_search_date_cmp (const void *a, const void *b)
+{
+  const casheph_transaction_t *ta = *(casheph_transaction_t * const *)a;
+  const casheph_transaction_t *tb = *(casheph_transaction_t * const *)b;
+  if (ta->date_posted != tb->date_posted)
+    {
+      return ta->date_posted > tb->date_posted ? -1 : 1;
+    }
+  return 0;
+}
+
+int
+casheph_search (casheph_t *ce, const char *query, casheph_search_mode_t mode,
+                casheph_transaction_t **results, int max_results)
+{
+  if (ce->text_index == NULL)
+    {
+      casheph_text_index_build (ce);
+    }
+  size_t qlen = strlen (query);
+  int n_candidates = ce->n_transactions;
+  casheph_transaction_t **candidates = ce->transactions;
+  size_t i;
+  for (i = 0; i + 3 <= qlen; ++i)
+    {
+      casheph_posting_t *p = casheph_text_index_posting (ce->text_index,
+                                                         casheph_trigram (query + i),
+                                                         false);
+      if (p == NULL)
+        {
+          return 0;
+        }
+      if (p->n < n_candidates)
+        {
+          n_candidates = p->n;
+          candidates = p->trns;
+        }
+    }
+
+  casheph_transaction_t **matches = (casheph_transaction_t**)malloc (sizeof (casheph_transaction_t*) * (n_candidates + 1));
+  int n_matches = 0;
+  int j;
+  for (j = 0; j < n_candidates; ++j)
+    {
+      casheph_search_op_t op = { query, qlen, mode, false };
+      casheph_trn_each_text (candidates[j], casheph_search_cb, &op);
+      if (op.found)
+        {
+          matches[n_matches++] = candidates[j];
+        }
+    }
+  qsort (matches, n_matches, sizeof (casheph_transaction_t*),
+         casheph_search_date_cmp);
+  if (n_matches > max_results)
+    {
+      n_matches = max_results;
+    }
+  memcpy (results, matches, sizeof (casheph_transaction_t*) * n_matches);
+  free (matches);
+  return n_matches;
+}
+
+typedef struct
+{
+  int n;
+  int cap;
+  int32_t *keys;
+  int64_t *sums;
+  int32_t *counts;
+} casheph_buckets_t;
+
+struct casheph_cube_s
+{
+  uint32_t denom;
+  /* A quantity could not be rescaled or a total overflowed; the sums
+     are unusable from then on. */
+  bool overflow;
+  casheph_buckets_t periods[3];
+};
+
+/* Days since 1970-01-01 of a proleptic Gregorian date. */
+int32_t
+casheph_days_from_civil (int y, unsigned int m, unsigned int d)
+{
+  y -= m <= 2;
+  int era = (y >= 0 ? y : y - 399) / 400;
+  unsigned int yoe = (unsigned int)(y - era * 400);
+  unsigned int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  unsigned int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + (int32_t)doe - 719468;
+}
+
+int32_t
+casheph_bucket_key (casheph_period_t period, int y, unsigned int m,
+                    unsigned int d)
+{
+  int32_t days;
+  switch (period)
+    {
+    case ce_month:
+      return y * 12 + (int32_t)m - 1;
+    case ce_week:
+      days = casheph_days_from_civil (y, m, d);
+      /* 1970-01-01 was a Thursday; weeks start on Monday. */
+      return days - ((days % 7 + 10) % 7);
+    default:
+      return casheph_days_from_civil (y, m, d);
+    }
+}
+
+int
+casheph_buckets_lower_bound (casheph_buckets_t *b, int32_t key)
+{
+  int lo = 0;
+  int hi = b->n;
+  while (lo < hi)
+    {
+      int mid = lo + (hi - lo) / 2;
+      if (b->keys[mid] < key)
+        {
+          lo = mid + 1;
+        }
+      else
+        {
+          hi = mid;
+        }
+    }
+  return lo;
+}
+
+bool
+casheph_buckets_add (casheph_buckets_t *b, int32_t key, int64_t amount,
+                     int count)
+{
+  int pos = casheph_buckets_lower_bound (b, key);
+  if (pos < b->n && b->keys[pos] == key)
+    {
+      if (!casheph_add_i64 (b->sums[pos], amount, &b->sums[pos]))
+        {
+          return false;
+        }
+      b->counts[pos] += count;
+      if (b->counts[pos] <= 0)
+        {
+          memmove (b->keys + pos, b->keys + pos + 1, sizeof (int32_t) * (b->n - pos - 1));
+          memmove (b->sums + pos, b->sums + pos + 1, sizeof (int64_t) * (b->n - pos - 1));
+          memmove (b->counts + pos, b->counts + pos + 1, sizeof (int32_t) * (b->n - pos - 1));
+          --b->n;
+        }
+      return true;
+    }
+  if (count <= 0)
+    {
+      return true;
+    }
+  if (b->n == b->cap)
+    {
+      b->cap = b->cap > 0 ? b->cap * 2 : 16;
+      b->keys = (int32_t*)realloc (b->keys, sizeof (int32_t) * b->cap);
+      b->sums = (int64_t*)realloc (b->sums, sizeof (int64_t) * b->cap);
+      b->counts = (int32_t*)realloc (b->counts, sizeof (int32_t) * b->cap);
+    }
+  memmove (b->keys + pos + 1, b->keys + pos, sizeof (int32_t) * (b->n - pos));
+  memmove (b->sums + pos + 1, b->sums + pos, sizeof (int64_t) * (b->n - pos));
+  memmove (b->counts + pos + 1, b->counts + pos, sizeof (int32_t) * (b->n - pos));
+  b->keys[pos] = key;
+  b->sums[pos] = amount;
+  b->counts[pos] = count;
+  ++b->n;
+  return true;
+}
+
+/* Add the buckets from LO to HI to *SUM. */
+bool
+casheph_buckets_sum (casheph_buckets_t *b, int32_t lo, int32_t hi, int64_t *sum)
+{
+  int i;
+  for (i = casheph_buckets_lower_bound (b, lo); i < b->n && b->keys[i] <= hi; ++i)
+    {
+      if (!casheph_add_i64 (*sum, b->sums[i], sum))
+        {
+          return false;
+        }
+    }
+  return true;
+}
+
+void
+casheph_cube_destroy (casheph_cube_t *cube)
+{
+  if (cube == NULL)
+    {
+      return;
+    }
+  int i;
+  for (i = 0; i < 3; ++i)
+    {
+      free (cube->periods[i].keys);
+      free (cube->periods[i].sums);
+      free (cube->periods[i].counts);
+    }
+  free (cube);
+}
+
+casheph_cube_t *
+casheph_account_cube (casheph_account_t *act)
+{
+  if (act->cube == NULL)
+    {
+      act->cube = (casheph_cube_t*)calloc (1, sizeof (casheph_cube_t));
+      act->cube->denom = act->commodity_scu > 0 ? act->commodity_scu : 100;
+    }
+  return act->cube;
+}
+
+void
+casheph_cubes_update (casheph_t *ce, casheph_transaction_t *trn, int sign)
+{
+  if (!ce->cubes_built)
+    {
+      return;
+    }
+  struct tm tm;
+  localtime_r (&trn->date_posted, &tm);
+  int y = tm.tm_year + 1900;
+  unsigned int m = tm.tm_mon + 1;
+  unsigned int d = tm.tm_mday;
+  casheph_guid_map_t *map = casheph_account_map (ce);
+  int i;
+  for (i = 0; i < trn->n_splits; ++i)
+    {
+      casheph_split_t *split = trn->splits[i];
+      casheph_account_t *act = (casheph_account_t*)casheph_guid_map_get (map, split->account);
+      if (act == NULL)
+        {
+          continue;
+        }
+      casheph_cube_t *cube = casheph_account_cube (act);
+      int64_t amount;
+      if (!casheph_rescale (split->quantity, cube->denom, &amount)
+          || (sign < 0 && amount == INT64_MIN))
+        {
+          cube->overflow = true;
+          continue;
+        }
+      int p;
+      for (p = ce_day; p <= ce_month; ++p)
+        {
+          if (!casheph_buckets_add (&cube->periods[p],
+                                    casheph_bucket_key ((casheph_period_t)p, y, m, d),
+                                    sign * amount, sign))
+            {
+              cube->overflow = true;
+            }
+        }
+    }
+}
+
+void
+casheph_cubes_clear_rec (casheph_account_t *act)
+{
+  casheph_cube_destroy (act->cube);
+  act->cube = NULL;
+  int i;
+  for (i = 0; i < act->n_accounts; ++i)
+    {
+      casheph_cubes_clear_rec (act->accounts[i]);
+    }
+}
+
+void
+casheph_build_cubes (casheph_t *ce)
+{
+  ce->cubes_built = true;
+  int i;
+  for (i = 0; i < ce->n_transactions; ++i)
+    {
+      casheph_cubes_update (ce, ce->transactions[i], 1);
+    }
+}
+
+unsigned int
+casheph_days_in_month (int y, unsigned int m)
+{
+  static const unsigned int days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+  if (m == 2 && (y % 4 == 0 && (y % 100 != 0 || y % 400 == 0)))
+    {
+      return 29;
+    }
+  return days[m - 1];
+}
+
+bool
+casheph_account_period_sum (casheph_t *ce, casheph_account_t *act,
+                            const casheph_gdate_t *from,
+                            const casheph_gdate_t *to, casheph_wval_t *sum)
+{
+  if (!ce->cubes_built)
+    {
+      casheph_build_cubes (ce);
+    }
+  casheph_cube_t *cube = casheph_account_cube (act);
+  casheph_buckets_t *days = &cube->periods[ce_day];
+  casheph_buckets_t *months = &cube->periods[ce_month];
+  int32_t from_day = casheph_days_from_civil (from->year, from->month, from->day);
+  int32_t to_day = casheph_days_from_civil (to->year, to->month, to->day);
+  int32_t first_month = casheph_bucket_key (ce_month, from->year, from->month, 1);
+  int32_t last_month = casheph_bucket_key (ce_month, to->year, to->month, 1);
+  if (from->day != 1)
+    {
+      ++first_month;
+    }
+  if (to->day != casheph_days_in_month (to->year, to->month))
+    {
+      --last_month;
+    }
+  int64_t total = 0;
+  bool ok;
+  if (first_month > last_month)
+    {
+      ok = casheph_buckets_sum (days, from_day, to_day, &total);
+    }
+  else
+    {
+      /* Whole months from the month buckets, the ragged ends from the
+         day buckets. */
+      int32_t head_end = casheph_days_from_civil (first_month / 12, first_month % 12 + 1, 1) - 1;
+      int32_t tail_start = casheph_days_from_civil ((last_month + 1) / 12,
+                                                    (last_month + 1) % 12 + 1, 1);
+      ok = (casheph_buckets_sum (days, from_day, head_end, &total)
+            && casheph_buckets_sum (months, first_month, last_month, &total)
+            && casheph_buckets_sum (days, tail_start, to_day, &total));
+    }
+  if (!ok || cube->overflow)
+    {
+      return false;
+    }
+  sum->n = total;
+  sum->d = cube->denom;
+  return true;
+}
+
+int
+casheph_account_period_series (casheph_t *ce, casheph_account_t *act,
+                               casheph_period_t period,
+                               const casheph_gdate_t *from,
+                               const casheph_gdate_t *to,
+                               casheph_wval_t *sums, int max)
+{
+  if (!ce->cubes_built)
+    {
+      casheph_build_cubes (ce);
+    }
+  casheph_cube_t *cube = casheph_account_cube (act);
+  casheph_buckets_t *b = &cube->periods[period];
+  int32_t lo = casheph_bucket_key (period, from->year, from->month, from->day);
+  int32_t hi = casheph_bucket_key (period, to->year, to->month, to->day);
+  int32_t step = period == ce_week ? 7 : 1;
+  if (cube->overflow)
+    {
+      return -1;
+    }
+  if (hi < lo)
+    {
+      return 0;
+    }
+  int n = (hi - lo) / step + 1;
+  int i;
+  for (i = 0; i < n && i < max; ++i)
+    {
+      sums[i].n = 0;
+      sums[i].d = cube->denom;
+    }
+  for (i = casheph_buckets_lower_bound (b, lo); i < b->n && b->keys[i] <= hi; ++i)
+    {
+      int k = (b->keys[i] - lo) / step;
+      if (k < max)
+        {
+          sums[k].n = b->sums[i];
+        }
+    }
+  return n;
+}
+
+void
+casheph_index_trn_added (casheph_t *ce, casheph_transaction_t *trn)
+{
+  ++ce->mod_count;
+  trn->version = ce->mod_count;
+  if (ce->trn_map != NULL)
+    {
+      casheph_guid_map_put (ce->trn_map, trn->id, trn);
+    }
+  if (ce->ledgers_built)
+    {
+      casheph_ledgers_add_trn (ce, trn, false);
+    }
+  if (ce->text_index != NULL)
+    {
+      casheph_text_index_add (ce->text_index, trn);
+    }
+  casheph_cubes_update (ce, trn, 1);
+}
+
+/* The same as casheph_index_trn_added on each of TRNS, but ledgers get
+   one sort instead of N sorted inserts. */
+void
+casheph_index_trns_added (casheph_t *ce, casheph_transaction_t **trns, int n)
+{
+  if (n < 64)
+    {
+      int i;
+      for (i = 0; i < n; ++i)
+        {
+          casheph_index_trn_added (ce, trns[i]);
+        }
+      return;
+    }
+  ++ce->mod_count;
+  int i;
+  for (i = 0; i < n; ++i)
+    {
+      casheph_transaction_t *trn = trns[i];
+      trn->version = ce->mod_count;
+      if (ce->trn_map != NULL)
+        {
+          casheph_guid_map_put (ce->trn_map, trn->id, trn);
+        }
+      if (ce->ledgers_built)
+        {
+          casheph_ledgers_add_trn (ce, trn, true);
+        }
+      if (ce->text_index != NULL)
+        {
+          casheph_text_index_add (ce->text_index, trn);
+        }
+      casheph_cubes_update (ce, trn, 1);
+    }
+  if (ce->ledgers_built)
+    {
+      casheph_ledgers_sort_rec (ce->root);
+    }
+}
+
+void
+casheph_index_trn_removed (casheph_t *ce, casheph_transaction_t *trn)
+{
+  ++ce->mod_count;
+  ++ce->n_tombstones;
+  ce->tombstones = (casheph_tombstone_t*)realloc (ce->tombstones,
+                                                  sizeof (casheph_tombstone_t)
+                                                  * ce->n_tombstones);
+  ce->tombstones[ce->n_tombstones - 1].id = strdup (trn->id);
+  ce->tombstones[ce->n_tombstones - 1].version = ce->mod_count;
+  if (ce->trn_map != NULL)
+    {
+      casheph_guid_map_remove (ce->trn_map, trn->id);
+    }
+  if (ce->ledgers_built)
+    {
+      casheph_guid_map_t *map = casheph_account_map (ce);
+      int i;
+      for (i = 0; i < trn->n_splits; ++i)
+        {
+          casheph_account_t *act = (casheph_account_t*)casheph_guid_map_get (map, trn->splits[i]->account);
+          if (act != NULL && act->ledger != NULL)
+            {
+              casheph_ledger_remove (act->ledger, trn);
+            }
+        }
+    }
+  if (ce->text_index != NULL)
+    {
+      casheph_text_index_remove (ce->text_index, trn);
+    }
+  casheph_cubes_update (ce, trn, -1);
+}
+
+/* Drop the entries of REMOVED transactions from every ledger under
+   ACT, compacting each ledger in one pass. */
+void
+casheph_ledgers_drop_rec (casheph_account_t *act, casheph_guid_map_t *removed)
+{
+  casheph_ledger_t *ledger = act->ledger;
+  int i;
+  if (ledger != NULL)
+    {
+      int j = 0;
+      int first = -1;
+      for (i = 0; i < ledger->n; ++i)
+        {
+          if (casheph_guid_map_get (removed, ledger->entries[i].trn->id) != NULL)
+            {
+              if (first < 0)
+                {
+                  first = i;
+                }
+              continue;
+            }
+          ledger->entries[j] = ledger->entries[i];
+          ledger->states[j] = ledger->states[i];
+          ++j;
+        }
+      ledger->n = j;
+      if (first >= 0 && ledger->n_valid > first)
+        {
+          ledger->n_valid = first;
+        }
+    }
+  for (i = 0; i < act->n_accounts; ++i)
+    {
+      casheph_ledgers_drop_rec (act->accounts[i], removed);
+    }
+}
+
+/* The same as casheph_index_trn_removed on each of TRNS, whose IDs are
+   the keys of REMOVED. */
+void
+casheph_index_trns_removed (casheph_t *ce, casheph_transaction_t **trns, int n,
+                            casheph_guid_map_t *removed)
+{
+  ++ce->mod_count;
+  ce->tombstones = (casheph_tombstone_t*)realloc (ce->tombstones,
+                                                  sizeof (casheph_tombstone_t)
+                                                  * (ce->n_tombstones + n));
+  int i;
+  for (i = 0; i < n; ++i)
+    {
+      casheph_transaction_t *trn = trns[i];
+      ce->tombstones[ce->n_tombstones].id = strdup (trn->id);
+      ce->tombstones[ce->n_tombstones].version = ce->mod_count;
+      ++ce->n_tombstones;
+      if (ce->trn_map != NULL)
+        {
+          casheph_guid_map_remove (ce->trn_map, trn->id);
+        }
+      if (ce->text_index != NULL)
+        {
+          casheph_text_index_remove (ce->text_index, trn);
+        }
+      casheph_cubes_update (ce, trn, -1);
+    }
+  if (ce->ledgers_built)
+    {
+      casheph_ledgers_drop_rec (ce->root, removed);
+    }
+}
+
+/* Journal records are transactions in the same XML as the book and
+   <casheph:remove> elements holding a transaction ID, one per line
+   group.  Replay ignores adds of transactions already present and
+   removes of absent ones, so a journal that was not emptied after a
+   compaction does no harm. */
+void
+casheph_journal_write (casheph_t *ce, casheph_buf_t *rec)
+{
+  if (fwrite (rec->data, 1, rec->len, ce->journal) != rec->len)
+    {
+      ce->journal_failed = true;
+      return;
+    }
+  if (++ce->journal_pending >= ce->journal_group)
+    {
+      casheph_journal_sync (ce);
+    }
+}
+
+void
+casheph_journal_add (casheph_t *ce, casheph_transaction_t *trn)
+{
+  if (ce->journal == NULL)
+    {
+      return;
+    }
+  casheph_buf_t rec;
+  casheph_buf_init (&rec, 2048, NULL, NULL);
+  casheph_write_transaction (trn, &rec);
+  casheph_journal_write (ce, &rec);
+  casheph_buf_free (&rec);
+}
+
+void
+casheph_journal_remove (casheph_t *ce, const char *id)
+{
+  if (ce->journal == NULL)
+    {
+      return;
+    }
+  casheph_buf_t rec;
+  casheph_buf_init (&rec, 64, NULL, NULL);
+  casheph_buf_put_elem (&rec, "", "<casheph:remove>", id, "</casheph:remove>\n");
+  casheph_journal_write (ce, &rec);
+  casheph_buf_free (&rec);
+}
+
+void
+casheph_journal_reconcile (casheph_t *ce, casheph_transaction_t *trn,
+                           casheph_split_t *split)
+{
+  if (ce->journal == NULL)
+    {
+      return;
+    }
+  casheph_buf_t rec;
+  casheph_buf_init (&rec, 160, NULL, NULL);
+  casheph_buf_putl (&rec, "<casheph:reconcile>\n");
+  casheph_buf_put_elem (&rec, "", "  <trn:id>", trn->id, "</trn:id>\n");
+  casheph_buf_put_elem (&rec, "", "  <split:id>", split->id, "</split:id>\n");
+  casheph_buf_putl (&rec, "  <split:reconciled-state>");
+  casheph_buf_putc (&rec, split->reconciled_state);
+  casheph_buf_putl (&rec, "</split:reconciled-state>\n"
+                    "</casheph:reconcile>\n");
+  casheph_journal_write (ce, &rec);
+  casheph_buf_free (&rec);
+}
+
+char *
+casheph_journal_path (const char *filename)
+{
+  char *path = (char*)malloc (strlen (filename) + 9);
+  strcpy (path, filename);
+  strcat (path, ".journal");
+  return path;
+}
+
+bool
+casheph_journal_open (casheph_t *ce, const char *filename, int group)
+{
+  casheph_journal_close (ce);
+  char *path = casheph_journal_path (filename);
+  ce->journal = fopen (path, "a");
+  free (path);
+  if (ce->journal == NULL)
+    {
+      return false;
+    }
+  ce->journal_book = strdup (filename);
+  ce->journal_group = group > 1 ? group : 1;
+  ce->journal_pending = 0;
+  ce->journal_failed = false;
+  return true;
+}
+
+bool
+casheph_journal_sync (casheph_t *ce)
+{
+  if (ce->journal == NULL)
+    {
+      return false;
+    }
+  ce->journal_pending = 0;
+  if (fflush (ce->journal) != 0 || fsync (fileno (ce->journal)) != 0)
+    {
+      ce->journal_failed = true;
+    }
+  return !ce->journal_failed;
+}
+
+bool
+casheph_journal_compact (casheph_t *ce, const casheph_save_opts_t *opts)
+{
+  if (ce->journal == NULL)
+    {
+      return false;
+    }
+  /* The journal may only be emptied once the new book is durably in
+     place, so write it aside, sync it and rename it over the old one. */
+  char *tmp = (char*)malloc (strlen (ce->journal_book) + 8);
+  strcpy (tmp, ce->journal_book);
+  strcat (tmp, ".saving");
+  bool ok = casheph_save_with (ce, tmp, opts, NULL);
+  if (ok)
+    {
+      int fd = open (tmp, O_RDONLY);
+      ok = fd >= 0 && fsync (fd) == 0;
+      if (fd >= 0)
+        {
+          close (fd);
+        }
+    }
+  ok = ok && rename (tmp, ce->journal_book) == 0;
+  if (!ok)
+    {
+      unlink (tmp);
+      free (tmp);
+      casheph_saved_free (ce);
+      return false;
+    }
+  free (tmp);
+  if (ce->saved != NULL)
+    {
+      free (ce->saved->path);
+      ce->saved->path = strdup (ce->journal_book);
+    }
+  /* The book now holds whatever the journal failed to record. */
+  fflush (ce->journal);
+  ce->journal_pending = 0;
+  ce->journal_failed = (ftruncate (fileno (ce->journal), 0) != 0
+                        || fsync (fileno (ce->journal)) != 0);
+  return !ce->journal_failed;
+}
+
+void
+casheph_journal_close (casheph_t *ce)
+{
+  if (ce->journal == NULL)
+    {
+      return;
+    }
+  casheph_journal_sync (ce);
+  fclose (ce->journal);
+  ce->journal = NULL;
+  free (ce->journal_book);
+  ce->journal_book = NULL;
+}
+
+/* Length of STR up to the end of its last complete record, so a record
+   torn by a crash is dropped. */
+size_t
+casheph_journal_complete_len (const char *str)
+{
+  const char *ends[3] = { "</gnc:transaction>\n", "</casheph:remove>\n",
+                          "</casheph:reconcile>\n" };
+  size_t len = 0;
+  int i;
+  for (i = 0; i < 3; ++i)
+    {
+      const char *m;
+      for (m = strstr (str, ends[i]); m != NULL; m = strstr (m + 1, ends[i]))
+        {
+          size_t end = m - str + strlen (ends[i]);
+          if (end > len)
+            {
+              len = end;
+            }
+        }
+    }
+  return len;
+}
+
+void
+casheph_journal_replay (casheph_t *ce, const char *filename,
+                        const casheph_filter_t *filter,
+                        casheph_guid_map_t *filter_accounts)
+{
+  char *path = casheph_journal_path (filename);
+  FILE *file = fopen (path, "r");
+  free (path);
+  if (file == NULL)
+    {
+      return;
+    }
+  fseek (file, 0, SEEK_END);
+  long size = ftell (file);
+  fseek (file, 0, SEEK_SET);
+  const char *open = "<casheph:journal>\n";
+  const char *close = "</casheph:journal>\n";
+  char *str = (char*)malloc (strlen (open) + size + strlen (close) + 1);
+  strcpy (str, open);
+  size_t n = fread (str + strlen (open), 1, size, file);
+  fclose (file);
+  str[strlen (open) + n] = '\0';
+  strcpy (str + casheph_journal_complete_len (str), close);
+
+  mxml_node_t *tree = mxmlLoadString (NULL, str, MXML_TEXT_CALLBACK);
+  free (str);
+  if (tree == NULL)
+    {
+      return;
+    }
+  mxml_node_t *node;
+  for (node = mxmlGetFirstChild (tree); node != NULL;
+       node = mxmlGetNextSibling (node))
+    {
+      if (node->type != MXML_ELEMENT)
+        {
+          continue;
+        }
+      if (strcmp (node->value.element.name, "gnc:transaction") == 0)
+        {
+          char *id = mxml_load_child_text (node, "trn:id");
+          bool present = id == NULL || casheph_get_transaction (ce, id) != NULL;
+          free (id);
+          if (present || (filter != NULL
+                          && !casheph_filter_match (filter, filter_accounts, node)))
+            {
+              continue;
+            }
+          casheph_transaction_t *trn = mxml_load_transaction (node);
+          ++ce->n_transactions;
+          ce->transactions = (casheph_transaction_t**)realloc (ce->transactions,
+                                                               sizeof (casheph_transaction_t*)
+                                                               * ce->n_transactions);
+          ce->transactions[ce->n_transactions - 1] = trn;
+          casheph_index_trn_added (ce, trn);
+        }
+      else if (strcmp (node->value.element.name, "casheph:remove") == 0)
+        {
+          const char *id = mxmlGetText (mxmlGetFirstChild (node), NULL);
+          if (id != NULL)
+            {
+              casheph_remove_trn (ce, id);
+            }
+        }
+      else if (strcmp (node->value.element.name, "casheph:reconcile") == 0)
+        {
+          char *trn_id = mxml_load_child_text (node, "trn:id");
+          char *split_id = mxml_load_child_text (node, "split:id");
+          char *state = mxml_load_child_text (node, "split:reconciled-state");
+          casheph_transaction_t *trn = NULL;
+          if (trn_id != NULL && split_id != NULL && state != NULL
+              && state[0] != '\0')
+            {
+              trn = casheph_get_transaction (ce, trn_id);
+            }
+          int i;
+          for (i = 0; trn != NULL && i < trn->n_splits; ++i)
+            {
+              if (strcmp (trn->splits[i]->id, split_id) == 0)
+                {
+                  casheph_split_set_reconciled (ce, trn, trn->splits[i],
+                                                (casheph_reconcile_t)state[0]);
+                  break;
+                }
+            }
+          free (trn_id);
+          free (split_id);
+          free (state);
+        }
+    }
+  mxmlDelete (tree);
+}
+
+/* Binary cache of a book, "<file>.cache".  After a header naming the
+   source file's size, mtime and CRC and the TZ it was loaded under
+   comes the body, with its own CRC: every object in load order, with
+   counts before arrays and strings as a length and bytes (~0 for
+   NULL). */
+#define CASHEPH_CACHE_MAGIC "CECACHE1"
+
+void
+casheph_bin_u32 (casheph_buf_t *out, uint32_t v)
+{
+  memcpy (casheph_buf_reserve (out, 4), &v, 4);
+  out->len += 4;
+}
+
+void
+casheph_bin_i64 (casheph_buf_t *out, int64_t v)
+{
+  memcpy (casheph_buf_reserve (out, 8), &v, 8);
+  out->len += 8;
+}
+
+void
+casheph_bin_str (casheph_buf_t *out, const char *str)
+{
+  if (str == NULL)
+    {
+      casheph_bin_u32 (out, 0xffffffff);
+      return;
+    }
+  size_t len = strlen (str);
+  casheph_bin_u32 (out, len);
+  casheph_buf_put (out, str, len);
+}
+
+void
+casheph_bin_gdate (casheph_buf_t *out, const casheph_gdate_t *date)
+{
+  casheph_buf_putc (out, date != NULL);
+  if (date != NULL)
+    {
+      casheph_bin_u32 (out, date->year);
+      casheph_bin_u32 (out, date->month);
+      casheph_bin_u32 (out, date->day);
+    }
+}
+
+void
+casheph_bin_slots (casheph_buf_t *out, int n_slots, casheph_slot_t **slots)
+{
+  casheph_bin_u32 (out, n_slots);
+  int i;
+  for (i = 0; i < n_slots; ++i)
+    {
+      casheph_slot_t *slot = slots[i];
+      if (slot == NULL)
+        {
+          casheph_buf_putc (out, (char)0xff);
+          continue;
+        }
+      casheph_buf_putc (out, slot->type);
+      casheph_bin_str (out, slot->key);
+      casheph_frame_t *frame;
+      switch (slot->type)
+        {
+        case ce_gdate:
+          casheph_bin_gdate (out, (casheph_gdate_t*)slot->value);
+          break;
+        case ce_string:
+        case ce_guid:
+          casheph_bin_str (out, (char*)slot->value);
+          break;
+        case ce_numeric:
+          casheph_bin_u32 (out, ((casheph_val_t*)slot->value)->n);
+          casheph_bin_u32 (out, ((casheph_val_t*)slot->value)->d);
+          break;
+        case ce_frame:
+          frame = (casheph_frame_t*)slot->value;
+          casheph_bin_slots (out, frame->n_slots, frame->slots);
+          break;
+        }
+    }
+}
+
+void
+casheph_bin_account (casheph_buf_t *out, casheph_account_t *act)
+{
+  casheph_bin_str (out, act->id);
+  casheph_bin_str (out, act->type);
+  casheph_bin_str (out, act->name);
+  casheph_bin_str (out, act->description);
+  casheph_bin_str (out, act->parent);
+  casheph_buf_putc (out, act->commodity != NULL);
+  if (act->commodity != NULL)
+    {
+      casheph_bin_str (out, act->commodity->space);
+      casheph_bin_str (out, act->commodity->id);
+    }
+  casheph_bin_u32 (out, act->commodity_scu);
+  casheph_bin_slots (out, act->n_slots, act->slots);
+  int i;
+  for (i = 0; i < act->n_accounts; ++i)
+    {
+      casheph_bin_account (out, act->accounts[i]);
+    }
+}
+
+void
+casheph_bin_accounts (casheph_buf_t *out, casheph_account_t *root)
+{
+  casheph_bin_u32 (out, 1 + casheph_account_n_sub_accounts (root));
+  casheph_bin_account (out, root);
+}
+
+void
+casheph_bin_transactions (casheph_buf_t *out, int n,
+                          casheph_transaction_t **trns)
+{
+  casheph_bin_u32 (out, n);
+  int i;
+  for (i = 0; i < n; ++i)
+    {
+      casheph_transaction_t *trn = trns[i];
+      casheph_bin_str (out, trn->id);
+      casheph_bin_i64 (out, trn->date_posted);
+      casheph_bin_i64 (out, trn->date_entered);
+      casheph_bin_str (out, trn->desc);
+      casheph_bin_slots (out, trn->n_slots, trn->slots);
+      casheph_bin_u32 (out, trn->n_splits);
+      int j;
+      for (j = 0; j < trn->n_splits; ++j)
+        {
+          casheph_split_t *split = trn->splits[j];
+          casheph_bin_str (out, split->id);
+          casheph_buf_putc (out, split->reconciled_state);
+          casheph_bin_i64 (out, split->value->n);
+          casheph_bin_u32 (out, split->value->d);
+          casheph_bin_i64 (out, split->quantity->n);
+          casheph_bin_u32 (out, split->quantity->d);
+          casheph_bin_str (out, split->account);
+          casheph_bin_slots (out, split->n_slots, split->slots);
+        }
+    }
+}
+
+void
+casheph_bin_schedxactions (casheph_buf_t *out, casheph_t *ce)
+{
+  casheph_bin_u32 (out, ce->n_schedxactions);
+  int i;
+  for (i = 0; i < ce->n_schedxactions; ++i)
+    {
+      casheph_schedxaction_t *sx = ce->schedxactions[i];
+      casheph_bin_str (out, sx->id);
+      casheph_bin_str (out, sx->name);
+      casheph_buf_putc (out, sx->enabled);
+      casheph_buf_putc (out, sx->auto_create);
+      casheph_buf_putc (out, sx->auto_create_notify);
+      casheph_bin_u32 (out, sx->advance_create_days);
+      casheph_bin_u32 (out, sx->advance_remind_days);
+      casheph_bin_u32 (out, sx->instance_count);
+      casheph_bin_gdate (out, sx->start);
+      casheph_bin_gdate (out, sx->last);
+      casheph_bin_str (out, sx->templ_acct);
+      casheph_buf_putc (out, sx->schedule != NULL);
+      if (sx->schedule == NULL)
+        {
+          continue;
+        }
+      casheph_bin_u32 (out, sx->schedule->n_recurrences);
+      int j;
+      for (j = 0; j < sx->schedule->n_recurrences; ++j)
+        {
+          casheph_recurrence_t *rec = sx->schedule->recurrences[j];
+          casheph_bin_u32 (out, rec->mult);
+          casheph_bin_str (out, rec->period_type);
+          casheph_bin_gdate (out, rec->start);
+          casheph_bin_str (out, rec->weekend_adj);
+        }
+    }
+}
+
+/* The header fields that must match for a cache to be used. */
+typedef struct
+{
+  uint64_t size;
+  int64_t mtime;
+  int64_t mtime_ns;
+  uint32_t crc;
+  const char *tz;
+} casheph_cache_key_t;
+
+bool
+casheph_cache_key (const char *filename, casheph_cache_key_t *key)
+{
+  int fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    {
+      return false;
+    }
+  struct stat st;
+  if (fstat (fd, &st) != 0 || st.st_size == 0)
+    {
+      close (fd);
+      return false;
+    }
+  void *map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    {
+      return false;
+    }
+  key->size = st.st_size;
+  key->mtime = st.st_mtim.tv_sec;
+  key->mtime_ns = st.st_mtim.tv_nsec;
+  key->crc = crc32 (crc32 (0, Z_NULL, 0), (const Bytef*)map, st.st_size);
+  munmap (map, st.st_size);
+  key->tz = getenv ("TZ");
+  if (key->tz == NULL)
+    {
+      key->tz = "";
+    }
+  return true;
+}
+
+char *
+casheph_cache_path (const char *filename, const char *suffix)
+{
+  char *path = (char*)malloc (strlen (filename) + strlen (suffix) + 1);
+  strcpy (path, filename);
+  strcat (path, suffix);
+  return path;
+}
+
+bool
+casheph_cache_write (casheph_t *ce, const char *filename)
+{
+  /* Only a book that still holds exactly what FILENAME holds. */
+  bool clean = ((ce->saved != NULL && ce->saved->mod_count == ce->mod_count
+                 && casheph_saved_unchanged (ce->saved, filename))
+                || (ce->loaded != NULL
+                    && ce->loaded->mod_count == ce->mod_count
+                    && casheph_saved_unchanged (ce->loaded, filename)));
+  casheph_cache_key_t key;
+  if (!clean || !casheph_cache_key (filename, &key))
+    {
+      return false;
+    }
+  casheph_buf_t body;
+  casheph_buf_init (&body, 1 << 20, NULL, NULL);
+  casheph_bin_str (&body, ce->book_id);
+  casheph_bin_accounts (&body, ce->root);
+  casheph_bin_transactions (&body, ce->n_transactions, ce->transactions);
+  casheph_buf_putc (&body, ce->template_root != NULL);
+  if (ce->template_root != NULL)
+    {
+      casheph_bin_accounts (&body, ce->template_root);
+    }
+  casheph_bin_transactions (&body, ce->n_template_transactions,
+                            ce->template_transactions);
+  casheph_bin_schedxactions (&body, ce);
+
+  casheph_buf_t head;
+  casheph_buf_init (&head, 256, NULL, NULL);
+  casheph_buf_put (&head, CASHEPH_CACHE_MAGIC, 8);
+  /* Byte order check. */
+  casheph_bin_u32 (&head, 0x01020304);
+  casheph_bin_i64 (&head, key.size);
+  casheph_bin_i64 (&head, key.mtime);
+  casheph_bin_i64 (&head, key.mtime_ns);
+  casheph_bin_u32 (&head, key.crc);
+  casheph_bin_str (&head, key.tz);
+  casheph_bin_i64 (&head, body.len);
+  casheph_bin_u32 (&head, crc32 (crc32 (0, Z_NULL, 0), (const Bytef*)body.data,
+                                 body.len));
+
+  char *tmp = casheph_cache_path (filename, ".cache.tmp");
+  char *path = casheph_cache_path (filename, ".cache");
+  FILE *file = fopen (tmp, "wb");
+  bool ok = file != NULL;
+  if (ok)
+    {
+      ok = fwrite (head.data, 1, head.len, file) == head.len;
+      ok = fwrite (body.data, 1, body.len, file) == body.len && ok;
+      ok = fclose (file) == 0 && ok;
+      ok = ok && rename (tmp, path) == 0;
+      if (!ok)
+        {
+          unlink (tmp);
+        }
+    }
+  free (tmp);
+  free (path);
+  casheph_buf_free (&head);
+  casheph_buf_free (&body);
+  return ok;
+}
+
+typedef struct
+{
+  const char *p;
+  const char *end;
+  bool bad;
+} casheph_bin_reader_t;
+
+bool
+casheph_bin_need (casheph_bin_reader_t *in, size_t n)
+{
+  if (in->bad || (size_t)(in->end - in->p) < n)
+    {
+      in->bad = true;
+      return false;
+    }
+  return true;
+}
+
+unsigned char
+casheph_bin_get_u8 (casheph_bin_reader_t *in)
+{
+  if (!casheph_bin_need (in, 1))
+    {
+      return 0;
+    }
+  return (unsigned char)*in->p++;
+}
+
+uint32_t
+casheph_bin_get_u32 (casheph_bin_reader_t *in)
+{
+  uint32_t v = 0;
+  if (casheph_bin_need (in, 4))
+    {
+      memcpy (&v, in->p, 4);
+      in->p += 4;
+    }
+  return v;
+}
+
+int64_t
+casheph_bin_get_i64 (casheph_bin_reader_t *in)
+{
+  int64_t v = 0;
+  if (casheph_bin_need (in, 8))
+    {
+      memcpy (&v, in->p, 8);
+      in->p += 8;
+    }
+  return v;
+}
+
+char *
+casheph_bin_get_str (casheph_bin_reader_t *in)
+{
+  uint32_t len = casheph_bin_get_u32 (in);
+  if (len == 0xffffffff || !casheph_bin_need (in, len))
+    {
+      return NULL;
+    }
+  char *str = (char*)malloc (len + 1);
+  memcpy (str, in->p, len);
+  str[len] = '\0';
+  in->p += len;
+  return str;
+}
+
+/* A count of items each taking at least MIN_SIZE more bytes. */
+uint32_t
+casheph_bin_get_count (casheph_bin_reader_t *in, size_t min_size)
+{
+  uint32_t n = casheph_bin_get_u32 (in);
+  if (in->bad || n > (size_t)(in->end - in->p) / min_size)
+    {
+      in->bad = true;
+      return 0;
+    }
+  return n;
+}
+
+casheph_gdate_t *
+casheph_bin_get_gdate (casheph_bin_reader_t *in)
+{
+  if (!casheph_bin_get_u8 (in))
+    {
+      return NULL;
+    }
+  casheph_gdate_t *date = (casheph_gdate_t*)malloc (sizeof (casheph_gdate_t));
+  date->year = casheph_bin_get_u32 (in);
+  date->month = casheph_bin_get_u32 (in);
+  date->day = casheph_bin_get_u32 (in);
+  return date;
+}
+
+casheph_slot_t **
+casheph_bin_get_slots (casheph_bin_reader_t *in, int *n_slots)
+{
+  *n_slots = casheph_bin_get_count (in, 1);
+  if (*n_slots == 0)
+    {
+      return NULL;
+    }
+  casheph_slot_t **slots = (casheph_slot_t**)malloc (sizeof (casheph_slot_t*) * *n_slots);
+  int i;
+  for (i = 0; i < *n_slots; ++i)
+    {
+      unsigned char type = casheph_bin_get_u8 (in);
+      if (type == 0xff)
+        {
+          slots[i] = NULL;
+          continue;
+        }
+      casheph_slot_t *slot = (casheph_slot_t*)malloc (sizeof (casheph_slot_t));
+      slot->type = (casheph_slot_type_t)type;
+      slot->key = casheph_bin_get_str (in);
+      casheph_val_t *val;
+      casheph_frame_t *frame;
+      switch (slot->type)
+        {
+        case ce_gdate:
+          slot->value = casheph_bin_get_gdate (in);
+          break;
+        case ce_string:
+        case ce_guid:
+          slot->value = casheph_bin_get_str (in);
+          break;
+        case ce_numeric:
+          val = (casheph_val_t*)malloc (sizeof (casheph_val_t));
+          val->n = (int32_t)casheph_bin_get_u32 (in);
+          val->d = casheph_bin_get_u32 (in);
+          slot->value = val;
+          break;
+        case ce_frame:
+          frame = (casheph_frame_t*)malloc (sizeof (casheph_frame_t));
+          frame->slots = casheph_bin_get_slots (in, &frame->n_slots);
+          slot->value = frame;
+          break;
+        default:
+          in->bad = true;
+          slot->type = ce_string;
+          slot->value = NULL;
+          break;
+        }
+      slots[i] = slot;
+    }
+  return slots;
+}
+
+/* The root of the accounts read, all collected into a tree. */
+casheph_account_t *
+casheph_bin_get_accounts (casheph_bin_reader_t *in)
+{
+  int n = casheph_bin_get_count (in, 20);
+  if (n <= 0 || in->bad)
+    {
+      in->bad = true;
+      return NULL;
+    }
+  casheph_account_t **accounts = (casheph_account_t**)malloc (sizeof (casheph_account_t*) * n);
+  int i;
+  for (i = 0; i < n; ++i)
+    {
+      casheph_account_t *act = (casheph_account_t*)malloc (sizeof (casheph_account_t));
+      act->accounts = NULL;
+      act->n_accounts = 0;
+      act->ledger = NULL;
+      act->cube = NULL;
+      act->id = casheph_bin_get_str (in);
+      act->type = casheph_bin_get_str (in);
+      act->name = casheph_bin_get_str (in);
+      act->description = casheph_bin_get_str (in);
+      act->parent = casheph_bin_get_str (in);
+      act->commodity = NULL;
+      if (casheph_bin_get_u8 (in))
+        {
+          act->commodity = (casheph_commodity_t*)malloc (sizeof (casheph_commodity_t));
+          act->commodity->space = casheph_bin_get_str (in);
+          act->commodity->id = casheph_bin_get_str (in);
+        }
+      act->commodity_scu = (int32_t)casheph_bin_get_u32 (in);
+      act->slots = casheph_bin_get_slots (in, &act->n_slots);
+      accounts[i] = act;
+      if (act->id == NULL)
+        {
+          in->bad = true;
+        }
+    }
+  casheph_account_t *root = NULL;
+  if (!in->bad)
+    {
+      root = accounts[0];
+      casheph_account_collect_accounts (root, n, accounts);
+    }
+  else
+    {
+      for (i = 0; i < n; ++i)
+        {
+          casheph_account_destroy (accounts[i]);
+        }
+    }
+  free (accounts);
+  return root;
+}
+
+casheph_transaction_t **
+casheph_bin_get_transactions (casheph_bin_reader_t *in, int *n)
+{
+  *n = casheph_bin_get_count (in, 24);
+  if (*n == 0)
+    {
+      return NULL;
+    }
+  casheph_transaction_t **trns = (casheph_transaction_t**)malloc (sizeof (casheph_transaction_t*) * *n);
+  int i;
+  for (i = 0; i < *n; ++i)
+    {
+      casheph_transaction_t *trn = (casheph_transaction_t*)malloc (sizeof (casheph_transaction_t));
+      trn->packed = false;
+      trn->id = casheph_bin_get_str (in);
+      trn->date_posted = casheph_bin_get_i64 (in);
+      trn->date_entered = casheph_bin_get_i64 (in);
+      trn->desc = casheph_bin_get_str (in);
+      trn->xml = NULL;
+      trn->xml_len = 0;
+      trn->version = 0;
+      trn->slots = casheph_bin_get_slots (in, &trn->n_slots);
+      trn->n_splits = casheph_bin_get_count (in, 30);
+      trn->splits = NULL;
+      if (trn->n_splits > 0)
+        {
+          trn->splits = (casheph_split_t**)malloc (sizeof (casheph_split_t*) * trn->n_splits);
+        }
+      int j;
+      for (j = 0; j < trn->n_splits; ++j)
+        {
+          casheph_split_t *split = (casheph_split_t*)malloc (sizeof (casheph_split_t));
+          split->id = casheph_bin_get_str (in);
+          split->reconciled_state = (casheph_reconcile_t)casheph_bin_get_u8 (in);
+          split->value = (casheph_wval_t*)malloc (sizeof (casheph_wval_t));
+          split->value->n = casheph_bin_get_i64 (in);
+          split->value->d = casheph_bin_get_u32 (in);
+          split->quantity = (casheph_wval_t*)malloc (sizeof (casheph_wval_t));
+          split->quantity->n = casheph_bin_get_i64 (in);
+          split->quantity->d = casheph_bin_get_u32 (in);
+          split->account = casheph_bin_get_str (in);
+          split->slots = casheph_bin_get_slots (in, &split->n_slots);
+          trn->splits[j] = split;
+        }
+      trns[i] = trn;
+    }
+  return trns;
+}
+
+void
+casheph_bin_get_schedxactions (casheph_bin_reader_t *in, casheph_t *ce)
+{
+  ce->n_schedxactions = casheph_bin_get_count (in, 30);
+  if (ce->n_schedxactions == 0)
+    {
+      return;
+    }
+  ce->schedxactions = (casheph_schedxaction_t**)malloc (sizeof (casheph_schedxaction_t*)
+                                                        * ce->n_schedxactions);
+  int i;
+  for (i = 0; i < ce->n_schedxactions; ++i)
+    {
+      casheph_schedxaction_t *sx = (casheph_schedxaction_t*)malloc (sizeof (casheph_schedxaction_t));
+      sx->id = casheph_bin_get_str (in);
+      sx->name = casheph_bin_get_str (in);
+      sx->enabled = casheph_bin_get_u8 (in);
+      sx->auto_create = casheph_bin_get_u8 (in);
+      sx->auto_create_notify = casheph_bin_get_u8 (in);
+      sx->advance_create_days = (int32_t)casheph_bin_get_u32 (in);
+      sx->advance_remind_days = (int32_t)casheph_bin_get_u32 (in);
+      sx->instance_count = (int32_t)casheph_bin_get_u32 (in);
+      sx->start = casheph_bin_get_gdate (in);
+      sx->last = casheph_bin_get_gdate (in);
+      sx->templ_acct = casheph_bin_get_str (in);
+      sx->schedule = NULL;
+      if (casheph_bin_get_u8 (in))
+        {
+          casheph_schedule_t *schedule = (casheph_schedule_t*)malloc (sizeof (casheph_schedule_t));
+          schedule->n_recurrences = casheph_bin_get_count (in, 10);
+          schedule->recurrences = NULL;
+          if (schedule->n_recurrences > 0)
+            {
+              schedule->recurrences = (casheph_recurrence_t**)malloc (sizeof (casheph_recurrence_t*)
+                                                                      * schedule->n_recurrences);
+            }
+          int j;
+          for (j = 0; j < schedule->n_recurrences; ++j)
+            {
+              casheph_recurrence_t *rec = (casheph_recurrence_t*)malloc (sizeof (casheph_recurrence_t));
+              rec->mult = (int32_t)casheph_bin_get_u32 (in);
+              rec->period_type = casheph_bin_get_str (in);
+              rec->start = casheph_bin_get_gdate (in);
+              rec->weekend_adj = casheph_bin_get_str (in);
+              schedule->recurrences[j] = rec;
+            }
+          sx->schedule = schedule;
+        }
+      ce->schedxactions[i] = sx;
+    }
+}
+
+void
+casheph_schedxaction_destroy (casheph_schedxaction_t *sx)
+{
+  free (sx->id);
+  free (sx->name);
+  free (sx->start);
+  free (sx->last);
+  free (sx->templ_acct);
+  if (sx->schedule != NULL)
+    {
+      int i;
+      for (i = 0; i < sx->schedule->n_recurrences; ++i)
+        {
+          free (sx->schedule->recurrences[i]->period_type);
+          free (sx->schedule->recurrences[i]->start);
+          free (sx->schedule->recurrences[i]->weekend_adj);
+          free (sx->schedule->recurrences[i]);
+        }
+      free (sx->schedule->recurrences);
+      free (sx->schedule);
+    }
+  free (sx);
+}
+
+/* Free a book that failed to load from the cache: nothing is indexed
+   yet, so only the trees and arrays read so far are owned. */
+void
+casheph_cache_discard (casheph_t *ce)
+{
+  int i;
+  if (ce->root != NULL)
+    {
+      casheph_account_destroy (ce->root);
+    }
+  if (ce->template_root != NULL)
+    {
+      casheph_account_destroy (ce->template_root);
+    }
+  for (i = 0; i < ce->n_transactions; ++i)
+    {
+      casheph_trn_destroy (ce->transactions[i]);
+    }
+  free (ce->transactions);
+  for (i = 0; i < ce->n_template_transactions; ++i)
+    {
+      casheph_trn_destroy (ce->template_transactions[i]);
+    }
+  free (ce->template_transactions);
+  for (i = 0; i < ce->n_schedxactions; ++i)
+    {
+      casheph_schedxaction_destroy (ce->schedxactions[i]);
+    }
+  free (ce->schedxactions);
+  free (ce->book_id);
+  free (ce);
+}
+
+/* Open FILENAME from its cache if the cache is there and matches it,
+   otherwise return NULL. */
+casheph_t *
+casheph_cache_load (const char *filename)
+{
+  char *path = casheph_cache_path (filename, ".cache");
+  int fd = open (path, O_RDONLY);
+  free (path);
+  if (fd < 0)
+    {
+      return NULL;
+    }
+  struct stat st;
+  if (fstat (fd, &st) != 0 || st.st_size < 64)
+    {
+      close (fd);
+      return NULL;
+    }
+  void *map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    {
+      return NULL;
+    }
+  casheph_bin_reader_t in;
+  in.p = (const char*)map;
+  in.end = in.p + st.st_size;
+  in.bad = false;
+
+  casheph_cache_key_t key;
+  bool fresh = memcmp (in.p, CASHEPH_CACHE_MAGIC, 8) == 0;
+  in.p += 8;
+  fresh = fresh && casheph_bin_get_u32 (&in) == 0x01020304;
+  fresh = fresh && casheph_cache_key (filename, &key);
+  fresh = fresh && (uint64_t)casheph_bin_get_i64 (&in) == key.size;
+  fresh = fresh && casheph_bin_get_i64 (&in) == key.mtime;
+  fresh = fresh && casheph_bin_get_i64 (&in) == key.mtime_ns;
+  fresh = fresh && casheph_bin_get_u32 (&in) == key.crc;
+  char *tz = fresh ? casheph_bin_get_str (&in) : NULL;
+  fresh = fresh && tz != NULL && strcmp (tz, key.tz) == 0;
+  free (tz);
+  int64_t body_len = fresh ? casheph_bin_get_i64 (&in) : 0;
+  uint32_t body_crc = casheph_bin_get_u32 (&in);
+  fresh = (fresh && !in.bad && body_len == in.end - in.p
+           && body_crc == crc32 (crc32 (0, Z_NULL, 0), (const Bytef*)in.p,
+                                 body_len));
+  if (!fresh)
+    {
+      munmap (map, st.st_size);
+      return NULL;
+    }
+
+  casheph_t *ce = casheph_alloc ();
+  ce->book_id = casheph_bin_get_str (&in);
+  ce->root = casheph_bin_get_accounts (&in);
+  ce->transactions = casheph_bin_get_transactions (&in, &ce->n_transactions);
+  if (casheph_bin_get_u8 (&in))
+    {
+      ce->template_root = casheph_bin_get_accounts (&in);
+    }
+  ce->template_transactions = casheph_bin_get_transactions (&in, &ce->n_template_transactions);
+  casheph_bin_get_schedxactions (&in, ce);
+  munmap (map, st.st_size);
+  if (in.bad)
+    {
+      /* The CRC matched, so this is a cache written by something else;
+         leave it to the XML loader. */
+      casheph_cache_discard (ce);
+      return NULL;
+    }
+  casheph_loaded_record (ce, filename);
+  casheph_journal_replay (ce, filename, NULL, NULL);
+  return ce;
+}
+
+casheph_checkpoint_t
+casheph_checkpoint (casheph_t *ce)
+{
+  casheph_checkpoint_t cp;
+  cp.epoch = ce->epoch;
+  cp.version = ce->mod_count;
+  return cp;
+}
+
+bool
+casheph_file_flush (casheph_buf_t *buf)
+{
+  return fwrite (buf->data, 1, buf->len, (FILE*)buf->ctx) == buf->len;
+}
+
+int
+casheph_export_delta (casheph_t *ce, casheph_checkpoint_t checkpoint,
+                      FILE *out, casheph_delta_format_t format)
+{
+  if (checkpoint.epoch != ce->epoch || checkpoint.version > ce->mod_count)
+    {
+      return -1;
+    }
+  uint64_t since = checkpoint.version;
+  casheph_transaction_t **changed = NULL;
+  int n_changed = 0;
+  int i;
+  for (i = 0; i < ce->n_transactions; ++i)
+    {
+      if (ce->transactions[i]->version > since)
+        {
+          ++n_changed;
+          changed = (casheph_transaction_t**)realloc (changed,
+                                                      sizeof (casheph_transaction_t*)
+                                                      * n_changed);
+          changed[n_changed - 1] = ce->transactions[i];
+        }
+    }
+  /* Tombstones are in version order. */
+  int first = ce->n_tombstones;
+  while (first > 0 && ce->tombstones[first - 1].version > since)
+    {
+      --first;
+    }
+
+  casheph_buf_t buf;
+  casheph_buf_init (&buf, 1 << 16, casheph_file_flush, out);
+  if (format == ce_delta_binary)
+    {
+      casheph_buf_put (&buf, "CEDELTA1", 8);
+      casheph_bin_u32 (&buf, 0x01020304);
+      casheph_bin_i64 (&buf, ce->epoch);
+      casheph_bin_i64 (&buf, since);
+      casheph_bin_i64 (&buf, ce->mod_count);
+      casheph_bin_transactions (&buf, n_changed, changed);
+      casheph_bin_u32 (&buf, ce->n_tombstones - first);
+      for (i = first; i < ce->n_tombstones; ++i)
+        {
+          casheph_bin_str (&buf, ce->tombstones[i].id);
+        }
+    }
+  else
+    {
+      casheph_buf_putl (&buf, "<casheph:delta epoch=\"");
+      char epoch[17];
+      sprintf (epoch, "%016llx", (unsigned long long)ce->epoch);
+      casheph_buf_puts (&buf, epoch);
+      casheph_buf_putl (&buf, "\" since=\"");
+      casheph_buf_put_int (&buf, since);
+      casheph_buf_putl (&buf, "\" version=\"");
+      casheph_buf_put_int (&buf, ce->mod_count);
+      casheph_buf_putl (&buf, "\">\n");
+      for (i = 0; i < n_changed; ++i)
+        {
+          casheph_write_transaction (changed[i], &buf);
+        }
+      for (i = first; i < ce->n_tombstones; ++i)
+        {
+          casheph_buf_put_elem (&buf, "", "<casheph:remove>",
+                                ce->tombstones[i].id, "</casheph:remove>\n");
+        }
+      casheph_buf_putl (&buf, "</casheph:delta>\n");
+    }
+  bool ok = casheph_file_flush (&buf) && !buf.error;
+  casheph_buf_free (&buf);
+  free (changed);
+  return ok ? n_changed + ce->n_tombstones - first : -1;
+}
+
+void
+casheph_prune_tombstones (casheph_t *ce, casheph_checkpoint_t since)
+{
+  if (since.epoch != ce->epoch)
+    {
+      return;
+    }
+  int n = 0;
+  while (n < ce->n_tombstones && ce->tombstones[n].version <= since.version)
+    {
+      free (ce->tombstones[n].id);
+      ++n;
+    }
+  if (n == 0)
+    {
+      return;
+    }
+  memmove (ce->tombstones, ce->tombstones + n,
+           sizeof (casheph_tombstone_t) * (ce->n_tombstones - n));
+  ce->n_tombstones -= n;
+}
+
+void
+casheph_val_destroy (casheph_val_t *v)
+{
+  free (v);
+}
+
+void casheph_slot_destroy (casheph_slot_t *s);
+
+void
+casheph_frame_destroy (casheph_frame_t *f)
+{
+  int i;
+  for (i = 0; i < f->n_slots; ++i)
+    {
+      casheph_slot_destroy (f->slots[i]);
+    }
+  free (f->slots);
+  free (f);
+}
+
+void
+casheph_slot_destroy (casheph_slot_t *s)
+{
+  if (s == NULL)
+    {
+      return;
+    }
+  free (s->key);
+  switch (s->type)
+    {
+    case ce_gdate:
+      free (s->value);
+      break;
+    case ce_string:
+      free (s->value);
+      break;
+    case ce_guid:
+      free (s->value);
+      break;
+    case ce_numeric:
+      casheph_val_destroy (s->value);
+      break;
+    case ce_frame:
+      casheph_frame_destroy (s->value);
+      break;
+    }
+  free (s);
+}
+
+void
+casheph_split_destroy (casheph_split_t *s)
+{
+  free (s->id);
+  free (s->value);
+  free (s->quantity);
+  free (s->account);
+  int i;
+  for (i = 0; i < s->n_slots; ++i)
+    {
+      casheph_slot_destroy (s->slots[i]);
+    }
+  free (s->slots);
+  free (s);
+}
+
+void
+casheph_trn_destroy (casheph_transaction_t *t)
+{
+  if (t->packed)
+    {
+      free (t->xml);
+      free (t);
+      return;
+    }
+  free (t->id);
+  free (t->desc);
+  int i;
+  for (i = 0; i < t->n_splits; ++i)
+    {
+      casheph_split_destroy (t->splits[i]);
+    }
+  free (t->splits);
+  for (i = 0; i < t->n_slots; ++i)
+    {
+      casheph_slot_destroy (t->slots[i]);
+    }
+  free (t->slots);
+  free (t->xml);
   free (t);
 }
 
 void
-casheph_remove_trn (casheph_t *ce, const char *id)
+casheph_account_destroy (casheph_account_t *act)
+{
+  int i;
+  for (i = 0; i < act->n_accounts; ++i)
+    {
+      casheph_account_destroy (act->accounts[i]);
+    }
+  free (act->accounts);
+  free (act->id);
+  free (act->type);
+  free (act->name);
+  free (act->description);
+  free (act->parent);
+  for (i = 0; i < act->n_slots; ++i)
+    {
+      casheph_slot_destroy (act->slots[i]);
+    }
+  free (act->slots);
+  if (act->commodity != NULL)
+    {
+      free (act->commodity->space);
+      free (act->commodity->id);
+      free (act->commodity);
+    }
+  casheph_ledger_destroy (act->ledger);
+  casheph_cube_destroy (act->cube);
+  free (act);
+}
+
+/* The path map owns its keys: account names below the root joined
+   with ':'. */
+void
+casheph_path_map_remove (casheph_guid_map_t *map, const char *path)
+{
+  size_t i = casheph_guid_map_slot (map, path);
+  if (map->keys[i] == NULL)
+    {
+      return;
+    }
+  char *key = (char*)map->keys[i];
+  casheph_guid_map_remove (map, path);
+  free (key);
+}
+
+char *
+casheph_path_join (const char *path, const char *name)
+{
+  if (path == NULL || *path == '\0')
+    {
+      return strdup (name);
+    }
+  char *sub = (char*)malloc (strlen (path) + strlen (name) + 2);
+  strcpy (sub, path);
+  strcat (sub, ":");
+  strcat (sub, name);
+  return sub;
+}
+
+/* Add (or with ADD false, remove) ACT and everything under it, ACT
+   being at PATH, in the account indexes that have been built. */
+void
+casheph_account_index_rec (casheph_t *ce, casheph_account_t *act,
+                           const char *path, bool add)
+{
+  if (ce->account_map != NULL)
+    {
+      if (add)
+        {
+          casheph_guid_map_put (ce->account_map, act->id, act);
+        }
+      else
+        {
+          casheph_guid_map_remove (ce->account_map, act->id);
+        }
+    }
+  if (ce->path_map != NULL)
+    {
+      casheph_path_map_remove (ce->path_map, path);
+      if (add)
+        {
+          casheph_guid_map_put (ce->path_map, strdup (path), act);
+        }
+    }
+  int i;
+  for (i = 0; i < act->n_accounts; ++i)
+    {
+      char *sub = casheph_path_join (path, act->accounts[i]->name);
+      casheph_account_index_rec (ce, act->accounts[i], sub, add);
+      free (sub);
+    }
+}
+
+char *
+casheph_account_path (casheph_t *ce, casheph_account_t *act)
+{
+  if (act == ce->root || act->parent == NULL)
+    {
+      return strdup ("");
+    }
+  char *up = casheph_account_path (ce, casheph_get_account (ce, act->parent));
+  char *path = casheph_path_join (up, act->name);
+  free (up);
+  return path;
+}
+
+/* Take ACT out of PARENT's sub-accounts, returning where it was. */
+int
+casheph_account_detach (casheph_account_t *parent, casheph_account_t *act)
+{
+  int i;
+  for (i = 0; i < parent->n_accounts; ++i)
+    {
+      if (parent->accounts[i] == act)
+        {
+          memmove (parent->accounts + i, parent->accounts + i + 1,
+                   sizeof (casheph_account_t*) * (parent->n_accounts - i - 1));
+          --parent->n_accounts;
+          return i;
+        }
+    }
+  return -1;
+}
+
+void
+casheph_account_attach (casheph_account_t *parent, casheph_account_t *act,
+                        int index)
+{
+  parent->accounts = (casheph_account_t**)realloc (parent->accounts,
+                                                   sizeof (casheph_account_t*)
+                                                   * (parent->n_accounts + 1));
+  memmove (parent->accounts + index + 1, parent->accounts + index,
+           sizeof (casheph_account_t*) * (parent->n_accounts - index));
+  parent->accounts[index] = act;
+  ++parent->n_accounts;
+  free (act->parent);
+  act->parent = strdup (parent->id);
+}
+
+/* Move ACT to position INDEX under PARENT, keeping the path index up
+   to date. */
+void
+casheph_account_relink (casheph_t *ce, casheph_account_t *act,
+                        casheph_account_t *parent, int index)
+{
+  char *path = casheph_account_path (ce, act);
+  casheph_account_index_rec (ce, act, path, false);
+  free (path);
+  casheph_account_detach (casheph_get_account (ce, act->parent), act);
+  casheph_account_attach (parent, act, index);
+  path = casheph_account_path (ce, act);
+  casheph_account_index_rec (ce, act, path, true);
+  free (path);
+  ++ce->mod_count;
+}
+
+/* Destroy the N removed TRNS, or keep them for casheph_save_wait while
+   a background save may still be writing them. */
+void
+casheph_discard_trns (casheph_t *ce, casheph_transaction_t **trns, int n)
+{
+  int i;
+  if (ce->save_job != NULL && ce->save_job->running)
+    {
+      ce->deferred = (casheph_transaction_t**)realloc (ce->deferred,
+                                                       sizeof (casheph_transaction_t*)
+                                                       * (ce->n_deferred + n));
+      memcpy (ce->deferred + ce->n_deferred, trns,
+              sizeof (casheph_transaction_t*) * n);
+      ce->n_deferred += n;
+    }
+  else
+    {
+      for (i = 0; i < n; ++i)
+        {
+          casheph_trn_destroy (trns[i]);
+        }
+    }
+}
+
+/* One change made inside an edit batch: the transaction added or
+   removed (from position INDEX), the split whose reconciled STATE was
+   changed, or the account added, removed or moved (from position INDEX
+   under PARENT).  STATE and VERSION are the split's state and its
+   transaction's version before the change. */
+struct casheph_undo_s
+{
+  int kind;
+  casheph_transaction_t *trn;
+  casheph_split_t *split;
+  int index;
+  casheph_reconcile_t state;
+  uint64_t version;
+  casheph_account_t *act;
+  casheph_account_t *parent;
+};
+
+void
+casheph_undo_push (casheph_t *ce, int kind, casheph_transaction_t *trn,
+                   casheph_split_t *split, int index)
+{
+  if (ce->n_undo == ce->cap_undo)
+    {
+      ce->cap_undo = ce->cap_undo == 0 ? 64 : ce->cap_undo * 2;
+      ce->undo = (casheph_undo_t*)realloc (ce->undo, sizeof (casheph_undo_t)
+                                           * ce->cap_undo);
+    }
+  casheph_undo_t *u = &ce->undo[ce->n_undo++];
+  u->kind = kind;
+  u->trn = trn;
+  u->split = split;
+  u->index = index;
+  u->state = split != NULL ? split->reconciled_state : ce_unreconciled;
+  u->version = trn != NULL ? trn->version : 0;
+}
+
+void
+casheph_undo_push_account (casheph_t *ce, int kind, casheph_account_t *act,
+                           casheph_account_t *parent, int index)
+{
+  casheph_undo_push (ce, kind, NULL, NULL, index);
+  ce->undo[ce->n_undo - 1].act = act;
+  ce->undo[ce->n_undo - 1].parent = parent;
+}
+
+bool
+casheph_begin (casheph_t *ce)
+{
+  if (ce->in_batch)
+    {
+      return false;
+    }
+  ce->in_batch = true;
+  ce->batch_trn_map = ce->trn_map != NULL;
+  ce->batch_ledgers = ce->ledgers_built;
+  ce->batch_cubes = ce->cubes_built;
+  ce->batch_text_index = ce->text_index != NULL;
+  ce->n_undo = 0;
+  return true;
+}
+
+/* Indexes built inside the batch saw its uncommitted changes; drop them
+   to be rebuilt on demand. */
+void
+casheph_batch_drop_indexes (casheph_t *ce)
+{
+  if (!ce->batch_trn_map && ce->trn_map != NULL)
+    {
+      casheph_guid_map_destroy (ce->trn_map);
+      ce->trn_map = NULL;
+    }
+  if (!ce->batch_ledgers && ce->ledgers_built)
+    {
+      casheph_ledgers_clear_rec (ce->root);
+      ce->ledgers_built = false;
+    }
+  if (!ce->batch_cubes && ce->cubes_built)
+    {
+      casheph_cubes_clear_rec (ce->root);
+      ce->cubes_built = false;
+    }
+  if (!ce->batch_text_index && ce->text_index != NULL)
+    {
+      casheph_text_index_destroy (ce->text_index);
+      ce->text_index = NULL;
+    }
+}
+
+void
+casheph_commit (casheph_t *ce)
+{
+  if (!ce->in_batch)
+    {
+      return;
+    }
+  ce->in_batch = false;
+  casheph_batch_drop_indexes (ce);
+  casheph_guid_map_t *added = casheph_guid_map_new (ce->n_undo);
+  casheph_guid_map_t *removed = casheph_guid_map_new (ce->n_undo);
+  int i;
+  for (i = 0; i < ce->n_undo; ++i)
+    {
+      casheph_undo_t *u = &ce->undo[i];
+      if (u->kind == ce_undo_add)
+        {
+          casheph_guid_map_put (added, u->trn->id, u->trn);
+        }
+      else if (u->kind == ce_undo_remove)
+        {
+          casheph_guid_map_put (removed, u->trn->id, u->trn);
+        }
+    }
+  casheph_transaction_t **trns;
+  trns = (casheph_transaction_t**)malloc (sizeof (casheph_transaction_t*)
+                                          * (ce->n_undo + 1));
+  /* Transactions that were in the book before the batch and are gone;
+     those added and removed again leave no trace. */
+  int n = 0;
+  for (i = 0; i < ce->n_undo; ++i)
+    {
+      casheph_undo_t *u = &ce->undo[i];
+      if (u->kind == ce_undo_remove
+          && casheph_guid_map_get (added, u->trn->id) == NULL)
+        {
+          casheph_journal_remove (ce, u->trn->id);
+          trns[n++] = u->trn;
+        }
+    }
+  if (n > 0)
+    {
+      casheph_index_trns_removed (ce, trns, n, removed);
+    }
+  n = 0;
+  for (i = 0; i < ce->n_undo; ++i)
+    {
+      casheph_undo_t *u = &ce->undo[i];
+      if (u->kind == ce_undo_add
+          && casheph_guid_map_get (removed, u->trn->id) == NULL)
+        {
+          trns[n++] = u->trn;
+        }
+    }
+  casheph_index_trns_added (ce, trns, n);
+  for (i = 0; i < n; ++i)
+    {
+      casheph_journal_add (ce, trns[i]);
+    }
+  /* Reconciled states reach the journal, and ledgers that predate the
+     batch, only now. */
+  for (i = 0; i < ce->n_undo; ++i)
+    {
+      casheph_undo_t *u = &ce->undo[i];
+      if (u->kind == ce_undo_reconcile
+          && casheph_guid_map_get (removed, u->trn->id) == NULL)
+        {
+          if (ce->ledgers_built)
+            {
+              casheph_ledger_set_state (ce, u->trn, u->split);
+            }
+          casheph_journal_reconcile (ce, u->trn, u->split);
+        }
+    }
+  n = 0;
+  for (i = 0; i < ce->n_undo; ++i)
+    {
+      if (ce->undo[i].kind == ce_undo_remove)
+        {
+          trns[n++] = ce->undo[i].trn;
+        }
+    }
+  casheph_discard_trns (ce, trns, n);
+  free (trns);
+  for (i = 0; i < ce->n_undo; ++i)
+    {
+      if (ce->undo[i].kind == ce_undo_account_remove)
+        {
+          casheph_account_destroy (ce->undo[i].act);
+        }
+    }
+  casheph_guid_map_destroy (added);
+  casheph_guid_map_destroy (removed);
+  ce->n_undo = 0;
+}
+
+void
+casheph_rollback (casheph_t *ce)
+{
+  if (!ce->in_batch)
+    {
+      return;
+    }
+  ce->in_batch = false;
+  casheph_batch_drop_indexes (ce);
+  int n_removed = 0;
+  int i;
+  for (i = 0; i < ce->n_undo; ++i)
+    {
+      n_removed += ce->undo[i].kind == ce_undo_remove;
+    }
+  ce->transactions = (casheph_transaction_t**)realloc (ce->transactions,
+                                                       sizeof (casheph_transaction_t*)
+                                                       * (ce->n_transactions + n_removed + 1));
+  for (i = ce->n_undo - 1; i >= 0; --i)
+    {
+      casheph_undo_t *u = &ce->undo[i];
+      switch (u->kind)
+        {
+        case ce_undo_add:
+          /* Everything after it has been undone, so it is last. */
+          --ce->n_transactions;
+          casheph_trn_destroy (u->trn);
+          break;
+        case ce_undo_remove:
+          memmove (ce->transactions + u->index + 1, ce->transactions + u->index,
+                   sizeof (casheph_transaction_t*) * (ce->n_transactions - u->index));
+          ce->transactions[u->index] = u->trn;
+          ++ce->n_transactions;
+          break;
+        case ce_undo_reconcile:
+          /* The ledgers never saw the change. */
+          u->split->reconciled_state = u->state;
+          u->trn->version = u->version;
+          break;
+        case ce_undo_account_add:
+          {
+            char *path = casheph_account_path (ce, u->act);
+            casheph_account_index_rec (ce, u->act, path, false);
+            free (path);
+            casheph_account_detach (u->parent, u->act);
+            casheph_account_destroy (u->act);
+            ++ce->mod_count;
+          }
+          break;
+        case ce_undo_account_remove:
+          {
+            casheph_account_attach (u->parent, u->act, u->index);
+            char *path = casheph_account_path (ce, u->act);
+            casheph_account_index_rec (ce, u->act, path, true);
+            free (path);
+            ++ce->mod_count;
+          }
+          break;
+        case ce_undo_account_move:
+          casheph_account_relink (ce, u->act, u->parent, u->index);
+          break;
+        }
+    }
+  ce->n_undo = 0;
+}
+
+void
+casheph_remove_trn (casheph_t *ce, const char *id)
+{
+  int index = -1;
+  int i;
+  for (i = 0; i < ce->n_transactions; ++i)
+    {
+      if (strcmp (ce->transactions[i]->id, id) == 0)
+        {
+          index = i;
+          break;
+        }
+    }
+  if (index >= 0 && ce->in_batch)
+    {
+      casheph_undo_push (ce, ce_undo_remove, ce->transactions[index], NULL,
+                         index);
+      memmove (ce->transactions + index, ce->transactions + index + 1,
+               sizeof (casheph_transaction_t*) * (ce->n_transactions - index - 1));
+      --ce->n_transactions;
+    }
+  else if (index >= 0)
+    {
+      casheph_journal_remove (ce, id);
+      casheph_index_trn_removed (ce, ce->transactions[index]);
+      if (ce->save_job != NULL && ce->save_job->running)
+        {
+          ++ce->n_deferred;
+          ce->deferred = (casheph_transaction_t**)realloc (ce->deferred,
+                                                           sizeof (casheph_transaction_t*)
+                                                           * ce->n_deferred);
+          ce->deferred[ce->n_deferred - 1] = ce->transactions[index];
+        }
+      else
+        {
+          casheph_trn_destroy (ce->transactions[index]);
+        }
+      int j;
+      for (j = index; j < ce->n_transactions - 1; ++j)
+        {
+          ce->transactions[j] = ce->transactions[j + 1];
+        }
+      --ce->n_transactions;
+    }
+}
+
+int
+casheph_remove_trns_if (casheph_t *ce,
+                        bool (*pred) (casheph_transaction_t *trn, void *data),
+                        void *data)
+{
+  if (ce->n_transactions == 0)
+    {
+      return 0;
+    }
+  casheph_transaction_t **removed;
+  removed = (casheph_transaction_t**)malloc (sizeof (casheph_transaction_t*)
+                                             * ce->n_transactions);
+  int *at = ce->in_batch ? (int*)malloc (sizeof (int) * ce->n_transactions) : NULL;
+  int n_removed = 0;
+  int n_kept = 0;
+  int i;
+  for (i = 0; i < ce->n_transactions; ++i)
+    {
+      casheph_transaction_t *trn = ce->transactions[i];
+      if (pred (trn, data))
+        {
+          if (at != NULL)
+            {
+              at[n_removed] = i;
+            }
+          removed[n_removed++] = trn;
+        }
+      else
+        {
+          ce->transactions[n_kept++] = trn;
+        }
+    }
+  ce->n_transactions = n_kept;
+  if (at != NULL)
+    {
+      /* Last first, so that rollback reinserts them in order. */
+      for (i = n_removed - 1; i >= 0; --i)
+        {
+          casheph_undo_push (ce, ce_undo_remove, removed[i], NULL, at[i]);
+        }
+      free (at);
+      free (removed);
+      return n_removed;
+    }
+  if (n_removed == 0)
+    {
+      free (removed);
+      return 0;
+    }
+  casheph_guid_map_t *map = casheph_guid_map_new (n_removed);
+  for (i = 0; i < n_removed; ++i)
+    {
+      casheph_journal_remove (ce, removed[i]->id);
+      casheph_guid_map_put (map, removed[i]->id, removed[i]);
+    }
+  casheph_index_trns_removed (ce, removed, n_removed, map);
+  casheph_guid_map_destroy (map);
+  casheph_discard_trns (ce, removed, n_removed);
+  free (removed);
+  return n_removed;
+}
+
+bool
+casheph_trn_in_map (casheph_transaction_t *trn, void *map)
+{
+  return casheph_guid_map_get ((casheph_guid_map_t*)map, trn->id) != NULL;
+}
+
+int
+casheph_remove_trns (casheph_t *ce, const char **ids, int n)
+{
+  casheph_guid_map_t *map = casheph_guid_map_new (n);
+  int i;
+  for (i = 0; i < n; ++i)
+    {
+      casheph_guid_map_put (map, ids[i], (void*)ids[i]);
+    }
+  int n_removed = casheph_remove_trns_if (ce, casheph_trn_in_map, map);
+  casheph_guid_map_destroy (map);
+  return n_removed;
+}
+
+bool
+casheph_trn_posted_before (casheph_transaction_t *trn, void *date)
+{
+  return trn->date_posted < *(time_t*)date;
+}
+
+/* GUIDs come from a per-thread xoshiro256** generator seeded from the
+   kernel, so threads never share state and no two processes (or two
+   books opened in the same second) start from the same seed.  A forked
+   child reseeds rather than repeat its parent's sequence. */
+__thread uint64_t casheph_rng[4];
+__thread bool casheph_rng_seeded = false;
+pthread_once_t casheph_rng_once = PTHREAD_ONCE_INIT;
+
+void
+casheph_rng_atfork_child ()
 {
-  int index = -1;
-  int i;
-  for (i = 0; i < ce->n_transactions; ++i)
+  casheph_rng_seeded = false;
+}
+
+void
+casheph_rng_register ()
+{
+  pthread_atfork (NULL, NULL, casheph_rng_atfork_child);
+}
+
+uint64_t
+casheph_rotl (uint64_t x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+void
+casheph_rng_seed ()
+{
+  pthread_once (&casheph_rng_once, casheph_rng_register);
+  size_t got = 0;
+#ifdef HAVE_GETRANDOM
+  while (got < sizeof (casheph_rng))
     {
-      if (strcmp (ce->transactions[i]->id, id) == 0)
+      ssize_t r = getrandom ((char*)casheph_rng + got,
+                             sizeof (casheph_rng) - got, 0);
+      if (r <= 0)
         {
-          index = i;
           break;
         }
+      got += r;
     }
-  if (index >= 0)
+#endif
+  if (got < sizeof (casheph_rng))
     {
-      casheph_trn_destroy (ce->transactions[index]);
-      int j;
-      for (j = index; j < ce->n_transactions - 1; ++j)
+      /* No getrandom (old libc or kernel, or seccomp); fall back to
+         splitmix64 over whatever identifies this thread and moment. */
+      struct timespec ts;
+      clock_gettime (CLOCK_REALTIME, &ts);
+      uint64_t x = ((uint64_t)ts.tv_sec << 32) ^ ts.tv_nsec ^ getpid ()
+        ^ (uint64_t)(uintptr_t)&ts;
+      int i;
+      for (i = 0; i < 4; ++i)
         {
-          ce->transactions[j] = ce->transactions[j + 1];
+          uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+          z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+          z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+          casheph_rng[i] = z ^ (z >> 31);
         }
-      --ce->n_transactions;
     }
+  casheph_rng_seeded = true;
 }
 
-char *
-make_guid ()
+uint64_t
+casheph_rng_next ()
 {
-  char buf[2];
-  char *id = (char*)malloc (33);
+  uint64_t *s = casheph_rng;
+  uint64_t result = casheph_rotl (s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = casheph_rotl (s[3], 45);
+  return result;
+}
+
+uint64_t
+casheph_random ()
+{
+  if (!casheph_rng_seeded)
+    {
+      casheph_rng_seed ();
+    }
+  return casheph_rng_next ();
+}
+
+void
+casheph_guid_fill (char *buf)
+{
+  static const char hex[] = "0123456789abcdef";
+  uint64_t w[2];
+  w[0] = casheph_random ();
+  w[1] = casheph_random ();
   int i;
-  for (i = 0; i < 32; ++i)
+  for (i = 0; i < 16; ++i)
     {
-      char v = rand () % 16;
-      sprintf (buf, "%x", v);
-      id[i] = buf[0];
+      unsigned int b = (w[i / 8] >> (8 * (i % 8))) & 0xff;
+      buf[2 * i] = hex[b >> 4];
+      buf[2 * i + 1] = hex[b & 0xf];
     }
-  return id;
+  buf[32] = '\0';
 }
 
-casheph_val_t *
-casheph_copy_val (casheph_val_t *val)
+char *
+make_guid ()
 {
-  casheph_val_t *val_cpy = (casheph_val_t*)malloc (sizeof (casheph_val_t));
-  val_cpy->n = val->n;
-  val_cpy->d = val->d;
-  return val_cpy;
+  char *id = (char*)malloc (33);
+  casheph_guid_fill (id);
+  return id;
 }
 
-casheph_transaction_t *
-casheph_add_simple_trn (casheph_t *ce, casheph_account_t *from,
-                        casheph_account_t *to, casheph_gdate_t *date,
-                        casheph_val_t *val, const char *desc)
+/* Local midnight starting DATE. */
+time_t
+casheph_gdate_time (const casheph_gdate_t *date)
 {
-  srand (time (NULL));
-  casheph_transaction_t *trn;
-  trn = (casheph_transaction_t*)malloc (sizeof (casheph_transaction_t));
-  trn->id = make_guid ();
   struct tm tm;
   tm.tm_sec = tm.tm_min = tm.tm_hour = 0;
   tm.tm_mday = date->day;
   tm.tm_mon = date->month - 1;
   tm.tm_year = date->year - 1900;
   tm.tm_isdst = -1;
-  trn->date_posted = mktime (&tm);
+  return mktime (&tm);
+}
+
+/* A transaction posted at POSTED with room for N_SPLITS splits, which
+   the caller fills in. */
+casheph_transaction_t *
+casheph_make_trn (const casheph_gdate_t *date, time_t posted,
+                  const char *desc, int n_splits)
+{
+  casheph_transaction_t *trn;
+  trn = (casheph_transaction_t*)malloc (sizeof (casheph_transaction_t));
+  trn->packed = false;
+  trn->id = make_guid ();
+  trn->date_posted = posted;
   trn->date_entered = time (NULL);
+  trn->xml = NULL;
+  trn->xml_len = 0;
+  trn->version = 0;
   trn->desc = (char*)malloc (strlen (desc) + 1);
   strcpy (trn->desc, desc);
   trn->n_slots = 1;
@@ -1229,36 +6462,321 @@ casheph_add_simple_trn (casheph_t *ce, casheph_account_t *from,
   date_cpy->month = date->month;
   date_cpy->day = date->day;
   trn->slots[0]->value = date_cpy;
-  trn->n_splits = 2;
-  trn->splits = (casheph_split_t**)malloc (sizeof (casheph_split_t*) * 2);
-  trn->splits[0] = (casheph_split_t*)malloc (sizeof (casheph_split_t));
-  trn->splits[0]->id = make_guid ();
-  trn->splits[0]->reconciled_state = (char*)malloc (2);
-  strcpy (trn->splits[0]->reconciled_state, "n");
-  casheph_val_t *v0 = casheph_copy_val (val);
-  casheph_val_t *q0 = casheph_copy_val (val);
-  trn->splits[0]->value = v0;
-  trn->splits[0]->quantity = q0;
-  trn->splits[0]->account = (char*)malloc (strlen (to->id) + 1);
-  strcpy (trn->splits[0]->account, to->id);
-  trn->splits[0]->n_slots = 0;
-  trn->splits[0]->slots = NULL;
-
-  trn->splits[1] = (casheph_split_t*)malloc (sizeof (casheph_split_t));
-  trn->splits[1]->id = make_guid ();
-  trn->splits[1]->reconciled_state = (char*)malloc (2);
-  strcpy (trn->splits[1]->reconciled_state, "n");
-  casheph_val_t *v1 = casheph_copy_val (val);
-  v1->n *= -1;
-  casheph_val_t *q1 = casheph_copy_val (val);
-  trn->splits[1]->value = v1;
-  trn->splits[1]->quantity = q1;
-  trn->splits[1]->account = (char*)malloc (strlen (from->id) + 1);
-  strcpy (trn->splits[1]->account, from->id);
-  trn->splits[1]->n_slots = 0;
-  trn->splits[1]->slots = NULL;
+  trn->n_splits = n_splits;
+  trn->splits = (casheph_split_t**)malloc (sizeof (casheph_split_t*) * n_splits);
+  return trn;
+}
+
+casheph_split_t *
+casheph_make_split (casheph_account_t *act, casheph_wval_t value,
+                    casheph_wval_t quantity, casheph_reconcile_t state)
+{
+  casheph_split_t *split = (casheph_split_t*)malloc (sizeof (casheph_split_t));
+  split->id = make_guid ();
+  split->reconciled_state = state;
+  split->value = (casheph_wval_t*)malloc (sizeof (casheph_wval_t));
+  *split->value = value;
+  split->quantity = (casheph_wval_t*)malloc (sizeof (casheph_wval_t));
+  *split->quantity = quantity;
+  split->account = (char*)malloc (strlen (act->id) + 1);
+  strcpy (split->account, act->id);
+  split->n_slots = 0;
+  split->slots = NULL;
+  return split;
+}
+
+/* A FROM -> TO transfer posted at POSTED, not yet in any book. */
+casheph_transaction_t *
+casheph_make_simple_trn (casheph_account_t *from, casheph_account_t *to,
+                         const casheph_gdate_t *date, time_t posted,
+                         const casheph_val_t *val, const char *desc)
+{
+  casheph_transaction_t *trn = casheph_make_trn (date, posted, desc, 2);
+  casheph_wval_t v = { val->n, val->d };
+  casheph_wval_t neg = { -(int64_t)val->n, val->d };
+  trn->splits[0] = casheph_make_split (to, v, v, ce_unreconciled);
+  trn->splits[1] = casheph_make_split (from, neg, neg, ce_unreconciled);
+  return trn;
+}
+
+void
+casheph_append_trn (casheph_t *ce, casheph_transaction_t *trn)
+{
   ++ce->n_transactions;
+  ce->transactions = (casheph_transaction_t**)realloc (ce->transactions,
+                                                       sizeof (casheph_transaction_t*)
+                                                       * ce->n_transactions);
   ce->transactions[ce->n_transactions - 1] = trn;
+  if (ce->in_batch)
+    {
+      casheph_undo_push (ce, ce_undo_add, trn, NULL, 0);
+      return;
+    }
+  casheph_index_trn_added (ce, trn);
+  casheph_journal_add (ce, trn);
+}
+
+casheph_transaction_t *
+casheph_add_simple_trn (casheph_t *ce, casheph_account_t *from,
+                        casheph_account_t *to, casheph_gdate_t *date,
+                        casheph_val_t *val, const char *desc)
+{
+  casheph_transaction_t *trn;
+  trn = casheph_make_simple_trn (from, to, date, casheph_gdate_time (date),
+                                 val, desc);
+  casheph_append_trn (ce, trn);
+  return trn;
+}
+
+int
+casheph_add_simple_trns (casheph_t *ce, const casheph_trn_record_t *records,
+                         int n, casheph_transaction_t **results)
+{
+  if (n <= 0)
+    {
+      return 0;
+    }
+  int first = ce->n_transactions;
+  ce->transactions = (casheph_transaction_t**)realloc (ce->transactions,
+                                                       sizeof (casheph_transaction_t*)
+                                                       * (first + n));
+  /* Imports are mostly in date order, so remember the last date. */
+  casheph_gdate_t last = { 0, 0, 0 };
+  time_t last_time = 0;
+  int i;
+  for (i = 0; i < n; ++i)
+    {
+      const casheph_trn_record_t *rec = &records[i];
+      if (rec->date.year != last.year || rec->date.month != last.month
+          || rec->date.day != last.day)
+        {
+          last = rec->date;
+          last_time = casheph_gdate_time (&last);
+        }
+      casheph_transaction_t *trn;
+      trn = casheph_make_simple_trn (rec->from, rec->to, &rec->date, last_time,
+                                     &rec->value, rec->desc);
+      ce->transactions[first + i] = trn;
+      if (results != NULL)
+        {
+          results[i] = trn;
+        }
+    }
+  ce->n_transactions += n;
+  if (ce->in_batch)
+    {
+      for (i = 0; i < n; ++i)
+        {
+          casheph_undo_push (ce, ce_undo_add, ce->transactions[first + i],
+                             NULL, 0);
+        }
+      return n;
+    }
+  casheph_index_trns_added (ce, ce->transactions + first, n);
+  for (i = 0; i < n; ++i)
+    {
+      casheph_journal_add (ce, ce->transactions[first + i]);
+    }
+  return n;
+}
+
+void
+casheph_trn_builder_init (casheph_trn_builder_t *b)
+{
+  memset (b, 0, sizeof (casheph_trn_builder_t));
+}
+
+void
+casheph_trn_builder_free (casheph_trn_builder_t *b)
+{
+  free (b->splits);
+  free (b->slots);
+  casheph_trn_builder_init (b);
+}
+
+void
+casheph_trn_builder_reset (casheph_trn_builder_t *b,
+                           const casheph_gdate_t *date, const char *desc)
+{
+  b->date = *date;
+  b->desc = desc;
+  b->n_splits = 0;
+  b->n_slots = 0;
+}
+
+void
+casheph_trn_builder_add_split (casheph_trn_builder_t *b, casheph_account_t *act,
+                               casheph_wval_t value, casheph_wval_t quantity,
+                               casheph_reconcile_t state)
+{
+  if (b->n_splits == b->cap_splits)
+    {
+      b->cap_splits = b->cap_splits == 0 ? 8 : b->cap_splits * 2;
+      b->splits = (casheph_split_spec_t*)realloc (b->splits,
+                                                  sizeof (casheph_split_spec_t)
+                                                  * b->cap_splits);
+    }
+  casheph_split_spec_t *s = &b->splits[b->n_splits++];
+  s->account = act;
+  s->value = value;
+  s->quantity = quantity;
+  s->state = state;
+  s->first_slot = b->n_slots;
+  s->n_slots = 0;
+}
+
+void
+casheph_trn_builder_add_slot (casheph_trn_builder_t *b, const char *key,
+                              const char *value)
+{
+  if (b->n_splits == 0)
+    {
+      return;
+    }
+  if (b->n_slots == b->cap_slots)
+    {
+      b->cap_slots = b->cap_slots == 0 ? 8 : b->cap_slots * 2;
+      b->slots = (const char**)realloc (b->slots, sizeof (const char*) * 2
+                                        * b->cap_slots);
+    }
+  b->slots[2 * b->n_slots] = key;
+  b->slots[2 * b->n_slots + 1] = value;
+  ++b->n_slots;
+  ++b->splits[b->n_splits - 1].n_slots;
+}
+
+bool
+casheph_trn_builder_balanced (const casheph_trn_builder_t *b)
+{
+  casheph_wval_t sum = { 0, 1 };
+  int i;
+  for (i = 0; i < b->n_splits; ++i)
+    {
+      if (!casheph_wval_add (sum, b->splits[i].value, &sum))
+        {
+          return false;
+        }
+    }
+  return sum.n == 0;
+}
+
+/* Space for SIZE bytes in a block carved up by casheph_block_take,
+   keeping every piece 8-byte aligned. */
+size_t
+casheph_block_round (size_t size)
+{
+  return (size + 7) & ~(size_t)7;
+}
+
+void *
+casheph_block_take (char **p, size_t size)
+{
+  void *piece = *p;
+  *p += casheph_block_round (size);
+  return piece;
+}
+
+char *
+casheph_block_strdup (char **p, const char *s)
+{
+  size_t len = strlen (s) + 1;
+  return (char*)memcpy (casheph_block_take (p, len), s, len);
+}
+
+casheph_transaction_t *
+casheph_trn_builder_commit (casheph_t *ce, casheph_trn_builder_t *b)
+{
+  if (b->n_splits == 0 || b->desc == NULL
+      || !casheph_trn_builder_balanced (b))
+    {
+      return NULL;
+    }
+  /* Size everything first so the transaction is one allocation. */
+  size_t size = (casheph_block_round (sizeof (casheph_transaction_t))
+                 + casheph_block_round (33)
+                 + casheph_block_round (strlen (b->desc) + 1)
+                 + casheph_block_round (sizeof (casheph_slot_t*))
+                 + casheph_block_round (sizeof (casheph_slot_t))
+                 + casheph_block_round (sizeof ("date-posted"))
+                 + casheph_block_round (sizeof (casheph_gdate_t))
+                 + casheph_block_round (sizeof (casheph_split_t*)
+                                        * b->n_splits));
+  int i, j;
+  for (i = 0; i < b->n_splits; ++i)
+    {
+      casheph_split_spec_t *s = &b->splits[i];
+      size += (casheph_block_round (sizeof (casheph_split_t))
+               + 2 * casheph_block_round (sizeof (casheph_wval_t))
+               + casheph_block_round (33)
+               + casheph_block_round (strlen (s->account->id) + 1)
+               + casheph_block_round (sizeof (casheph_slot_t*) * s->n_slots));
+      for (j = 0; j < s->n_slots; ++j)
+        {
+          const char **kv = &b->slots[2 * (s->first_slot + j)];
+          size += (casheph_block_round (sizeof (casheph_slot_t))
+                   + casheph_block_round (strlen (kv[0]) + 1)
+                   + casheph_block_round (strlen (kv[1]) + 1));
+        }
+    }
+  char *p = (char*)malloc (size);
+  casheph_transaction_t *trn;
+  trn = (casheph_transaction_t*)casheph_block_take (&p, sizeof (casheph_transaction_t));
+  trn->packed = true;
+  trn->id = (char*)casheph_block_take (&p, 33);
+  casheph_guid_fill (trn->id);
+  trn->date_posted = casheph_gdate_time (&b->date);
+  trn->date_entered = time (NULL);
+  trn->desc = casheph_block_strdup (&p, b->desc);
+  trn->xml = NULL;
+  trn->xml_len = 0;
+  trn->version = 0;
+  trn->n_slots = 1;
+  trn->slots = (casheph_slot_t**)casheph_block_take (&p, sizeof (casheph_slot_t*));
+  casheph_slot_t *posted;
+  posted = (casheph_slot_t*)casheph_block_take (&p, sizeof (casheph_slot_t));
+  posted->key = casheph_block_strdup (&p, "date-posted");
+  posted->type = ce_gdate;
+  posted->value = memcpy (casheph_block_take (&p, sizeof (casheph_gdate_t)),
+                          &b->date, sizeof (casheph_gdate_t));
+  trn->slots[0] = posted;
+  trn->n_splits = b->n_splits;
+  trn->splits = (casheph_split_t**)casheph_block_take (&p, sizeof (casheph_split_t*)
+                                                       * b->n_splits);
+  for (i = 0; i < b->n_splits; ++i)
+    {
+      casheph_split_spec_t *s = &b->splits[i];
+      casheph_split_t *split;
+      split = (casheph_split_t*)casheph_block_take (&p, sizeof (casheph_split_t));
+      split->id = (char*)casheph_block_take (&p, 33);
+      casheph_guid_fill (split->id);
+      split->reconciled_state = s->state;
+      split->value = (casheph_wval_t*)casheph_block_take (&p, sizeof (casheph_wval_t));
+      *split->value = s->value;
+      split->quantity = (casheph_wval_t*)casheph_block_take (&p, sizeof (casheph_wval_t));
+      *split->quantity = s->quantity;
+      split->account = casheph_block_strdup (&p, s->account->id);
+      split->n_slots = s->n_slots;
+      split->slots = NULL;
+      if (s->n_slots > 0)
+        {
+          split->slots = (casheph_slot_t**)casheph_block_take (&p, sizeof (casheph_slot_t*)
+                                                               * s->n_slots);
+        }
+      for (j = 0; j < s->n_slots; ++j)
+        {
+          const char **kv = &b->slots[2 * (s->first_slot + j)];
+          casheph_slot_t *slot;
+          slot = (casheph_slot_t*)casheph_block_take (&p, sizeof (casheph_slot_t));
+          slot->key = casheph_block_strdup (&p, kv[0]);
+          slot->type = ce_string;
+          slot->value = casheph_block_strdup (&p, kv[1]);
+          split->slots[j] = slot;
+        }
+      trn->splits[i] = split;
+    }
+  casheph_append_trn (ce, trn);
+  b->n_splits = 0;
+  b->n_slots = 0;
   return trn;
 }
 
@@ -1284,5 +6802,188 @@ casheph_get_account_rec (casheph_account_t *act, const char *id)
 casheph_account_t *
 casheph_get_account (casheph_t *ce, const char *id)
 {
+  if (ce->account_map != NULL)
+    {
+      return (casheph_account_t*)casheph_guid_map_get (ce->account_map, id);
+    }
   return casheph_get_account_rec (ce->root, id);
 }
+
+casheph_guid_map_t *
+casheph_path_map (casheph_t *ce)
+{
+  if (ce->path_map == NULL)
+    {
+      ce->path_map = casheph_guid_map_new (64);
+      casheph_account_index_rec (ce, ce->root, "", true);
+    }
+  return ce->path_map;
+}
+
+casheph_account_t *
+casheph_get_account_by_path (casheph_t *ce, const char *path)
+{
+  return (casheph_account_t*)casheph_guid_map_get (casheph_path_map (ce), path);
+}
+
+/* Whether a split in ACT, or with SUBTREE in any account under it,
+   would be orphaned by removing it. */
+bool
+casheph_account_in_use (casheph_t *ce, casheph_account_t *act, bool subtree)
+{
+  int i, j;
+  if (subtree)
+    {
+      for (i = 0; i < act->n_accounts; ++i)
+        {
+          if (casheph_account_in_use (ce, act->accounts[i], true))
+            {
+              return true;
+            }
+        }
+    }
+  /* The ledgers lag behind an open batch. */
+  if (!ce->in_batch)
+    {
+      if (!ce->ledgers_built)
+        {
+          casheph_build_ledgers (ce);
+        }
+      return casheph_account_ledger (act)->n > 0;
+    }
+  for (i = 0; i < ce->n_transactions; ++i)
+    {
+      casheph_transaction_t *trn = ce->transactions[i];
+      for (j = 0; j < trn->n_splits; ++j)
+        {
+          if (strcmp (trn->splits[j]->account, act->id) == 0)
+            {
+              return true;
+            }
+        }
+    }
+  return false;
+}
+
+casheph_account_t *
+casheph_add_account (casheph_t *ce, casheph_account_t *parent,
+                     const char *name, const char *type,
+                     const casheph_commodity_t *commodity)
+{
+  if (commodity == NULL)
+    {
+      commodity = parent->commodity;
+    }
+  if (commodity == NULL || strchr (name, ':') != NULL
+      || casheph_account_get_account_by_name (parent, name) != NULL)
+    {
+      return NULL;
+    }
+  casheph_account_t *act = (casheph_account_t*)calloc (1, sizeof (casheph_account_t));
+  act->id = make_guid ();
+  act->type = strdup (type);
+  act->name = strdup (name);
+  act->commodity = (casheph_commodity_t*)malloc (sizeof (casheph_commodity_t));
+  act->commodity->space = strdup (commodity->space);
+  act->commodity->id = strdup (commodity->id);
+  act->commodity_scu = commodity == parent->commodity ? parent->commodity_scu : 100;
+  casheph_account_attach (parent, act, parent->n_accounts);
+  char *path = casheph_account_path (ce, act);
+  casheph_account_index_rec (ce, act, path, true);
+  free (path);
+  ++ce->mod_count;
+  if (ce->in_batch)
+    {
+      casheph_undo_push_account (ce, ce_undo_account_add, act, parent, 0);
+    }
+  return act;
+}
+
+bool
+casheph_move_account (casheph_t *ce, casheph_account_t *act,
+                      casheph_account_t *parent)
+{
+  casheph_account_t *up;
+  for (up = parent; up != NULL; up = up->parent == NULL ? NULL
+         : casheph_get_account (ce, up->parent))
+    {
+      if (up == act)
+        {
+          return false;
+        }
+    }
+  casheph_account_t *other = casheph_account_get_account_by_name (parent, act->name);
+  if (act == ce->root || (other != NULL && other != act))
+    {
+      return false;
+    }
+  casheph_account_t *old = casheph_get_account (ce, act->parent);
+  int index;
+  for (index = 0; old->accounts[index] != act; ++index)
+    {
+    }
+  casheph_account_relink (ce, act, parent, parent->n_accounts);
+  if (ce->in_batch)
+    {
+      casheph_undo_push_account (ce, ce_undo_account_move, act, old, index);
+    }
+  return true;
+}
+
+bool
+casheph_remove_account (casheph_t *ce, const char *id, bool reparent)
+{
+  casheph_account_t *act = casheph_get_account (ce, id);
+  if (act == NULL || act == ce->root
+      || casheph_account_in_use (ce, act, !reparent))
+    {
+      return false;
+    }
+  casheph_account_t *parent = casheph_get_account (ce, act->parent);
+  int i;
+  if (reparent)
+    {
+      for (i = 0; i < act->n_accounts; ++i)
+        {
+          casheph_account_t *other;
+          other = casheph_account_get_account_by_name (parent, act->accounts[i]->name);
+          if (other != NULL && other != act)
+            {
+              return false;
+            }
+        }
+    }
+  char *path = casheph_account_path (ce, act);
+  casheph_account_index_rec (ce, act, path, false);
+  free (path);
+  int index = casheph_account_detach (parent, act);
+  if (reparent)
+    {
+      /* The sub-accounts take its place, in order. */
+      for (i = 0; i < act->n_accounts; ++i)
+        {
+          casheph_account_t *sub = act->accounts[i];
+          casheph_account_attach (parent, sub, index + i);
+          path = casheph_account_path (ce, sub);
+          casheph_account_index_rec (ce, sub, path, true);
+          free (path);
+        }
+      /* Last first, so that rollback moves them back in order. */
+      for (i = act->n_accounts - 1; i >= 0 && ce->in_batch; --i)
+        {
+          casheph_undo_push_account (ce, ce_undo_account_move, act->accounts[i],
+                                     act, i);
+        }
+      act->n_accounts = 0;
+    }
+  ++ce->mod_count;
+  if (ce->in_batch)
+    {
+      casheph_undo_push_account (ce, ce_undo_account_remove, act, parent, index);
+    }
+  else
+    {
+      casheph_account_destroy (act);
+    }
+  return true;
+}
@@ -18,6 +18,7 @@
 #ifndef CASHEPH_H
 #define CASHEPH_H
 
+#include <stdio.h>
 #include <time.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -50,12 +51,72 @@ typedef struct casheph_recurrence_s casheph_recurrence_t;
 
 typedef struct casheph_val_s casheph_val_t;
 
+typedef struct casheph_wval_s casheph_wval_t;
+
+typedef struct casheph_guid_map_s casheph_guid_map_t;
+
+typedef struct casheph_ledger_s casheph_ledger_t;
+
+typedef struct casheph_text_index_s casheph_text_index_t;
+
+typedef struct casheph_cube_s casheph_cube_t;
+
+typedef enum { ce_day, ce_week, ce_month } casheph_period_t;
+
+typedef enum { ce_search_substring, ce_search_prefix } casheph_search_mode_t;
+
+typedef enum { ce_unreconciled = 'n', ce_cleared = 'c', ce_reconciled = 'y',
+               ce_frozen = 'f', ce_voided = 'v' } casheph_reconcile_t;
+
+/* Masks of reconciliation states for the casheph_account_reconcile_*
+   queries. */
+enum { ce_mask_unreconciled = 1, ce_mask_cleared = 2, ce_mask_reconciled = 4,
+       ce_mask_frozen = 8, ce_mask_voided = 16 };
+
+typedef struct casheph_filter_s casheph_filter_t;
+
+typedef struct casheph_register_s casheph_register_t;
+
+typedef struct casheph_register_row_s casheph_register_row_t;
+
+typedef struct casheph_save_opts_s casheph_save_opts_t;
+
+typedef struct casheph_ts_year_s casheph_ts_year_t;
+
+typedef struct casheph_ts_cache_s casheph_ts_cache_t;
+
+typedef struct casheph_save_job_s casheph_save_job_t;
+
+typedef struct casheph_saved_s casheph_saved_t;
+
+typedef struct casheph_tombstone_s casheph_tombstone_t;
+
+typedef struct casheph_checkpoint_s casheph_checkpoint_t;
+
+typedef struct casheph_trn_record_s casheph_trn_record_t;
+
+typedef struct casheph_split_spec_s casheph_split_spec_t;
+
+typedef struct casheph_trn_builder_s casheph_trn_builder_t;
+
+typedef struct casheph_undo_s casheph_undo_t;
+
+typedef enum { ce_delta_xml, ce_delta_binary } casheph_delta_format_t;
+
+typedef struct casheph_save_stats_s casheph_save_stats_t;
+
 struct casheph_val_s
 {
   int32_t n;
   uint32_t d;
 };
 
+struct casheph_wval_s
+{
+  int64_t n;
+  uint32_t d;
+};
+
 struct casheph_s
 {
   casheph_account_t *root;
@@ -67,6 +128,48 @@ struct casheph_s
   casheph_schedxaction_t **schedxactions;
   casheph_account_t *template_root;
   char *book_id;
+  casheph_guid_map_t *account_map;
+  casheph_guid_map_t *path_map;
+  casheph_guid_map_t *trn_map;
+  bool ledgers_built;
+  /* Per-account period totals exist; see casheph_account_period_sum. */
+  bool cubes_built;
+  casheph_text_index_t *text_index;
+  /* TZ the cached transaction XML was written under, or NULL. */
+  char *xml_tz;
+  /* Change journal; see casheph_journal_open. */
+  FILE *journal;
+  char *journal_book;
+  int journal_group;
+  int journal_pending;
+  /* A record could not be written or synced; see casheph_journal_sync. */
+  bool journal_failed;
+  /* Latest casheph_save_async, and transactions removed while it runs. */
+  casheph_save_job_t *save_job;
+  int n_deferred;
+  casheph_transaction_t **deferred;
+  /* Bumped by every change; see casheph_save_with.  Also the version
+     returned by casheph_checkpoint. */
+  uint64_t mod_count;
+  /* Random for each open; see casheph_checkpoint_t. */
+  uint64_t epoch;
+  casheph_saved_t *saved;
+  /* The file the book was opened from, before the journal was replayed;
+     see casheph_cache_write. */
+  casheph_saved_t *loaded;
+  /* Transactions removed since opening, for casheph_export_delta. */
+  int n_tombstones;
+  casheph_tombstone_t *tombstones;
+  /* Open edit batch; see casheph_begin.  The batch_* flags record
+     which indexes existed when it began. */
+  bool in_batch;
+  bool batch_trn_map;
+  bool batch_ledgers;
+  bool batch_cubes;
+  bool batch_text_index;
+  int n_undo;
+  int cap_undo;
+  casheph_undo_t *undo;
 };
 
 struct casheph_account_s
@@ -82,6 +185,8 @@ struct casheph_account_s
   casheph_slot_t **slots;
   casheph_commodity_t *commodity;
   int commodity_scu;
+  casheph_ledger_t *ledger;
+  casheph_cube_t *cube;
 };
 
 struct casheph_transaction_s
@@ -94,6 +199,17 @@ struct casheph_transaction_s
   casheph_split_t **splits;
   int n_slots;
   casheph_slot_t **slots;
+  /* Serialized form reused by saves with keep_fragments; dropped by
+     casheph_trn_touch. */
+  char *xml;
+  size_t xml_len;
+  /* Book version when last added or touched, 0 if unchanged since
+     opening. */
+  uint64_t version;
+  /* Allocated as one block holding its splits, slots and strings (see
+     casheph_trn_builder_commit), so those must not be freed or
+     replaced one by one; casheph_trn_destroy frees the block. */
+  bool packed;
 };
 
 struct casheph_schedxaction_s
@@ -115,14 +231,29 @@ struct casheph_schedxaction_s
 struct casheph_split_s
 {
   char *id;
-  char *reconciled_state;
-  casheph_val_t *value;
-  casheph_val_t *quantity;
+  casheph_reconcile_t reconciled_state;
+  casheph_wval_t *value;
+  casheph_wval_t *quantity;
   char *account;
   int n_slots;
   casheph_slot_t **slots;
 };
 
+/* A point in the book's history, from casheph_checkpoint.  Versions
+   restart whenever a book is opened, so EPOCH, random for each open,
+   ties the version to the open it came from. */
+struct casheph_checkpoint_s
+{
+  uint64_t epoch;
+  uint64_t version;
+};
+
+struct casheph_tombstone_s
+{
+  char *id;
+  uint64_t version;
+};
+
 struct casheph_slot_s
 {
   char *key;
@@ -143,6 +274,42 @@ struct casheph_gdate_s
   unsigned int day;
 };
 
+/* One transfer for casheph_add_simple_trns. */
+struct casheph_trn_record_s
+{
+  casheph_account_t *from;
+  casheph_account_t *to;
+  casheph_gdate_t date;
+  casheph_val_t value;
+  const char *desc;
+};
+
+struct casheph_split_spec_s
+{
+  casheph_account_t *account;
+  casheph_wval_t value;
+  casheph_wval_t quantity;
+  casheph_reconcile_t state;
+  int first_slot;
+  int n_slots;
+};
+
+/* Splits collected for casheph_trn_builder_commit.  The scratch arrays
+   are kept between transactions; the strings passed in are copied only
+   at commit. */
+struct casheph_trn_builder_s
+{
+  casheph_gdate_t date;
+  const char *desc;
+  int n_splits;
+  int cap_splits;
+  casheph_split_spec_t *splits;
+  /* Key, value pairs of string slots, in split order. */
+  int n_slots;
+  int cap_slots;
+  const char **slots;
+};
+
 struct casheph_commodity_s
 {
   char *space;
@@ -163,18 +330,162 @@ struct casheph_recurrence_s
   char *weekend_adj;
 };
 
+/* Position in an account register; see casheph_register_open.  Adding
+   or removing transactions invalidates open registers. */
+struct casheph_register_s
+{
+  casheph_t *ce;
+  casheph_account_t *account;
+  int n_rows;
+  int row;
+};
+
+struct casheph_register_row_s
+{
+  casheph_transaction_t *trn;
+  casheph_split_t *split;
+  casheph_wval_t balance;
+};
+
+/* Transactions kept by casheph_open_filtered: posted in
+   [posted_from, posted_to) when has_dates is set, with a split in one
+   of ACCOUNTS when n_accounts > 0, and with a slot named SLOT_KEY when
+   it is not NULL. */
+struct casheph_filter_s
+{
+  bool has_dates;
+  time_t posted_from;
+  time_t posted_to;
+  int n_accounts;
+  const char **accounts;
+  const char *slot_key;
+};
+
+/* The UTC offset changes during one (UTC) year: OFF[0] from the start
+   of the year, OFF[i + 1] from AT[i].  N is -1 when the year has more
+   changes than fit. */
+struct casheph_ts_year_s
+{
+  bool used;
+  int year;
+  int n;
+  time_t at[4];
+  int32_t off[5];
+};
+
+/* UTC offsets by year, for casheph_format_ts.  Valid until TZ changes.
+   Filling a year takes a few hundred localtime calls, so once fills
+   stop paying for themselves (dates spread over more years than the
+   table holds) a miss costs a single localtime call instead. */
+struct casheph_ts_cache_s
+{
+  uint64_t lookups;
+  uint64_t fills;
+  casheph_ts_year_t years[64];
+};
+
+/* How casheph_save_with writes the file.  LEVEL is 0-9 or
+   Z_DEFAULT_COMPRESSION, STRATEGY one of Z_DEFAULT_STRATEGY,
+   Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE or Z_FIXED; saves with anything
+   else fail before writing.  UNCOMPRESSED writes plain XML.
+   BUFFER_SIZE is the number of bytes serialized before they are handed
+   to zlib (0 for the default).
+   With N_THREADS other than 1, blocks of BUFFER_SIZE bytes are
+   compressed in parallel (N_THREADS <= 0 uses one thread per online
+   CPU) into a single ordinary gzip stream.  KEEP_FRAGMENTS keeps each
+   transaction's XML and copies it verbatim on the next save that also
+   sets it, unless the transaction was touched or TZ changed. */
+struct casheph_save_opts_s
+{
+  int level;
+  int strategy;
+  bool uncompressed;
+  size_t buffer_size;
+  int n_threads;
+  bool keep_fragments;
+};
+
+struct casheph_save_stats_s
+{
+  /* False when the save was skipped as unchanged. */
+  bool wrote;
+  uint64_t raw_bytes;
+  uint64_t out_bytes;
+  double seconds;
+  /* Serialized megabytes (10^6 bytes) per second. */
+  double mb_per_sec;
+  /* raw_bytes / out_bytes. */
+  double ratio;
+};
+
 casheph_t *casheph_open (const char *filename);
 
+/* Write "FILENAME.cache", a binary copy of CE that casheph_open
+   (FILENAME) loads instead of parsing FILENAME for as long as FILENAME
+   is unchanged and TZ is the same.  Returns false without writing
+   unless CE holds what FILENAME holds: it was opened (without a filter
+   or journal changes) or last saved there, both file and book are
+   unchanged since, and TZ is the same. */
+bool casheph_cache_write (casheph_t *ce, const char *filename);
+
+casheph_t *casheph_open_filtered (const char *filename,
+                                  const casheph_filter_t *filter);
+
 casheph_account_t *casheph_account_get_account_by_name (casheph_account_t *act,
                                                         const char *name);
 
 casheph_transaction_t *casheph_get_transaction (casheph_t *ce,
                                                 const char *id);
 
+/* Look up N transaction IDs at once, storing the matches (or NULL) in
+   RESULTS.  Builds the transaction ID index if N makes it worthwhile. */
+void casheph_get_transactions (casheph_t *ce, const char **ids, int n,
+                               casheph_transaction_t **results);
+
 casheph_account_t *casheph_get_account (casheph_t *ce, const char *id);
 
+/* The account at PATH, the names of the accounts leading to it from
+   the root joined with ':', as in "Expenses:Groceries". */
+casheph_account_t *casheph_get_account_by_path (casheph_t *ce,
+                                                const char *path);
+
+/* Add an account called NAME of TYPE (such as "EXPENSE") under PARENT,
+   in COMMODITY or, when that is NULL, in PARENT's.  Returns NULL if
+   PARENT already has an account called NAME, NAME contains ':', or
+   there is no commodity. */
+casheph_account_t *casheph_add_account (casheph_t *ce,
+                                        casheph_account_t *parent,
+                                        const char *name, const char *type,
+                                        const casheph_commodity_t *commodity);
+
+/* Remove the account with ID.  With REPARENT its sub-accounts take its
+   place under its parent, otherwise they are removed with it.  Fails
+   for the root, for accounts that splits still refer to and when a
+   sub-account's name is taken in the parent.  Account changes are not
+   journaled; save the book after making them. */
+bool casheph_remove_account (casheph_t *ce, const char *id, bool reparent);
+
+/* Move ACT, with its sub-accounts, to the end of PARENT's.  Fails if
+   PARENT is ACT or under it, or has another account with ACT's name. */
+bool casheph_move_account (casheph_t *ce, casheph_account_t *act,
+                           casheph_account_t *parent);
+
 void casheph_remove_trn (casheph_t *ce, const char *id);
 
+/* Remove every transaction for which PRED returns true, compacting the
+   transaction list and updating the indexes once.  Returns the number
+   removed. */
+int casheph_remove_trns_if (casheph_t *ce,
+                            bool (*pred) (casheph_transaction_t *trn,
+                                          void *data),
+                            void *data);
+
+/* Remove the transactions with the N IDS; unknown IDs are ignored. */
+int casheph_remove_trns (casheph_t *ce, const char **ids, int n);
+
+/* A casheph_remove_trns_if predicate: posted before *(time_t*)DATE. */
+bool casheph_trn_posted_before (casheph_transaction_t *trn, void *date);
+
 casheph_transaction_t *casheph_add_simple_trn (casheph_t *ce,
                                                casheph_account_t *from,
                                                casheph_account_t *to,
@@ -182,8 +493,240 @@ casheph_transaction_t *casheph_add_simple_trn (casheph_t *ce,
                                                casheph_val_t *val,
                                                const char *desc);
 
-casheph_val_t *casheph_trn_value_for_act (casheph_transaction_t *t, casheph_account_t *act);
+/* Write a new random GUID (32 hex digits and a NUL) to BUF.  Safe to
+   call from any thread. */
+void casheph_guid_fill (char *buf);
+
+/* Add N transfers as casheph_add_simple_trn would, storing the new
+   transactions in RESULTS if it is not NULL.  Returns N. */
+int casheph_add_simple_trns (casheph_t *ce, const casheph_trn_record_t *records,
+                             int n, casheph_transaction_t **results);
+
+void casheph_trn_builder_init (casheph_trn_builder_t *b);
+
+void casheph_trn_builder_free (casheph_trn_builder_t *b);
+
+/* Start a transaction posted on DATE, dropping any uncommitted splits. */
+void casheph_trn_builder_reset (casheph_trn_builder_t *b,
+                                const casheph_gdate_t *date, const char *desc);
+
+void casheph_trn_builder_add_split (casheph_trn_builder_t *b,
+                                    casheph_account_t *act,
+                                    casheph_wval_t value,
+                                    casheph_wval_t quantity,
+                                    casheph_reconcile_t state);
+
+/* Add a string slot, such as "notes", to the last split added. */
+void casheph_trn_builder_add_slot (casheph_trn_builder_t *b, const char *key,
+                                   const char *value);
+
+/* Whether the split values sum to zero. */
+bool casheph_trn_builder_balanced (const casheph_trn_builder_t *b);
+
+/* Add the transaction built in B to the book and empty B for the next
+   one.  The transaction is allocated as a single block; see
+   casheph_transaction_t's packed.  Returns NULL, leaving B as it was,
+   when the splits do not balance. */
+casheph_transaction_t *casheph_trn_builder_commit (casheph_t *ce,
+                                                   casheph_trn_builder_t *b);
+
+/* Start an edit batch.  Until casheph_commit or casheph_rollback,
+   transactions added, removed or reconciled and accounts added,
+   removed or moved are recorded in an undo log.  The transaction
+   indexes, balances and journal are only brought up to date at
+   commit, so transaction lookups and balances (reconciled balances
+   included) still show the book as it was when the batch began; the
+   transactions and splits themselves, and account lookups, follow each
+   change.
+   Saving fails during a batch.  Returns false if a batch is already
+   open. */
+bool casheph_begin (casheph_t *ce);
+
+/* Apply the batch to the indexes and journal in one pass. */
+void casheph_commit (casheph_t *ce);
+
+/* Undo every change made since casheph_begin.  Transactions whose
+   reconciled states are put back get their old versions back too, so
+   casheph_export_delta does not report them. */
+void casheph_rollback (casheph_t *ce);
+
+/* Mark TRN as changed so the next save writes it afresh.  Needed after
+   modifying a transaction's fields directly; the casheph_* functions
+   that change transactions do it themselves. */
+void casheph_trn_touch (casheph_t *ce, casheph_transaction_t *trn);
+
+casheph_wval_t *casheph_trn_value_for_act (casheph_transaction_t *t, casheph_account_t *act);
 
 void casheph_save (casheph_t *ce, const char *filename);
 
+/* The book's current version, to pass to casheph_export_delta later.
+   Only meaningful for this open of the book. */
+casheph_checkpoint_t casheph_checkpoint (casheph_t *ce);
+
+/* Write to OUT the transactions added or changed since the checkpoint
+   SINCE and the IDs of those removed since, and return how many records
+   were written (-1 on error, or if SINCE was taken from another open of
+   the book or is ahead of it).  ce_delta_xml writes a <casheph:delta>
+   element holding <gnc:transaction> and <casheph:remove> elements as in
+   the book and its journal; ce_delta_binary writes them in the format
+   of the binary cache. */
+int casheph_export_delta (casheph_t *ce, casheph_checkpoint_t since,
+                          FILE *out, casheph_delta_format_t format);
+
+/* Forget removals older than the checkpoint SINCE, if it is from this
+   open of the book. */
+void casheph_prune_tombstones (casheph_t *ce, casheph_checkpoint_t since);
+
+/* Save on a background thread, to a temporary file renamed over
+   FILENAME when complete.  The file holds the book as it was when this
+   was called; transactions may be added and removed meanwhile, but
+   existing ones must not be edited directly until the save is done
+   (the casheph_* setters wait for it).  Returns false if the save could
+   not be started. */
+bool casheph_save_async (casheph_t *ce, const char *filename,
+                         const casheph_save_opts_t *opts);
+
+/* True when no background save is running. */
+bool casheph_save_done (casheph_t *ce);
+
+/* Wait for the latest background save and return whether it succeeded
+   (true if there was none), filling STATS if it is not NULL. */
+bool casheph_save_wait (casheph_t *ce, casheph_save_stats_t *stats);
+
+/* Append every later transaction added or removed, and every split
+   reconciled, to "FILENAME.journal", which casheph_open (FILENAME)
+   replays after loading FILENAME.  Changes in a batch are appended at
+   commit.  Records are flushed and synced every GROUP records (every
+   record when GROUP <= 1).  Account changes are not journaled. */
+bool casheph_journal_open (casheph_t *ce, const char *filename, int group);
+
+/* Flush and sync the records not yet written to disk.  Returns false
+   if this or any earlier record since the journal was opened or last
+   compacted could not be written or synced, in which case the journal
+   is incomplete until casheph_journal_compact succeeds. */
+bool casheph_journal_sync (casheph_t *ce);
+
+/* Save the book to the journal's file with OPTS (NULL for defaults) and
+   empty the journal.  The book is written to "<file>.saving", synced and
+   renamed into place before the journal is truncated, so a crash leaves
+   either the old book and its journal or the new book. */
+bool casheph_journal_compact (casheph_t *ce, const casheph_save_opts_t *opts);
+
+void casheph_journal_close (casheph_t *ce);
+
+void casheph_save_opts_init (casheph_save_opts_t *opts);
+
+/* Save with OPTS (NULL for the defaults casheph_save uses), filling
+   STATS if it is not NULL.  Returns false if the options are invalid or
+   the file could not be written.  The book goes to "FILENAME.saving"
+   first and is renamed over FILENAME once complete, so a failed save
+   leaves FILENAME as it was.  Nothing is written if the last save
+   went to FILENAME with the same settings, the file is untouched since,
+   and the book has not changed (by mod_count, or failing that by a hash
+   of its XML). */
+bool casheph_save_with (casheph_t *ce, const char *filename,
+                        const casheph_save_opts_t *opts,
+                        casheph_save_stats_t *stats);
+
+void casheph_ts_cache_init (casheph_ts_cache_t *cache);
+
+/* Write T as local time in the book's "YYYY-MM-DD HH:MM:SS +HHMM" form
+   and a terminating NUL to BUF, which must hold at least 32 bytes.
+   CACHE may be NULL.  Returns the length written. */
+int casheph_format_ts (casheph_ts_cache_t *cache, time_t t, char *buf);
+
+/* Checked arithmetic on wide values.  The functions returning bool
+   return false, leaving *RES untouched, when the result does not fit. */
+bool casheph_wval_add (casheph_wval_t a, casheph_wval_t b, casheph_wval_t *res);
+
+bool casheph_wval_neg (casheph_wval_t a, casheph_wval_t *res);
+
+/* Convert A to denominator D, rounding half away from zero. */
+bool casheph_wval_rescale (casheph_wval_t a, uint32_t d, casheph_wval_t *res);
+
+int casheph_wval_cmp (casheph_wval_t a, casheph_wval_t b);
+
+/* Parse "n/d" or "n" into *VAL. */
+bool casheph_parse_wval (const char *str, casheph_wval_t *val);
+
+/* Write "n/d" and a terminating NUL to BUF, which must hold at least
+   32 bytes.  Returns the length written. */
+int casheph_format_wval (casheph_wval_t val, char *buf);
+
+/* Balance (sum of split quantities) of ACT over transactions posted at
+   or before DATE, in units of 1/bal->d.  Fails if a quantity cannot be
+   put in the account's denominator or the sum overflows. */
+bool casheph_account_balance_at (casheph_t *ce, casheph_account_t *act,
+                                 time_t date, casheph_wval_t *bal);
+
+/* Fill MATRIX (N_ACCOUNTS rows of N_PERIODS) with the split quantities
+   posted to each account in [BOUNDS[p], BOUNDS[p + 1]).  N_THREADS <= 0
+   uses one thread per online CPU.  Fails if a quantity cannot be put in
+   the account's denominator or a total overflows. */
+bool casheph_report (casheph_t *ce, casheph_account_t **accounts,
+                     int n_accounts, const time_t *bounds, int n_periods,
+                     int n_threads, casheph_wval_t *matrix);
+
+/* Open the register of ACT (its splits in date order) at row 0 and
+   return the number of rows. */
+int casheph_register_open (casheph_t *ce, casheph_account_t *act,
+                           casheph_register_t *reg);
+
+bool casheph_register_seek (casheph_register_t *reg, int row);
+
+/* Fill ROW with the current row and its running balance, then advance.
+   Returns false past the last row or if the balance overflows. */
+bool casheph_register_next (casheph_register_t *reg,
+                            casheph_register_row_t *row);
+
+/* Sum of the splits of ACT whose reconciliation state is in MASK. */
+bool casheph_account_reconcile_balance (casheph_t *ce, casheph_account_t *act,
+                                        unsigned int mask, casheph_wval_t *bal);
+
+/* Store up to MAX splits of ACT whose state is in MASK, in date order,
+   and return how many match in total. */
+int casheph_account_reconcile_list (casheph_t *ce, casheph_account_t *act,
+                                    unsigned int mask, casheph_split_t **splits,
+                                    int max);
+
+void casheph_split_set_reconciled (casheph_t *ce, casheph_transaction_t *trn,
+                                   casheph_split_t *split,
+                                   casheph_reconcile_t state);
+
+/* Mark every unreconciled or cleared split of ACT posted at or before
+   DATE as reconciled.  Returns the number of splits changed. */
+int casheph_account_mark_reconciled (casheph_t *ce, casheph_account_t *act,
+                                     time_t date);
+
+/* Sum of the split quantities of ACT posted on the days FROM to TO
+   inclusive (local time), from per-day and per-month totals built for
+   all of CE's accounts on first use and kept up to date after.  Fails if a quantity could not be put in the
+   account's denominator or a total overflowed. */
+bool casheph_account_period_sum (casheph_t *ce, casheph_account_t *act,
+                                 const casheph_gdate_t *from,
+                                 const casheph_gdate_t *to,
+                                 casheph_wval_t *sum);
+
+/* Store in SUMS one total per day, week (starting Monday) or month from
+   the period containing FROM to the one containing TO.  Returns the
+   number of periods, of which at most MAX are stored, or -1 when the
+   totals overflowed as for casheph_account_period_sum. */
+int casheph_account_period_series (casheph_t *ce, casheph_account_t *act,
+                                   casheph_period_t period,
+                                   const casheph_gdate_t *from,
+                                   const casheph_gdate_t *to,
+                                   casheph_wval_t *sums, int max);
+
+/* Build (or rebuild) the trigram index over transaction descriptions
+   and string slots.  casheph_search builds it on first use. */
+void casheph_text_index_build (casheph_t *ce);
+
+/* Case-insensitive search of descriptions and string slots for QUERY,
+   anywhere (ce_search_substring) or at the start of a word, after any
+   character other than a letter or digit (ce_search_prefix).  Stores up to MAX_RESULTS matches in RESULTS,
+   newest first, and returns how many were stored. */
+int casheph_search (casheph_t *ce, const char *query,
+                    casheph_search_mode_t mode,
+                    casheph_transaction_t **results, int max_results);
+
 #endif
@@ -19,6 +19,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
 
 #include "zlib.h"
 
@@ -659,6 +663,1307 @@ get_account_by_id ()
   return true;
 }
 
+casheph_account_t *
+get_checking (casheph_t *ce)
+{
+  casheph_account_t *assets;
+  assets = casheph_account_get_account_by_name (ce->root, "Assets");
+  casheph_account_t *cur_assets;
+  cur_assets = casheph_account_get_account_by_name (assets, "Current Assets");
+  return casheph_account_get_account_by_name (cur_assets, "Checking Account");
+}
+
+bool
+balance_at_date ()
+{
+  casheph_t *ce = casheph_open ("test.gnucash");
+  casheph_account_t *checking = get_checking (ce);
+  casheph_wval_t bal;
+  casheph_account_balance_at (ce, checking, 1354552858, &bal);
+  if (bal.n != 0 || bal.d != 100) return false;
+  casheph_account_balance_at (ce, checking, 1354665600, &bal);
+  if (bal.n != 11963) return false;
+  casheph_account_balance_at (ce, checking, 1354838400, &bal);
+  if (bal.n != 199476) return false;
+  return true;
+}
+
+bool
+balance_at_date_after_add_and_remove ()
+{
+  casheph_t *ce = casheph_open ("test.gnucash");
+  casheph_account_t *checking = get_checking (ce);
+  casheph_account_t *expenses;
+  expenses = casheph_account_get_account_by_name (ce->root, "Expenses");
+  casheph_wval_t bal;
+  casheph_account_balance_at (ce, checking, 1354838400, &bal);
+  casheph_val_t val = { 1000, 100 };
+  casheph_gdate_t date = { 2012, 12, 5 };
+  setenv ("TZ", "UTC+0", 1);
+  casheph_transaction_t *trn;
+  trn = casheph_add_simple_trn (ce, checking, expenses, &date, &val, "Lunch");
+  casheph_account_balance_at (ce, checking, trn->date_posted - 1, &bal);
+  if (bal.n != 20000 - 3214) return false;
+  casheph_account_balance_at (ce, checking, trn->date_posted, &bal);
+  if (bal.n != 11963 - 1000) return false;
+  casheph_account_balance_at (ce, checking, 1354838400, &bal);
+  if (bal.n != 199476 - 1000) return false;
+  casheph_remove_trn (ce, "75fe0a336df6675568885a8cd7c582a8");
+  casheph_account_balance_at (ce, checking, 1354838400, &bal);
+  if (bal.n != 199476 - 1000 + 3214) return false;
+  return true;
+}
+
+bool
+report_sums_per_account_and_period ()
+{
+  casheph_t *ce = casheph_open ("test.gnucash");
+  casheph_account_t *accounts[2];
+  accounts[0] = get_checking (ce);
+  accounts[1] = casheph_get_account (ce, "7e36774d188b3aca9a8ec99441466d51");
+  time_t bounds[3] = { 1354552859, 1354665600, 1354838401 };
+  casheph_wval_t m1[4];
+  casheph_wval_t m4[4];
+  if (!casheph_report (ce, accounts, 2, bounds, 2, 1, m1)
+      || !casheph_report (ce, accounts, 2, bounds, 2, 4, m4))
+    {
+      return false;
+    }
+  if (m1[0].n != 20000 - 3214 || m1[1].n != -4823 + 500279 - 312766
+      || m1[0].d != 100 || m1[2].n != 0 || m1[3].n != 0)
+    {
+      return false;
+    }
+  /* Enough transactions for the work to be split four ways. */
+  setenv ("TZ", "UTC+0", 1);
+  int n = 4 * 4096 + 1000;
+  casheph_trn_record_t *recs;
+  recs = (casheph_trn_record_t*)malloc (sizeof (casheph_trn_record_t) * n);
+  int64_t added[2] = { 0, 0 };
+  int i;
+  for (i = 0; i < n; ++i)
+    {
+      recs[i].from = accounts[1];
+      recs[i].to = accounts[0];
+      recs[i].date.year = 2012;
+      recs[i].date.month = 12;
+      recs[i].date.day = 4 + 2 * (i % 2);
+      recs[i].value.n = i % 97 + 1;
+      recs[i].value.d = 100;
+      recs[i].desc = "Report";
+      added[i % 2] += i % 97 + 1;
+    }
+  casheph_add_simple_trns (ce, recs, n, NULL);
+  free (recs);
+  if (!casheph_report (ce, accounts, 2, bounds, 2, 1, m1)
+      || !casheph_report (ce, accounts, 2, bounds, 2, 4, m4))
+    {
+      return false;
+    }
+  if (m1[0].n != 20000 - 3214 + added[0]
+      || m1[1].n != -4823 + 500279 - 312766 + added[1]
+      || m1[2].n != -added[0] || m1[3].n != -added[1])
+    {
+      return false;
+    }
+  for (i = 0; i < 4; ++i)
+    {
+      if (m1[i].n != m4[i].n || m1[i].d != m4[i].d)
+        {
+          return false;
+        }
+    }
+  return true;
+}
+
+bool
+search_descriptions_and_slots ()
+{
+  casheph_t *ce = casheph_open ("test.gnucash");
+  casheph_transaction_t *res[8];
+  if (casheph_search (ce, "GROC", ce_search_substring, res, 8) != 1
+      || strcmp (res[0]->id, "75fe0a336df6675568885a8cd7c582a8") != 0)
+    {
+      return false;
+    }
+  if (casheph_search (ce, "money", ce_search_prefix, res, 8) != 1
+      || casheph_search (ce, "oney", ce_search_prefix, res, 8) != 0
+      || casheph_search (ce, "oney", ce_search_substring, res, 8) != 1
+      || casheph_search (ce, "a", ce_search_substring, res, 8) != 4)
+    {
+      return false;
+    }
+  /* Newest first. */
+  if (res[0]->date_posted < res[1]->date_posted
+      || res[1]->date_posted < res[2]->date_posted)
+    {
+      return false;
+    }
+  casheph_remove_trn (ce, "75fe0a336df6675568885a8cd7c582a8");
+  casheph_val_t val = { 1000, 100 };
+  casheph_gdate_t date = { 2013, 1, 5 };
+  casheph_add_simple_trn (ce, get_checking (ce), get_checking (ce), &date,
+                          &val, "More groceries");
+  if (casheph_search (ce, "grocer", ce_search_substring, res, 8) != 1
+      || strcmp (res[0]->desc, "More groceries") != 0)
+    {
+      return false;
+    }
+  /* Punctuation starts a word too. */
+  casheph_add_simple_trn (ce, get_checking (ce), get_checking (ce), &date,
+                          &val, "Food/Groceries");
+  casheph_add_simple_trn (ce, get_checking (ce), get_checking (ce), &date,
+                          &val, "Market (Groceries)");
+  casheph_add_simple_trn (ce, get_checking (ce), get_checking (ce), &date,
+                          &val, "Cafe\xc3\xa9groceries");
+  return (casheph_search (ce, "Groc", ce_search_prefix, res, 8) == 3
+          && casheph_search (ce, "ood", ce_search_prefix, res, 8) == 0);
+}
+
+bool
+filtered_open_keeps_matching_transactions ()
+{
+  casheph_filter_t filter;
+  memset (&filter, 0, sizeof (filter));
+  filter.has_dates = true;
+  filter.posted_from = 1354579200;
+  filter.posted_to = 1354752000;
+  casheph_t *ce = casheph_open_filtered ("test.gnucash", &filter);
+  if (ce == NULL || ce->n_transactions != 2
+      || !casheph_get_transaction (ce, "75fe0a336df6675568885a8cd7c582a8")
+      || !casheph_get_transaction (ce, "26d5b26ad0b23fd822f2c63a6e1084e0")
+      || ce->root->n_accounts != 5)
+    {
+      return false;
+    }
+  const char *gas[] = { "bd552553b90e67efe2f348970dbabcb9" };
+  memset (&filter, 0, sizeof (filter));
+  filter.n_accounts = 1;
+  filter.accounts = gas;
+  ce = casheph_open_filtered ("test.gnucash", &filter);
+  if (ce->n_transactions != 1
+      || !casheph_get_transaction (ce, "26d5b26ad0b23fd822f2c63a6e1084e0"))
+    {
+      return false;
+    }
+  memset (&filter, 0, sizeof (filter));
+  filter.slot_key = "date-posted";
+  ce = casheph_open_filtered ("test.gnucash", &filter);
+  if (ce->n_transactions != 4 || casheph_get_account (ce, "5c40e1bcbf05128a9dd754c76e9fe959") == NULL)
+    {
+      return false;
+    }
+  return true;
+}
+
+bool
+register_rows_in_date_order ()
+{
+  casheph_t *ce = casheph_open ("test.gnucash");
+  casheph_register_t reg;
+  casheph_register_row_t row;
+  if (casheph_register_open (ce, get_checking (ce), &reg) != 5)
+    {
+      return false;
+    }
+  int32_t balances[] = { 20000, 16786, 11963, 512242, 199476 };
+  int i = 0;
+  time_t last = 0;
+  while (casheph_register_next (&reg, &row))
+    {
+      if (row.trn->date_posted < last || row.balance.n != balances[i]
+          || strcmp (row.split->account, get_checking (ce)->id) != 0)
+        {
+          return false;
+        }
+      last = row.trn->date_posted;
+      ++i;
+    }
+  if (i != 5 || !casheph_register_seek (&reg, 3)
+      || !casheph_register_next (&reg, &row) || row.balance.n != 512242)
+    {
+      return false;
+    }
+  return true;
+}
+
+bool
+reconciling_up_to_a_date ()
+{
+  casheph_t *ce = casheph_open ("test.gnucash");
+  casheph_account_t *checking = get_checking (ce);
+  casheph_wval_t bal;
+  casheph_split_t *splits[8];
+  if (casheph_account_mark_reconciled (ce, checking, 1354665600) != 3)
+    {
+      return false;
+    }
+  casheph_account_reconcile_balance (ce, checking, ce_mask_reconciled, &bal);
+  if (bal.n != 11963
+      || casheph_account_reconcile_list (ce, checking, ce_mask_unreconciled,
+                                         splits, 8) != 2
+      || splits[0]->reconciled_state != ce_unreconciled)
+    {
+      return false;
+    }
+  casheph_transaction_t *t;
+  t = casheph_get_transaction (ce, "b1bac36e34d568e6363a81f2f61af197");
+  casheph_split_set_reconciled (ce, t, splits[0], ce_cleared);
+  casheph_account_reconcile_balance (ce, checking,
+                                     ce_mask_cleared | ce_mask_reconciled, &bal);
+  if (bal.n != 11963 + 500279)
+    {
+      return false;
+    }
+  casheph_save (ce, "reconciled.gnucash");
+  ce = casheph_open ("reconciled.gnucash");
+  system ("rm reconciled.gnucash");
+  casheph_account_reconcile_balance (ce, get_checking (ce),
+                                     ce_mask_unreconciled, &bal);
+  return bal.n == -312766;
+}
+
+bool
+wide_values_do_checked_arithmetic ()
+{
+  casheph_wval_t a, b, r;
+  char buf[32];
+  if (!casheph_parse_wval ("-9000000000000/100", &a)
+      || a.n != -9000000000000LL || a.d != 100
+      || !casheph_parse_wval ("25", &b) || b.n != 25 || b.d != 1
+      || casheph_parse_wval ("99999999999999999999/100", &r)
+      || casheph_parse_wval ("1/0", &r))
+    {
+      return false;
+    }
+  if (!casheph_wval_add (a, b, &r) || r.n != -9000000000000LL + 2500
+      || r.d != 100 || casheph_wval_cmp (r, a) <= 0)
+    {
+      return false;
+    }
+  casheph_format_wval (r, buf);
+  if (strcmp (buf, "-8999999997500/100") != 0)
+    {
+      return false;
+    }
+  a.n = INT64_MAX;
+  a.d = 100;
+  b.n = 1;
+  b.d = 100;
+  if (casheph_wval_add (a, b, &r) || casheph_wval_rescale (a, 1000, &r))
+    {
+      return false;
+    }
+  a.n = 2050;
+  a.d = 1000;
+  if (!casheph_wval_rescale (a, 100, &r) || r.n != 205
+      || !casheph_wval_neg (r, &r) || r.n != -205
+      || !casheph_wval_rescale (a, 10, &r) || r.n != 21)
+    {
+      return false;
+    }
+  b.n = 1;
+  b.d = 3;
+  return (casheph_wval_add (a, b, &r) && r.n == 6150 + 1000 && r.d == 3000
+          && casheph_wval_cmp (a, b) > 0);
+}
+
+bool
+period_sums_and_series ()
+{
+  setenv ("TZ", "UTC+0", 1);
+  casheph_t *ce = casheph_open ("test.gnucash");
+  casheph_account_t *checking = get_checking (ce);
+  casheph_gdate_t from = { 2012, 12, 4 };
+  casheph_gdate_t to = { 2012, 12, 6 };
+  casheph_wval_t sum;
+  if (ce->cubes_built)
+    {
+      return false;
+    }
+  casheph_account_period_sum (ce, checking, &from, &to, &sum);
+  if (sum.n != -3214 - 4823 + 500279 || sum.d != 100)
+    {
+      return false;
+    }
+  casheph_gdate_t nov = { 2012, 11, 15 };
+  casheph_gdate_t jan = { 2013, 1, 31 };
+  casheph_account_period_sum (ce, checking, &nov, &jan, &sum);
+  if (sum.n != 199476)
+    {
+      return false;
+    }
+  casheph_wval_t series[4];
+  if (casheph_account_period_series (ce, checking, ce_month, &nov, &jan,
+                                     series, 4) != 3
+      || series[0].n != 0 || series[1].n != 199476 || series[2].n != 0)
+    {
+      return false;
+    }
+  casheph_gdate_t mon = { 2012, 12, 3 };
+  if (casheph_account_period_series (ce, checking, ce_week, &mon, &jan,
+                                     series, 4) != 9
+      || series[0].n != 199476 || series[1].n != 0)
+    {
+      return false;
+    }
+  casheph_remove_trn (ce, "2205e761a5c5abbc66f34be4e212e457");
+  casheph_gdate_t dec31 = { 2012, 12, 31 };
+  casheph_account_period_sum (ce, checking, &from, &dec31, &sum);
+  if (sum.n != -3214 - 4823 + 500279)
+    {
+      return false;
+    }
+  /* Totals first built inside a batch go with it on rollback. */
+  ce = casheph_open ("test.gnucash");
+  checking = get_checking (ce);
+  casheph_account_t *expenses;
+  expenses = casheph_account_get_account_by_name (ce->root, "Expenses");
+  casheph_val_t val = { 1000, 100 };
+  casheph_begin (ce);
+  casheph_add_simple_trn (ce, checking, expenses, &from, &val, "Lunch");
+  casheph_account_period_sum (ce, checking, &from, &to, &sum);
+  if (sum.n != -3214 - 4823 + 500279 - 1000)
+    {
+      return false;
+    }
+  casheph_rollback (ce);
+  casheph_account_period_sum (ce, checking, &from, &to, &sum);
+  return sum.n == -3214 - 4823 + 500279;
+}
+
+bool
+batch_transaction_lookup ()
+{
+  casheph_t *ce = casheph_open ("test.gnucash");
+  const char *ids[10] = {
+    "b83f85a497dfb3f1d8db4c26489f57d9", "75fe0a336df6675568885a8cd7c582a8",
+    "00000000000000000000000000000000", "26d5b26ad0b23fd822f2c63a6e1084e0",
+    "b1bac36e34d568e6363a81f2f61af197", "2205e761a5c5abbc66f34be4e212e457",
+    "b83f85a497dfb3f1d8db4c26489f57d9", "75fe0a336df6675568885a8cd7c582a8",
+    "26d5b26ad0b23fd822f2c63a6e1084e0", "ffffffffffffffffffffffffffffffff" };
+  casheph_transaction_t *res[10];
+  casheph_get_transactions (ce, ids, 10, res);
+  int i;
+  for (i = 0; i < 10; ++i)
+    {
+      if ((i == 2 || i == 9) != (res[i] == NULL)
+          || (res[i] != NULL && strcmp (res[i]->id, ids[i]) != 0))
+        {
+          return false;
+        }
+    }
+  casheph_remove_trn (ce, ids[1]);
+  casheph_get_transactions (ce, ids, 3, res);
+  return (res[0] != NULL && res[1] == NULL
+          && casheph_get_transaction (ce, ids[3]) != NULL
+          && casheph_get_transaction (ce, ids[1]) == NULL);
+}
+
+bool
+aggregates_fail_on_overflow ()
+{
+  setenv ("TZ", "UTC+0", 1);
+  casheph_t *ce = casheph_open ("test.gnucash");
+  casheph_account_t *checking = get_checking (ce);
+  casheph_account_t *expenses;
+  expenses = casheph_account_get_account_by_name (ce->root, "Expenses");
+  casheph_wval_t bal;
+  casheph_account_balance_at (ce, checking, 1354838400, &bal);
+  /* Fits in units of 1, not of 1/100. */
+  casheph_wval_t huge = { INT64_MAX / 2, 1 };
+  casheph_wval_t neg = { -(INT64_MAX / 2), 1 };
+  casheph_gdate_t date = { 2012, 12, 10 };
+  casheph_trn_builder_t b;
+  casheph_trn_builder_init (&b);
+  casheph_trn_builder_reset (&b, &date, "Too much");
+  casheph_trn_builder_add_split (&b, checking, huge, huge, ce_unreconciled);
+  casheph_trn_builder_add_split (&b, expenses, neg, neg, ce_unreconciled);
+  casheph_trn_builder_commit (ce, &b);
+  casheph_trn_builder_free (&b);
+  casheph_account_t *accounts[] = { checking };
+  time_t bounds[] = { 1354320000, 1356998400 };
+  casheph_wval_t m[1];
+  casheph_gdate_t from = { 2012, 12, 1 };
+  casheph_gdate_t to = { 2012, 12, 31 };
+  casheph_wval_t series[1];
+  return (!casheph_account_balance_at (ce, checking, 1356998400, &bal)
+          && !casheph_account_reconcile_balance (ce, checking,
+                                                 ce_mask_unreconciled, &bal)
+          && !casheph_report (ce, accounts, 1, bounds, 1, 1, m)
+          && !casheph_account_period_sum (ce, checking, &from, &to, &bal)
+          && casheph_account_period_series (ce, checking, ce_month, &from,
+                                            &to, series, 1) == -1);
+}
+
+bool
+saving_large_book_round_trips ()
+{
+  casheph_t *ce = casheph_open ("test.gnucash");
+  casheph_account_t *checking = get_checking (ce);
+  casheph_account_t *expenses;
+  expenses = casheph_account_get_account_by_name (ce->root, "Expenses");
+  casheph_account_t *groceries;
+  groceries = casheph_account_get_account_by_name (expenses, "Groceries");
+  casheph_val_t val = {1999, 100};
+  casheph_gdate_t date = {2013, 3, 1};
+  int i;
+  for (i = 0; i < 2000; ++i)
+    {
+      casheph_add_simple_trn (ce, checking, groceries, &date, &val,
+                              "Groceries & sundries");
+    }
+  /* A transaction without a description still saves. */
+  free (ce->transactions[2004]->desc);
+  ce->transactions[2004]->desc = NULL;
+  casheph_save (ce, "large.gnucash");
+  casheph_t *ce2 = casheph_open ("large.gnucash");
+  system ("rm large.gnucash");
+  if (ce2 == NULL || ce2->n_transactions != 2005)
+    {
+      return false;
+    }
+  casheph_wval_t *v;
+  v = casheph_trn_value_for_act (ce2->transactions[2004], get_checking (ce2));
+  return v != NULL && v->n == -1999 && v->d == 100;
+}
+
+bool
+saving_with_options ()
+{
+  casheph_t *ce = casheph_open ("test.gnucash");
+  setenv ("TZ", "UTC+0", 1);
+  casheph_save_opts_t opts;
+  casheph_save_opts_init (&opts);
+  opts.uncompressed = true;
+  opts.buffer_size = 64;
+  casheph_save_stats_t plain;
+  if (!casheph_save_with (ce, "test.gnucash.plain", &opts, &plain))
+    {
+      return false;
+    }
+  opts.uncompressed = false;
+  opts.level = 9;
+  casheph_save_stats_t best;
+  if (!casheph_save_with (ce, "test.gnucash.best", &opts, &best))
+    {
+      return false;
+    }
+  opts.level = 12;
+  if (casheph_save_with (ce, "test.gnucash.bad", &opts, NULL))
+    {
+      return false;
+    }
+  /* Bad strategies are refused before any file is opened. */
+  opts.level = 6;
+  opts.strategy = 99;
+  if (casheph_save_with (ce, "test.gnucash.bad", &opts, NULL)
+      || casheph_save_async (ce, "test.gnucash.bad", &opts)
+      || system ("test -e test.gnucash.bad.saving") == 0)
+    {
+      return false;
+    }
+  system ("gunzip -c test.gnucash > test.gnucash.raw");
+  int res = system ("cmp -s test.gnucash.raw test.gnucash.plain");
+  system ("rm test.gnucash.raw test.gnucash.plain");
+  casheph_t *ce2 = casheph_open ("test.gnucash.best");
+  system ("rm test.gnucash.best");
+  return (res == 0 && ce2 != NULL && ce2->n_transactions == 5
+          && plain.raw_bytes == plain.out_bytes
+          && best.raw_bytes == plain.raw_bytes
+          && best.out_bytes < best.raw_bytes && best.ratio > 1);
+}
+
+bool
+saving_with_parallel_compression ()
+{
+  casheph_t *ce = casheph_open ("test.gnucash");
+  setenv ("TZ", "UTC+0", 1);
+  casheph_account_t *checking = get_checking (ce);
+  casheph_account_t *expenses;
+  expenses = casheph_account_get_account_by_name (ce->root, "Expenses");
+  casheph_account_t *groceries;
+  groceries = casheph_account_get_account_by_name (expenses, "Groceries");
+  casheph_val_t val = {4250, 100};
+  casheph_gdate_t date = {2013, 4, 2};
+  int i;
+  for (i = 0; i < 500; ++i)
+    {
+      casheph_add_simple_trn (ce, checking, groceries, &date, &val, "Market");
+    }
+  casheph_save_opts_t opts;
+  casheph_save_opts_init (&opts);
+  opts.uncompressed = true;
+  if (!casheph_save_with (ce, "parallel.gnucash.plain", &opts, NULL))
+    {
+      return false;
+    }
+  opts.uncompressed = false;
+  opts.n_threads = 4;
+  opts.buffer_size = 32768;
+  casheph_save_stats_t stats;
+  if (!casheph_save_with (ce, "parallel.gnucash", &opts, &stats))
+    {
+      return false;
+    }
+  system ("gunzip -c parallel.gnucash > parallel.gnucash.raw");
+  int res = system ("cmp -s parallel.gnucash.raw parallel.gnucash.plain");
+  /* A save that fails leaves the last one in place. */
+  casheph_add_simple_trn (ce, checking, groceries, &date, &val, "Market");
+  opts.strategy = 99;
+  bool failed = !casheph_save_with (ce, "parallel.gnucash", &opts, NULL);
+  int leftover = system ("test -e parallel.gnucash.saving");
+  casheph_t *ce2 = casheph_open ("parallel.gnucash");
+  system ("rm parallel.gnucash parallel.gnucash.raw parallel.gnucash.plain");
+  return (res == 0 && failed && leftover != 0 && ce2 != NULL
+          && ce2->n_transactions == 505
+          && stats.raw_bytes > 4 * 32768 && stats.ratio > 1);
+}
+
+bool
+saving_reuses_untouched_fragments ()
+{
+  casheph_t *ce = casheph_open ("test.gnucash");
+  setenv ("TZ", "UTC+0", 1);
+  casheph_save_opts_t opts;
+  casheph_save_opts_init (&opts);
+  opts.uncompressed = true;
+  opts.keep_fragments = true;
+  casheph_save_with (ce, "fragments.xml", &opts, NULL);
+  casheph_transaction_t *trn;
+  trn = casheph_get_transaction (ce, "b83f85a497dfb3f1d8db4c26489f57d9");
+  if (trn->xml == NULL)
+    {
+      return false;
+    }
+  free (trn->desc);
+  trn->desc = strdup ("Starting Balance");
+  casheph_save_with (ce, "fragments.xml", &opts, NULL);
+  int stale = system ("grep -q 'Opening Balance' fragments.xml");
+  casheph_trn_touch (ce, trn);
+  casheph_save_with (ce, "fragments.xml", &opts, NULL);
+  int fresh = system ("grep -q 'Starting Balance' fragments.xml");
+  /* A background save leaves the cache alone. */
+  bool async = (casheph_save_async (ce, "fragments.async.xml", &opts)
+                && casheph_save_wait (ce, NULL) && trn->xml != NULL);
+  system ("rm fragments.async.xml");
+  opts.keep_fragments = false;
+  casheph_save_with (ce, "fragments.xml", &opts, NULL);
+  system ("rm fragments.xml");
+  return (stale == 0 && fresh == 0 && async && trn->xml == NULL
+          && ce->xml_tz == NULL);
+}
+
+bool
+journal_replays_and_compacts ()
+{
+  system ("cp test.gnucash journal.gnucash");
+  casheph_t *ce = casheph_open ("journal.gnucash");
+  if (!casheph_journal_open (ce, "journal.gnucash", 2))
+    {
+      return false;
+    }
+  casheph_account_t *checking = get_checking (ce);
+  casheph_account_t *expenses;
+  expenses = casheph_account_get_account_by_name (ce->root, "Expenses");
+  casheph_account_t *groceries;
+  groceries = casheph_account_get_account_by_name (expenses, "Groceries");
+  casheph_val_t val = {1234, 100};
+  casheph_gdate_t date = {2013, 5, 6};
+  casheph_transaction_t *trn;
+  trn = casheph_add_simple_trn (ce, checking, groceries, &date, &val, "Bakery");
+  char *id = strdup (trn->id);
+  casheph_remove_trn (ce, "b83f85a497dfb3f1d8db4c26489f57d9");
+  casheph_transaction_t *marked = ce->transactions[0];
+  casheph_split_set_reconciled (ce, marked, marked->splits[1], ce_cleared);
+  char *marked_id = strdup (marked->id);
+  if (!casheph_journal_sync (ce))
+    {
+      return false;
+    }
+  casheph_journal_close (ce);
+  /* A record cut short by a crash is ignored. */
+  system ("printf '<gnc:transaction version=\"2.0.0\">\\n  <trn:id' >> journal.gnucash.journal");
+
+  casheph_t *ce2 = casheph_open ("journal.gnucash");
+  if (ce2 == NULL || ce2->n_transactions != 5
+      || casheph_get_transaction (ce2, id) == NULL
+      || casheph_get_transaction (ce2, "b83f85a497dfb3f1d8db4c26489f57d9") != NULL
+      || casheph_trn_value_for_act (casheph_get_transaction (ce2, id),
+                                    get_checking (ce2))->n != -1234
+      || casheph_get_transaction (ce2, marked_id)->splits[1]->reconciled_state
+         != ce_cleared)
+    {
+      return false;
+    }
+  free (marked_id);
+  /* A journal that cannot be written says so. */
+  system ("ln -s /dev/full full.gnucash.journal");
+  bool opened = casheph_journal_open (ce2, "full.gnucash", 4);
+  casheph_add_simple_trn (ce2, get_checking (ce2), get_checking (ce2), &date,
+                          &val, "Lost");
+  bool synced = casheph_journal_sync (ce2);
+  casheph_journal_close (ce2);
+  system ("rm full.gnucash.journal");
+  if (!opened || synced)
+    {
+      return false;
+    }
+  casheph_journal_open (ce2, "journal.gnucash", 1);
+  if (!casheph_journal_compact (ce2, NULL))
+    {
+      return false;
+    }
+  casheph_journal_close (ce2);
+  int empty = system ("test ! -s journal.gnucash.journal"
+                      " -a ! -e journal.gnucash.saving");
+  casheph_t *ce3 = casheph_open ("journal.gnucash");
+  system ("rm journal.gnucash journal.gnucash.journal");
+  free (id);
+  return empty == 0 && ce3 != NULL && ce3->n_transactions == 6;
+}
+
+bool
+formatting_timestamps ()
+{
+  char buf[32];
+  setenv ("TZ", "UTC+0", 1);
+  casheph_ts_cache_t cache;
+  casheph_ts_cache_init (&cache);
+  casheph_format_ts (&cache, 1354552859, buf);
+  if (strcmp (buf, "2012-12-03 16:40:59 +0000") != 0)
+    {
+      return false;
+    }
+  /* East of Greenwich, in and out of summer time. */
+  setenv ("TZ", "CET-1CEST,M3.5.0,M10.5.0/3", 1);
+  casheph_ts_cache_init (&cache);
+  casheph_format_ts (&cache, 1340000000, buf);
+  if (strcmp (buf, "2012-06-18 08:13:20 +0200") != 0)
+    {
+      return false;
+    }
+  casheph_format_ts (&cache, 1354552859, buf);
+  if (strcmp (buf, "2012-12-03 17:40:59 +0100") != 0)
+    {
+      return false;
+    }
+  /* Dates all over the place, including right at the changes. */
+  char buf2[32];
+  uint64_t x = 88172645463325252ULL;
+  int i;
+  for (i = 0; i < 20000; ++i)
+    {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      time_t t = (time_t)(x % 2145916800);
+      if (i % 2 == 0)
+        {
+          t = 1332637200 + (time_t)(x % 3) - 1;
+        }
+      casheph_format_ts (&cache, t, buf);
+      casheph_format_ts (NULL, t, buf2);
+      if (strcmp (buf, buf2) != 0)
+        {
+          setenv ("TZ", "UTC+0", 1);
+          return false;
+        }
+    }
+  casheph_format_ts (NULL, 1340000000, buf);
+  setenv ("TZ", "UTC+0", 1);
+  return strcmp (buf, "2012-06-18 08:13:20 +0200") == 0;
+}
+
+bool
+saving_in_the_background ()
+{
+  casheph_t *ce = casheph_open ("test.gnucash");
+  casheph_account_t *checking = get_checking (ce);
+  casheph_account_t *expenses;
+  expenses = casheph_account_get_account_by_name (ce->root, "Expenses");
+  casheph_account_t *groceries;
+  groceries = casheph_account_get_account_by_name (expenses, "Groceries");
+  casheph_val_t val = {775, 100};
+  casheph_gdate_t date = {2013, 6, 7};
+  int i;
+  for (i = 0; i < 500; ++i)
+    {
+      casheph_add_simple_trn (ce, checking, groceries, &date, &val, "Deli");
+    }
+  if (!casheph_save_async (ce, "async.gnucash", NULL))
+    {
+      return false;
+    }
+  casheph_remove_trn (ce, "b83f85a497dfb3f1d8db4c26489f57d9");
+  casheph_add_simple_trn (ce, checking, groceries, &date, &val, "Late");
+  while (!casheph_save_done (ce))
+    {
+      usleep (1000);
+    }
+  casheph_save_stats_t stats;
+  if (!casheph_save_wait (ce, &stats) || stats.raw_bytes == 0)
+    {
+      return false;
+    }
+  casheph_t *ce2 = casheph_open ("async.gnucash");
+  system ("rm async.gnucash");
+  return (ce2 != NULL && ce2->n_transactions == 505
+          && casheph_get_transaction (ce2, "b83f85a497dfb3f1d8db4c26489f57d9") != NULL
+          && strcmp (ce2->transactions[504]->desc, "Deli") == 0);
+}
+
+bool
+opening_from_binary_cache ()
+{
+  system ("cp test3.gnucash cached.gnucash");
+  setenv ("TZ", "America/New_York", 1);
+  casheph_t *ce = casheph_open ("cached.gnucash");
+  if (!casheph_cache_write (ce, "cached.gnucash"))
+    {
+      return false;
+    }
+  casheph_t *ce2 = casheph_open ("cached.gnucash");
+  casheph_save (ce2, "cached.gnucash.saved");
+  system ("gunzip -c cached.gnucash > cached.gnucash.raw");
+  system ("gunzip -c cached.gnucash.saved > cached.gnucash.saved.raw");
+  int same = system ("cmp -s cached.gnucash.raw cached.gnucash.saved.raw");
+  if (same != 0 || ce2->n_template_transactions != 4
+      || ce2->template_root->n_accounts != 4)
+    {
+      return false;
+    }
+  /* A changed book is not cached until it is saved there. */
+  casheph_remove_trn (ce, ce->transactions[0]->id);
+  if (casheph_cache_write (ce, "cached.gnucash"))
+    {
+      return false;
+    }
+  casheph_t *ce3 = casheph_open ("cached.gnucash");
+  /* A cache that no longer matches its file is not used: the XML wins
+     over this one, which still holds the removed transaction. */
+  system ("cp cached.gnucash.cache cached.gnucash.cache.old");
+  casheph_save (ce, "cached.gnucash");
+  bool saved_cached = casheph_cache_write (ce, "cached.gnucash");
+  casheph_t *ce4 = casheph_open ("cached.gnucash");
+  system ("mv cached.gnucash.cache.old cached.gnucash.cache");
+  casheph_t *ce5 = casheph_open ("cached.gnucash");
+  system ("rm cached.gnucash cached.gnucash.cache cached.gnucash.saved");
+  system ("rm cached.gnucash.raw cached.gnucash.saved.raw");
+  return (ce3->n_transactions == ce2->n_transactions && saved_cached
+          && ce4->n_transactions == ce2->n_transactions - 1
+          && ce5->n_transactions == ce2->n_transactions - 1);
+}
+
+bool
+saving_unchanged_book_is_skipped ()
+{
+  system ("cp test.gnucash unchanged.gnucash");
+  setenv ("TZ", "UTC+0", 1);
+  casheph_t *ce = casheph_open ("unchanged.gnucash");
+  casheph_save_stats_t stats;
+  if (!casheph_save_with (ce, "unchanged.gnucash", NULL, &stats) || !stats.wrote)
+    {
+      return false;
+    }
+  if (!casheph_save_with (ce, "unchanged.gnucash", NULL, &stats) || stats.wrote)
+    {
+      return false;
+    }
+  /* A change that is undone leaves nothing to write. */
+  casheph_transaction_t *trn = ce->transactions[1];
+  casheph_split_t *split = trn->splits[0];
+  casheph_reconcile_t state = split->reconciled_state;
+  casheph_split_set_reconciled (ce, trn, split, ce_frozen);
+  casheph_split_set_reconciled (ce, trn, split, state);
+  if (!casheph_save_with (ce, "unchanged.gnucash", NULL, &stats) || stats.wrote)
+    {
+      return false;
+    }
+  casheph_split_set_reconciled (ce, trn, split, ce_frozen);
+  if (!casheph_save_with (ce, "unchanged.gnucash", NULL, &stats) || !stats.wrote)
+    {
+      return false;
+    }
+  /* A file changed behind our back is written again. */
+  system ("cp test.gnucash unchanged.gnucash");
+  bool wrote = casheph_save_with (ce, "unchanged.gnucash", NULL, &stats) && stats.wrote;
+  system ("rm unchanged.gnucash");
+  return wrote;
+}
+
+bool
+exporting_changes_since_checkpoint ()
+{
+  casheph_t *ce = casheph_open ("test.gnucash");
+  casheph_checkpoint_t since = casheph_checkpoint (ce);
+  casheph_account_t *checking = get_checking (ce);
+  casheph_account_t *expenses;
+  expenses = casheph_account_get_account_by_name (ce->root, "Expenses");
+  casheph_account_t *groceries;
+  groceries = casheph_account_get_account_by_name (expenses, "Groceries");
+  casheph_val_t val = {999, 100};
+  casheph_gdate_t date = {2013, 7, 8};
+  casheph_add_simple_trn (ce, checking, groceries, &date, &val, "Corner shop");
+  casheph_transaction_t *trn;
+  trn = casheph_get_transaction (ce, "75fe0a336df6675568885a8cd7c582a8");
+  casheph_split_set_reconciled (ce, trn, trn->splits[0], ce_cleared);
+  casheph_remove_trn (ce, "b83f85a497dfb3f1d8db4c26489f57d9");
+
+  FILE *file = fopen ("delta.xml", "w");
+  int n = casheph_export_delta (ce, since, file, ce_delta_xml);
+  fclose (file);
+  int trns = system ("test $(grep -c '<gnc:transaction' delta.xml) = 2");
+  int removes = system ("grep -q '<casheph:remove>b83f85a497dfb3f1d8db4c26489f57d9<' delta.xml");
+  file = fopen ("delta.bin", "w");
+  int n_bin = casheph_export_delta (ce, since, file, ce_delta_binary);
+  long bin_size = ftell (file);
+  fclose (file);
+  system ("rm delta.xml delta.bin");
+
+  casheph_checkpoint_t now = casheph_checkpoint (ce);
+  file = fopen ("/dev/null", "w");
+  int none = casheph_export_delta (ce, now, file, ce_delta_xml);
+  /* Checkpoints from another open of the book, or from its future, are
+     refused. */
+  casheph_t *ce2 = casheph_open ("test.gnucash");
+  casheph_checkpoint_t other = casheph_checkpoint (ce2);
+  casheph_checkpoint_t ahead = now;
+  ++ahead.version;
+  int refused = (casheph_export_delta (ce, other, file, ce_delta_xml) == -1
+                 && casheph_export_delta (ce, ahead, file, ce_delta_xml) == -1);
+  casheph_prune_tombstones (ce, other);
+  int kept = ce->n_tombstones;
+  casheph_prune_tombstones (ce, now);
+  fclose (file);
+  return (n == 3 && trns == 0 && removes == 0 && n_bin == 3 && bin_size > 100
+          && none == 0 && refused && kept == 1 && ce->n_tombstones == 0);
+}
+
+bool
+adding_transactions_in_a_batch ()
+{
+  setenv ("TZ", "UTC+0", 1);
+  casheph_t *ce = casheph_open ("test.gnucash");
+  casheph_account_t *checking = get_checking (ce);
+  casheph_account_t *expenses;
+  expenses = casheph_account_get_account_by_name (ce->root, "Expenses");
+  casheph_wval_t before;
+  casheph_account_balance_at (ce, checking, 1354838400, &before);
+  int n = ce->n_transactions;
+  casheph_trn_record_t recs[200];
+  casheph_transaction_t *trns[200];
+  int i, j;
+  for (i = 0; i < 200; ++i)
+    {
+      recs[i].from = checking;
+      recs[i].to = expenses;
+      recs[i].date.year = 2012;
+      recs[i].date.month = 12;
+      recs[i].date.day = 1 + i % 28;
+      recs[i].value.n = 100;
+      recs[i].value.d = 100;
+      recs[i].desc = "Batch";
+    }
+  if (casheph_add_simple_trns (ce, recs, 200, trns) != 200
+      || ce->n_transactions != n + 200 || ce->transactions[n] != trns[0])
+    {
+      return false;
+    }
+  for (i = 0; i < 200; ++i)
+    {
+      for (j = 0; j < i; ++j)
+        {
+          if (strcmp (trns[i]->id, trns[j]->id) == 0)
+            {
+              return false;
+            }
+        }
+    }
+  /* Days 1 to 7 come up 53 times. */
+  casheph_wval_t after;
+  casheph_account_balance_at (ce, checking, 1354838400, &after);
+  if (after.n != before.n - 53 * 100)
+    {
+      return false;
+    }
+  casheph_register_t reg;
+  casheph_register_row_t row;
+  time_t last = 0;
+  casheph_register_open (ce, checking, &reg);
+  while (casheph_register_next (&reg, &row))
+    {
+      if (row.trn->date_posted < last)
+        {
+          return false;
+        }
+      last = row.trn->date_posted;
+    }
+  return casheph_get_transaction (ce, trns[199]->id) == trns[199];
+}
+
+bool
+building_multi_split_transactions ()
+{
+  casheph_t *ce = casheph_open ("test.gnucash");
+  casheph_account_t *checking = get_checking (ce);
+  casheph_account_t *expenses;
+  expenses = casheph_account_get_account_by_name (ce->root, "Expenses");
+  casheph_account_t *groceries;
+  groceries = casheph_account_get_account_by_name (expenses, "Groceries");
+  int n = ce->n_transactions;
+  casheph_gdate_t date = { 2013, 1, 15 };
+  casheph_wval_t pay = { -30000, 100 };
+  casheph_wval_t food = { 12550, 100 };
+  casheph_wval_t rest = { 1745, 10 };
+  casheph_trn_builder_t b;
+  casheph_trn_builder_init (&b);
+  int i;
+  for (i = 0; i < 2; ++i)
+    {
+      casheph_trn_builder_reset (&b, &date, "Split purchase");
+      casheph_trn_builder_add_split (&b, checking, pay, pay, ce_cleared);
+      casheph_trn_builder_add_split (&b, groceries, food, food, ce_unreconciled);
+      casheph_trn_builder_add_slot (&b, "notes", "Market & bakery");
+      casheph_trn_builder_add_split (&b, expenses, rest, rest, ce_unreconciled);
+      if (casheph_trn_builder_commit (ce, &b) == NULL)
+        {
+          return false;
+        }
+    }
+  /* Off by a cent. */
+  casheph_trn_builder_reset (&b, &date, "Unbalanced");
+  casheph_trn_builder_add_split (&b, checking, pay, pay, ce_unreconciled);
+  casheph_trn_builder_add_split (&b, expenses, food, food, ce_unreconciled);
+  bool rejected = casheph_trn_builder_commit (ce, &b) == NULL && b.n_splits == 2;
+  /* Committed transactions are one block, and are freed as one. */
+  casheph_trn_builder_add_split (&b, expenses, rest, rest, ce_unreconciled);
+  casheph_transaction_t *extra = casheph_trn_builder_commit (ce, &b);
+  casheph_trn_builder_free (&b);
+  if (!rejected || extra == NULL || !extra->packed)
+    {
+      return false;
+    }
+  char *extra_id = strdup (extra->id);
+  casheph_remove_trn (ce, extra_id);
+  free (extra_id);
+  if (ce->n_transactions != n + 2 || !ce->transactions[n]->packed)
+    {
+      return false;
+    }
+  casheph_save (ce, "builder.gnucash");
+  casheph_t *ce2 = casheph_open ("builder.gnucash");
+  system ("rm builder.gnucash");
+  casheph_transaction_t *trn = ce2->transactions[n + 1];
+  return (trn->n_splits == 3
+          && trn->splits[0]->reconciled_state == ce_cleared
+          && trn->splits[2]->value->n == 1745 && trn->splits[2]->value->d == 10
+          && trn->splits[1]->n_slots == 1
+          && strcmp (trn->splits[1]->slots[0]->key, "notes") == 0
+          && strcmp ((char*)trn->splits[1]->slots[0]->value,
+                     "Market & bakery") == 0);
+}
+
+bool
+removing_transactions_in_bulk ()
+{
+  setenv ("TZ", "UTC+0", 1);
+  casheph_t *ce = casheph_open ("test.gnucash");
+  casheph_t *ce2 = casheph_open ("test.gnucash");
+  casheph_account_t *checking = get_checking (ce);
+  casheph_wval_t bal, bal2;
+  casheph_account_balance_at (ce, checking, 1354838400, &bal);
+  casheph_get_transaction (ce, "75fe0a336df6675568885a8cd7c582a8");
+  const char *ids[] = { "75fe0a336df6675568885a8cd7c582a8", "not-a-guid",
+                        "b83f85a497dfb3f1d8db4c26489f57d9" };
+  if (casheph_remove_trns (ce, ids, 3) != 2)
+    {
+      return false;
+    }
+  casheph_remove_trn (ce2, ids[0]);
+  casheph_remove_trn (ce2, ids[2]);
+  casheph_account_balance_at (ce, checking, 1354838400, &bal);
+  casheph_account_balance_at (ce2, get_checking (ce2), 1354838400, &bal2);
+  if (ce->n_transactions != ce2->n_transactions || bal.n != bal2.n
+      || ce->n_tombstones != 2
+      || casheph_get_transaction (ce, ids[0]) != NULL)
+    {
+      return false;
+    }
+  time_t cutoff = 1354838400;
+  int n = ce->n_transactions;
+  int removed = casheph_remove_trns_if (ce, casheph_trn_posted_before, &cutoff);
+  if (removed == 0 || ce->n_transactions != n - removed)
+    {
+      return false;
+    }
+  int i;
+  for (i = 0; i < ce->n_transactions; ++i)
+    {
+      if (ce->transactions[i]->date_posted < cutoff)
+        {
+          return false;
+        }
+    }
+  casheph_account_balance_at (ce, checking, cutoff - 1, &bal);
+  return bal.n == 0;
+}
+
+void *
+make_guids (void *buf)
+{
+  int i;
+  for (i = 0; i < 1000; ++i)
+    {
+      casheph_guid_fill ((char*)buf + 33 * i);
+    }
+  return NULL;
+}
+
+int
+guid_cmp (const void *a, const void *b)
+{
+  return strcmp ((const char*)a, (const char*)b);
+}
+
+bool
+making_guids_from_threads ()
+{
+  char *guids = (char*)malloc (4 * 1000 * 33);
+  pthread_t threads[4];
+  int i;
+  for (i = 0; i < 4; ++i)
+    {
+      pthread_create (&threads[i], NULL, make_guids, guids + i * 1000 * 33);
+    }
+  for (i = 0; i < 4; ++i)
+    {
+      pthread_join (threads[i], NULL);
+    }
+  qsort (guids, 4000, 33, guid_cmp);
+  bool ok = true;
+  for (i = 0; i < 4000 && ok; ++i)
+    {
+      const char *g = guids + 33 * i;
+      ok = (strlen (g) == 32 && strspn (g, "0123456789abcdef") == 32
+            && (i == 0 || strcmp (g - 33, g) != 0));
+    }
+  free (guids);
+  /* A forked child does not repeat the parent's next GUID. */
+  char mine[33];
+  char theirs[33];
+  int fds[2];
+  casheph_guid_fill (mine);
+  if (pipe (fds) != 0)
+    {
+      return false;
+    }
+  pid_t pid = fork ();
+  if (pid == 0)
+    {
+      casheph_guid_fill (theirs);
+      write (fds[1], theirs, 33);
+      _exit (0);
+    }
+  casheph_guid_fill (mine);
+  bool got = read (fds[0], theirs, 33) == 33;
+  waitpid (pid, NULL, 0);
+  close (fds[0]);
+  close (fds[1]);
+  return ok && got && strcmp (mine, theirs) != 0;
+}
+
+/* Adds two transactions, removes one of them and one from the file,
+   and reconciles a split, inside a batch. */
+casheph_transaction_t *
+edit_in_batch (casheph_t *ce)
+{
+  casheph_account_t *checking = get_checking (ce);
+  casheph_account_t *expenses;
+  expenses = casheph_account_get_account_by_name (ce->root, "Expenses");
+  casheph_val_t val = { 2500, 100 };
+  casheph_gdate_t date = { 2012, 12, 4 };
+  casheph_begin (ce);
+  casheph_transaction_t *kept;
+  kept = casheph_add_simple_trn (ce, checking, expenses, &date, &val, "Kept");
+  casheph_transaction_t *dropped;
+  dropped = casheph_add_simple_trn (ce, checking, expenses, &date, &val, "Dropped");
+  casheph_remove_trn (ce, "75fe0a336df6675568885a8cd7c582a8");
+  casheph_remove_trn (ce, dropped->id);
+  casheph_transaction_t *trn = ce->transactions[0];
+  casheph_split_set_reconciled (ce, trn, trn->splits[0], ce_voided);
+  return kept;
+}
+
+bool
+rolling_back_and_committing_batches ()
+{
+  setenv ("TZ", "UTC+0", 1);
+  casheph_t *ce = casheph_open ("test.gnucash");
+  casheph_account_t *checking = get_checking (ce);
+  casheph_wval_t before, bal;
+  casheph_account_balance_at (ce, checking, 1354838400, &before);
+  int n = ce->n_transactions;
+  char **ids = (char**)malloc (sizeof (char*) * n);
+  int i;
+  for (i = 0; i < n; ++i)
+    {
+      ids[i] = strdup (ce->transactions[i]->id);
+    }
+  casheph_split_t *split = ce->transactions[0]->splits[0];
+  casheph_account_t *act = casheph_get_account (ce, split->account);
+  casheph_reconcile_t state = split->reconciled_state;
+  uint64_t version = ce->transactions[0]->version;
+  casheph_wval_t voided, voided_in_batch;
+  casheph_account_reconcile_balance (ce, act, ce_mask_voided, &voided);
+  edit_in_batch (ce);
+  /* Balances, reconciled ones included, do not see the batch until it
+     is committed. */
+  casheph_account_balance_at (ce, checking, 1354838400, &bal);
+  casheph_account_reconcile_balance (ce, act, ce_mask_voided, &voided_in_batch);
+  if (bal.n != before.n || voided_in_batch.n != voided.n
+      || casheph_save_async (ce, "batch.gnucash", NULL))
+    {
+      return false;
+    }
+  casheph_rollback (ce);
+  if (ce->n_transactions != n || ce->n_tombstones != 0
+      || split->reconciled_state != state
+      || ce->transactions[0]->version != version)
+    {
+      return false;
+    }
+  for (i = 0; i < n; ++i)
+    {
+      if (strcmp (ce->transactions[i]->id, ids[i]) != 0)
+        {
+          return false;
+        }
+      free (ids[i]);
+    }
+  free (ids);
+  casheph_account_balance_at (ce, checking, 1354838400, &bal);
+  if (bal.n != before.n)
+    {
+      return false;
+    }
+  casheph_transaction_t *kept = edit_in_batch (ce);
+  casheph_commit (ce);
+  casheph_account_balance_at (ce, checking, 1354838400, &bal);
+  casheph_account_reconcile_balance (ce, act, ce_mask_voided, &voided);
+  return (ce->n_transactions == n && ce->n_tombstones == 1
+          && voided.n == split->value->n
+          && bal.n == before.n - 2500 + 3214
+          && casheph_get_transaction (ce, kept->id) == kept
+          && casheph_get_transaction (ce, "75fe0a336df6675568885a8cd7c582a8") == NULL
+          && ce->transactions[0]->splits[0]->reconciled_state == ce_voided);
+}
+
+/* Adds a transaction to checking, removes one from the file and marks
+   checking reconciled, in a batch or not. */
+int
+mark_after_adding (casheph_t *ce, bool batch, casheph_transaction_t **added)
+{
+  casheph_account_t *checking = get_checking (ce);
+  casheph_account_t *expenses;
+  expenses = casheph_account_get_account_by_name (ce->root, "Expenses");
+  casheph_val_t val = { 1200, 100 };
+  casheph_gdate_t date = { 2012, 12, 4 };
+  casheph_wval_t bal;
+  casheph_account_balance_at (ce, checking, 1354838400, &bal);
+  if (batch)
+    {
+      casheph_begin (ce);
+    }
+  *added = casheph_add_simple_trn (ce, checking, expenses, &date, &val, "Marked");
+  casheph_remove_trn (ce, "75fe0a336df6675568885a8cd7c582a8");
+  int n = casheph_account_mark_reconciled (ce, checking, 1356998400);
+  if (batch)
+    {
+      casheph_commit (ce);
+    }
+  return n;
+}
+
+bool
+marking_reconciled_in_a_batch ()
+{
+  setenv ("TZ", "UTC+0", 1);
+  casheph_t *ce = casheph_open ("test.gnucash");
+  casheph_t *ce2 = casheph_open ("test.gnucash");
+  casheph_transaction_t *plain, *batched;
+  int n = mark_after_adding (ce, false, &plain);
+  int n2 = mark_after_adding (ce2, true, &batched);
+  casheph_wval_t rec, rec2;
+  casheph_account_reconcile_balance (ce, get_checking (ce),
+                                     ce_mask_reconciled, &rec);
+  casheph_account_reconcile_balance (ce2, get_checking (ce2),
+                                     ce_mask_reconciled, &rec2);
+  return (n > 0 && n2 == n && rec.n == rec2.n && rec.d == rec2.d
+          && batched->splits[1]->reconciled_state == ce_reconciled);
+}
+
+bool
+adding_moving_and_removing_accounts ()
+{
+  casheph_t *ce = casheph_open ("test.gnucash");
+  casheph_account_t *expenses;
+  expenses = casheph_get_account_by_path (ce, "Expenses");
+  casheph_account_t *groceries;
+  groceries = casheph_get_account_by_path (ce, "Expenses:Groceries");
+  if (expenses == NULL || groceries == NULL
+      || groceries != casheph_account_get_account_by_name (expenses, "Groceries")
+      || casheph_add_account (ce, expenses, "Groceries", "EXPENSE", NULL) != NULL)
+    {
+      return false;
+    }
+  casheph_account_t *travel;
+  travel = casheph_add_account (ce, expenses, "Travel", "EXPENSE", NULL);
+  casheph_account_t *fuel;
+  fuel = casheph_add_account (ce, travel, "Fuel", "EXPENSE", NULL);
+  if (casheph_get_account (ce, fuel->id) != fuel
+      || casheph_get_account_by_path (ce, "Expenses:Travel:Fuel") != fuel
+      || casheph_move_account (ce, expenses, fuel))
+    {
+      return false;
+    }
+  /* Undone moves and removals put everything back. */
+  casheph_begin (ce);
+  casheph_move_account (ce, travel, ce->root);
+  casheph_remove_account (ce, travel->id, true);
+  if (casheph_get_account_by_path (ce, "Fuel") != fuel)
+    {
+      return false;
+    }
+  casheph_rollback (ce);
+  if (casheph_get_account_by_path (ce, "Expenses:Travel:Fuel") != fuel
+      || casheph_get_account_by_path (ce, "Travel") != NULL
+      || expenses->accounts[expenses->n_accounts - 1] != travel)
+    {
+      return false;
+    }
+  casheph_move_account (ce, travel, ce->root);
+  if (casheph_get_account_by_path (ce, "Travel:Fuel") != fuel
+      || casheph_get_account_by_path (ce, "Expenses:Travel") != NULL
+      || casheph_remove_account (ce, groceries->id, false))
+    {
+      return false;
+    }
+  casheph_remove_account (ce, travel->id, true);
+  if (casheph_get_account_by_path (ce, "Fuel") != fuel
+      || casheph_get_account_by_path (ce, "Travel") != NULL)
+    {
+      return false;
+    }
+  casheph_save (ce, "accounts.gnucash");
+  casheph_t *ce2 = casheph_open ("accounts.gnucash");
+  system ("rm accounts.gnucash");
+  casheph_account_t *fuel2 = casheph_get_account_by_path (ce2, "Fuel");
+  return (fuel2 != NULL && strcmp (fuel2->id, fuel->id) == 0
+          && strcmp (fuel2->commodity->id, expenses->commodity->id) == 0
+          && casheph_get_account_by_path (ce2, "Expenses:Groceries") != NULL);
+}
+
 #define CE_TEST(r, f, s) r = r && test (f, s)
 
 int
@@ -717,5 +2022,61 @@ main (int argc, char *argv[])
            "Adding a simple transaction (A->B) works [test.gnucash]");
   CE_TEST (res, get_account_by_id,
            "You can retrieve an account by ID [test.gnucash]");
+  CE_TEST (res, balance_at_date,
+           "Account balances as of a date are correct [test.gnucash]");
+  CE_TEST (res, balance_at_date_after_add_and_remove,
+           "Balances as of a date follow adds and removes [test.gnucash]");
+  CE_TEST (res, report_sums_per_account_and_period,
+           "Reports sum each account per period [test.gnucash]");
+  CE_TEST (res, search_descriptions_and_slots,
+           "Searching descriptions finds the right transactions [test.gnucash]");
+  CE_TEST (res, filtered_open_keeps_matching_transactions,
+           "Opening with a filter keeps only matching transactions [test.gnucash]");
+  CE_TEST (res, register_rows_in_date_order,
+           "Account registers list splits in date order with balances [test.gnucash]");
+  CE_TEST (res, reconciling_up_to_a_date,
+           "Reconciling up to a date updates balances and is saved [test.gnucash]");
+  CE_TEST (res, wide_values_do_checked_arithmetic,
+           "Wide values parse, format and detect overflow");
+  CE_TEST (res, period_sums_and_series,
+           "Per-period totals combine day and month buckets [test.gnucash]");
+  CE_TEST (res, batch_transaction_lookup,
+           "Looking up many transaction IDs at once works [test.gnucash]");
+  CE_TEST (res, saving_large_book_round_trips,
+           "Saving a large book and opening it again works [test.gnucash]");
+  CE_TEST (res, saving_with_options,
+           "Saving with options writes plain or compressed files [test.gnucash]");
+  CE_TEST (res, saving_with_parallel_compression,
+           "Compressing in parallel gives an ordinary gzip file [test.gnucash]");
+  CE_TEST (res, saving_reuses_untouched_fragments,
+           "Saving reuses the XML of untouched transactions [test.gnucash]");
+  CE_TEST (res, journal_replays_and_compacts,
+           "The journal is replayed on open and emptied by compaction [test.gnucash]");
+  CE_TEST (res, formatting_timestamps,
+           "Timestamps are formatted with the right UTC offset");
+  CE_TEST (res, saving_in_the_background,
+           "Saving in the background writes the book as it was [test.gnucash]");
+  CE_TEST (res, opening_from_binary_cache,
+           "Opening uses the binary cache while it matches the file [test3.gnucash]");
+  CE_TEST (res, saving_unchanged_book_is_skipped,
+           "Saving an unchanged book does not rewrite the file [test.gnucash]");
+  CE_TEST (res, exporting_changes_since_checkpoint,
+           "Exporting a delta writes only what changed since a checkpoint [test.gnucash]");
+  CE_TEST (res, adding_transactions_in_a_batch,
+           "Adding a batch of transactions indexes all of them [test.gnucash]");
+  CE_TEST (res, building_multi_split_transactions,
+           "Building a transaction split by split [test.gnucash]");
+  CE_TEST (res, removing_transactions_in_bulk,
+           "Removing transactions by ID and by predicate [test.gnucash]");
+  CE_TEST (res, making_guids_from_threads,
+           "GUIDs made on several threads are distinct");
+  CE_TEST (res, rolling_back_and_committing_batches,
+           "Edit batches roll back and commit [test.gnucash]");
+  CE_TEST (res, marking_reconciled_in_a_batch,
+           "Marking reconciled in a batch sees the batch's own changes [test.gnucash]");
+  CE_TEST (res, adding_moving_and_removing_accounts,
+           "Adding, moving and removing accounts keeps lookups right [test.gnucash]");
+  CE_TEST (res, aggregates_fail_on_overflow,
+           "Balances and reports fail rather than overflow [test.gnucash]");
   return res?0:1;
 }